@@ -0,0 +1,200 @@
+/******************************************************************************
+ * ac.c
+ *
+ * pdfsearch - Search PDF text-contents from shell
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of pdfsearch.
+ * pdfsearch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pdfsearch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pdfsearch.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Aho-Corasick: The patterns are built into a trie, then the trie is completed
+ * into a DFA (every state has a transition for every byte class, following the
+ * failure links) so scanning is one table lookup per byte.  Bytes are mapped to
+ * classes first, bytes in no pattern all sharing one, which keeps the table
+ * small with thousands of patterns.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "search.h"
+
+
+/* Byte classes: Bytes in no pattern, whitespace (skipped: it stays in the
+ * same state), then one for each distinct byte of the patterns
+ */
+#define CLASS_OTHER 0
+#define CLASS_SKIP  1
+
+
+static _Bool grow(ac_t *ac, int *max_states)
+{
+    int *tmp, max = *max_states * 2;
+
+#define GROW(_a, _n) \
+    if (!(tmp = realloc(ac->_a, sizeof(int) * (_n)))) \
+      return false; \
+    ac->_a = tmp;
+
+    GROW(delta, max * ac->n_classes);
+    GROW(term, max);
+#undef GROW
+
+    memset(ac->delta + *max_states * ac->n_classes, 0,
+           sizeof(int) * (max - *max_states) * ac->n_classes);
+    *max_states = max;
+    return true;
+}
+
+
+ac_t *ac_new(const char *const *patterns, int n_patterns)
+{
+    int i, k, s, t, head, tail, max_states = 64, *queue;
+    const char *p;
+    ac_t *ac;
+
+    if (!(ac = calloc(1, sizeof(ac_t))))
+      return NULL;
+    ac->n_patterns = n_patterns;
+
+    /* Byte classes */
+    ac->classes[' '] = ac->classes['\t'] = CLASS_SKIP;
+    ac->n_classes = CLASS_SKIP + 1;
+    for (i=0; i<n_patterns; ++i)
+      for (p=patterns[i]; *p; ++p)
+        if (!ac->classes[(unsigned char)*p])
+          ac->classes[(unsigned char)*p] = ac->n_classes++;
+
+    /* Trie (0 means no transition yet, nothing goes back to the root) */
+    ac->n_states = 1;
+    ac->delta = calloc(max_states * ac->n_classes, sizeof(int));
+    ac->term = malloc(sizeof(int) * max_states);
+    ac->next = malloc(sizeof(int) * (n_patterns ? n_patterns : 1));
+    if (!ac->delta || !ac->term || !ac->next)
+    {
+        ac_destroy(ac);
+        return NULL;
+    }
+    ac->term[0] = -1;
+
+    for (i=0; i<n_patterns; ++i)
+    {
+        s = 0;
+        for (p=patterns[i]; *p; ++p)
+        {
+            if ((k = ac->classes[(unsigned char)*p]) == CLASS_SKIP)
+              continue;
+            if (!(t = ac->delta[s * ac->n_classes + k]))
+            {
+                if (ac->n_states == max_states && !grow(ac, &max_states))
+                {
+                    ac_destroy(ac);
+                    return NULL;
+                }
+                t = ac->delta[s * ac->n_classes + k] = ac->n_states++;
+                ac->term[t] = -1;
+            }
+            s = t;
+        }
+
+        /* Empty patterns end at the root, which is never reported */
+        ac->next[i] = ac->term[s];
+        ac->term[s] = i;
+    }
+
+    /* Complete the trie breadth first: A state's failure link (and so its
+     * missing transitions) only depends on shallower states.
+     */
+    ac->fail = calloc(ac->n_states, sizeof(int));
+    ac->report = calloc(ac->n_states, sizeof(int));
+    queue = malloc(sizeof(int) * ac->n_states);
+    if (!ac->fail || !ac->report || !queue)
+    {
+        free(queue);
+        ac_destroy(ac);
+        return NULL;
+    }
+
+    head = tail = 0;
+    queue[tail++] = 0;
+    while (head < tail)
+    {
+        s = queue[head++];
+        for (k=0; k<ac->n_classes; ++k)
+        {
+            t = ac->delta[s * ac->n_classes + k];
+            if (k == CLASS_SKIP)
+              ac->delta[s * ac->n_classes + k] = s;
+            else if (t)
+            {
+                ac->fail[t] = s ? ac->delta[ac->fail[s] * ac->n_classes + k]
+                                : 0;
+                ac->report[t] = (ac->term[t] >= 0) ? t
+                                                   : ac->report[ac->fail[t]];
+                queue[tail++] = t;
+            }
+            else if (s)
+              ac->delta[s * ac->n_classes + k] =
+                  ac->delta[ac->fail[s] * ac->n_classes + k];
+        }
+    }
+
+    free(queue);
+    return ac;
+}
+
+
+void ac_destroy(ac_t *ac)
+{
+    if (!ac)
+      return;
+    free(ac->delta);
+    free(ac->fail);
+    free(ac->report);
+    free(ac->term);
+    free(ac->next);
+    free(ac);
+}
+
+
+/* Report every pattern ending at state 's' */
+static void report(const ac_t *ac, int s, ac_hit_cb hit, void *arg)
+{
+    int i;
+
+    for (s=ac->report[s]; s; s=ac->report[ac->fail[s]])
+      for (i=ac->term[s]; i>=0; i=ac->next[i])
+        hit(arg, i);
+}
+
+
+int ac_scan(const ac_t *ac, int state, const char *text, size_t len,
+            ac_hit_cb hit, void *arg)
+{
+    size_t i;
+    const int *delta = ac->delta, *rep = ac->report;
+    const int n_classes = ac->n_classes;
+    const unsigned char *classes = ac->classes;
+
+    for (i=0; i<len; ++i)
+    {
+        state = delta[state * n_classes + classes[(unsigned char)text[i]]];
+        if (rep[state])
+          report(ac, state, hit, arg);
+    }
+
+    return state;
+}
@@ -0,0 +1,251 @@
+/******************************************************************************
+ * cache.c
+ *
+ * libnachopdf - A basic PDF text extraction library
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Per-document cache of decoded streams, keyed by object id.  Streams are kept
+ * on a list in most recently used order and the least recently used ones are
+ * evicted once the cache holds more than its byte budget.
+ *
+ * A stream handed out by stream_cache_get stays valid until it is released,
+ * even if it is evicted in the meantime: eviction only unlinks it, and the
+ * last user to release it frees it.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "pdf.h"
+
+
+static void free_stream(cached_stream_t *cs)
+{
+    free(cs->data);
+    free(cs);
+}
+
+
+/* Take 'cs' off of the LRU list (cache locked) */
+static void list_remove(stream_cache_t *cache, cached_stream_t *cs)
+{
+    if (cs->prev)
+      cs->prev->next = cs->next;
+    else
+      cache->head = cs->next;
+    if (cs->next)
+      cs->next->prev = cs->prev;
+    else
+      cache->tail = cs->prev;
+    cs->prev = cs->next = NULL;
+}
+
+
+/* Remove 'cs' from the cache (cache locked) */
+static void unlink_stream(stream_cache_t *cache, cached_stream_t *cs)
+{
+    list_remove(cache, cs);
+    cache->by_id[cs->id] = NULL;
+    cache->used -= cs->len;
+    --cache->n_streams;
+}
+
+
+/* Make 'cs' the most recently used stream (cache locked) */
+static void push_front(stream_cache_t *cache, cached_stream_t *cs)
+{
+    cs->prev = NULL;
+    cs->next = cache->head;
+    if (cache->head)
+      cache->head->prev = cs;
+    cache->head = cs;
+    if (!cache->tail)
+      cache->tail = cs;
+}
+
+
+/* Evict least recently used streams until the cache is within its budget
+ * (cache locked).  Streams still in use are freed when they are released.
+ */
+static void evict(stream_cache_t *cache)
+{
+    cached_stream_t *cs;
+
+    while (cache->used > cache->budget && (cs = cache->tail))
+    {
+        unlink_stream(cache, cs);
+        cs->is_evicted = true;
+        ++cache->evictions;
+        if (cs->refs == 0)
+          free_stream(cs);
+    }
+}
+
+
+int pdf_set_stream_cache(pdf_t *pdf, size_t budget)
+{
+    cached_stream_t *cs;
+    stream_cache_t *cache = pdf->stream_cache;
+
+    /* Disable: Nothing can be in use, so just free it all */
+    if (budget == 0)
+    {
+        if (!cache)
+          return PDF_OK;
+        while ((cs = cache->head))
+        {
+            unlink_stream(cache, cs);
+            free_stream(cs);
+        }
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->by_id);
+        free(cache);
+        pdf->stream_cache = NULL;
+        return PDF_OK;
+    }
+
+    /* Resize */
+    if (cache)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->budget = budget;
+        evict(cache);
+        pthread_mutex_unlock(&cache->lock);
+        return PDF_OK;
+    }
+
+    /* Enable */
+    if (!(cache = calloc(1, sizeof(stream_cache_t))))
+      return PDF_ERR;
+    if (!(cache->by_id = calloc(pdf->n_objects, sizeof(cached_stream_t *))))
+    {
+        free(cache);
+        return PDF_ERR;
+    }
+    cache->budget = budget;
+    pthread_mutex_init(&cache->lock, NULL);
+    pdf->stream_cache = cache;
+    return PDF_OK;
+}
+
+
+void pdf_get_stream_cache_stats(const pdf_t *pdf, pdf_cache_stats_t *stats)
+{
+    stream_cache_t *cache = pdf->stream_cache;
+
+    memset(stats, 0, sizeof(pdf_cache_stats_t));
+    if (!cache)
+      return;
+
+    pthread_mutex_lock(&cache->lock);
+    stats->budget = cache->budget;
+    stats->used = cache->used;
+    stats->n_streams = cache->n_streams;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+/* Look 'id' up and take a reference to it (cache locked) */
+static cached_stream_t *lookup(stream_cache_t *cache, off_t id)
+{
+    cached_stream_t *cs;
+
+    if (!(cs = cache->by_id[id]))
+      return NULL;
+
+    ++cs->refs;
+    if (cs != cache->head)
+    {
+        list_remove(cache, cs);
+        push_front(cache, cs);
+    }
+    return cs;
+}
+
+
+const cached_stream_t *stream_cache_get(
+    const pdf_t    *pdf,
+    const stream_t *stream)
+{
+    char *data;
+    size_t len;
+    cached_stream_t *cs;
+    stream_cache_t *cache = pdf->stream_cache;
+
+    if (!cache || stream->id <= 0 || stream->id >= pdf->n_objects)
+      return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if ((cs = lookup(cache, stream->id)))
+      ++cache->hits;
+    else
+      ++cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+    if (cs)
+      return cs;
+
+    /* Decode without holding the lock, so other streams can be served */
+    if (!(data = pdf_decode_stream(pdf, stream, &len)))
+      return NULL;
+    if (!(cs = calloc(1, sizeof(cached_stream_t))))
+    {
+        free(data);
+        return NULL;
+    }
+    cs->id = stream->id;
+    cs->data = data;
+    cs->len = len;
+    cs->refs = 1;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->by_id[cs->id])
+    {
+        /* Another thread decoded it first, use theirs */
+        free_stream(cs);
+        cs = lookup(cache, stream->id);
+    }
+    else if (len > cache->budget)
+      cs->is_evicted = true; /* Never fits: Freed on release */
+    else
+    {
+        push_front(cache, cs);
+        cache->by_id[cs->id] = cs;
+        cache->used += len;
+        ++cache->n_streams;
+        evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return cs;
+}
+
+
+void stream_cache_release(const pdf_t *pdf, const cached_stream_t *stream)
+{
+    cached_stream_t *cs = (cached_stream_t *)stream;
+    stream_cache_t *cache = pdf->stream_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    if (--cs->refs == 0 && cs->is_evicted)
+      free_stream(cs);
+    pthread_mutex_unlock(&cache->lock);
+}
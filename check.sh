@@ -0,0 +1,269 @@
+#!/bin/sh
+#
+# check.sh - Check what pdfsearch finds against what grep finds ('make check')
+#
+# Usage: check.sh <dir> <file.pdf>...
+#
+# pdftext writes the text of each page of the pdfs to <dir>, and grep over it
+# says which pages each expression (-e) and each pattern (-f) is on.  pdfsearch
+# has to report the same pages, searching the pdfs themselves (with one thread
+# and with several), an index of them (-b/-q) and their sidecars (-s, both
+# writing and then reading them).  pdfsearch reads a pdf's sidecar whenever it
+# has one, so the sidecars are written for copies of the pdfs (in <dir>/sidecar)
+# and searching the pdfs themselves must not leave any behind.  As pdfsearch drops the spaces from an
+# expression, and -f skips spaces and tabs (in the patterns and the text), so
+# does what grep is given.
+#
+# Besides the expressions below, a literal is taken from text that straddles
+# pdfsearch's 16K decode buffers on a few of the pages, to check that matches
+# carry over from one buffer to the next.
+#
+# Before any of that, a few small pdfs with bad counts in them have to be
+# reported as not loading (PDF_ERR_FORMAT) rather than exited on.
+
+SEARCH=./pdfsearch
+PDFTEXT=./pdftext
+BUF_SIZE=16384
+
+dir=$1
+shift
+[ -n "$dir" ] && [ $# -gt 0 ] || { echo "Usage: $0 <dir> <file.pdf>..."; exit 1; }
+
+export LC_ALL=C
+n_checks=0
+n_found=0
+n_fails=0
+
+EXPRS='needle
+foo
+^the
+[[:space:]]bar$
+^(invoice|payment)[[:space:]][a-z]+[[:space:]](total|account)
+foo|bar|needle
+(an|the)d?[[:space:]][a-z]{2,3}[[:space:]]of
+(was|were)([[:space:]][a-z]+){2}[[:space:]](was|were)
+o{2}
+e.{3,5}t.r
+^.{70,}$
+^[^[:space:]]+$
+repor?t.a
+[[:digit:]]
+^$
+x{1,2}y
+(table|figure)[[:space:]](table|figure){1,2}
+tableof|figureof'
+
+PATTERNS='needle
+foo
+invoice total
+the of
+section section
+payment report
+zzz'
+
+
+# Text of page file $1 straddling the buffer boundary at $2: The 8 bytes either
+# side of it, if they are all on one line and the boundary splits a word
+boundary_literal()
+{
+    before=$(head -c $2 "$1" | tail -n 1 | tail -c 8)
+    after=$(tail -c +$(($2 + 1)) "$1" | head -n 1 | head -c 8)
+    [ ${#before} -eq 8 ] && [ ${#after} -eq 8 ] &&
+      [ "${before% }" = "$before" ] && [ "${after# }" = "$after" ] &&
+      printf '%s%s\n' "$before" "$after"
+}
+
+
+# The pages of pdf $1 whose text (or without spaces, if $4 is "-nospace") has
+# a line matching 'grep $2 -- $3'
+grep_pages()
+{
+    grep -l "$2" -- "$3" "$dir/$(basename "$1").text$4"/* |
+      sed 's|.*/||' | sort -n
+}
+
+
+# What pdfsearch -e $1 should print for the pdfs $2...
+expect_expr()
+{
+    e=$1
+    shift
+    for f in "$@"; do
+        grep_pages "$f" -E "$(printf '%s' "$e" | tr -d ' ')" |
+          sed "s|^|$f: Found match on page |"
+    done
+}
+
+
+# What pdfsearch -f $1 should print for the pdfs $2... (sorted, the patterns
+# found on a page are printed in the order they were found)
+expect_patterns()
+{
+    pats=$1
+    shift
+    for f in "$@"; do
+        while IFS= read -r p; do
+            grep_pages "$f" -F "$(printf '%s' "$p" | tr -d ' \t')" -nospace |
+              sed "s|^|$f: Found match on page |; s|\$|: $p|"
+        done < "$pats"
+    done | sort
+}
+
+
+# Compare what was expected ($2) with what pdfsearch printed ($3)
+check()
+{
+    n_checks=$((n_checks + 1))
+    if ! cmp -s "$2" "$3"; then
+        n_fails=$((n_fails + 1))
+        echo "FAIL: $1"
+        diff "$2" "$3" | head -n 10
+    fi
+}
+
+
+# Write a one page pdf to $1 with the page tree root's /Count $2, and its xref
+# table's subsection header $3 (e.g. "0 4")
+small_pdf()
+{
+    o1='1 0 obj << /Type /Catalog /Pages 2 0 R >> endobj
+'
+    o2="2 0 obj << /Type /Pages /Kids [3 0 R] /Count $2 >> endobj
+"
+    o3='3 0 obj << /Type /Page /Parent 2 0 R >> endobj
+'
+    hdr='%PDF-1.4
+'
+    at1=${#hdr}
+    at2=$((at1 + ${#o1}))
+    at3=$((at2 + ${#o2}))
+    {
+        printf '%s%s%s%s' "$hdr" "$o1" "$o2" "$o3"
+        printf 'xref\n%s\n0000000000 65535 f \n' "$3"
+        printf '%010d 00000 n \n' $at1 $at2 $at3
+        printf 'trailer << /Size 4 /Root 1 0 R >>\nstartxref\n%d\n%%%%EOF\n' \
+          $((at3 + ${#o3}))
+    } > "$1"
+}
+
+
+# pdftext on the pdf $2 should fail with the PDF_ERR_* code $3 (or load, if it
+# is 0), without exiting along the way
+check_load()
+{
+    n_checks=$((n_checks + 1))
+    rm -rf "$dir/bad" && mkdir "$dir/bad"
+    msg=$($PDFTEXT "$2" "$dir/bad" 2>&1)
+    case "$3:$?:$msg" in
+        0:0:|-?:1:*"(error $3)")
+            ;;
+        *)
+            n_fails=$((n_fails + 1))
+            echo "FAIL: $1"
+            echo "$msg" | head -n 10
+            ;;
+    esac
+}
+
+
+# Error paths: pdfs that cannot be loaded are reported, not exited on
+small_pdf "$dir/small.pdf" 1 "0 4"
+check_load "small pdf" "$dir/small.pdf" 0
+small_pdf "$dir/small.pdf" 99999999999 "0 4"
+check_load "huge /Count" "$dir/small.pdf" -3
+small_pdf "$dir/small.pdf" 5 "0 4"
+check_load "/Count past the objects" "$dir/small.pdf" -3
+small_pdf "$dir/small.pdf" 1 "0 999999999999"
+check_load "huge xref subsection" "$dir/small.pdf" -3
+small_pdf "$dir/small.pdf" 1 "0 -4"
+check_load "negative xref subsection" "$dir/small.pdf" -3
+
+# Page text
+for f in "$@"; do
+    t="$dir/$(basename "$f").text"
+    rm -rf "$t" "$t-nospace" "$f.pagetext"
+    mkdir -p "$t" "$t-nospace"
+    $PDFTEXT "$f" "$t" || exit 1
+    for p in "$t"/*; do
+        tr -d ' \t' < "$p" > "$t-nospace/${p##*/}"
+    done
+done
+
+# The boundary literals (a few of them, from the pages long enough to have any)
+lits=
+for f in "$@"; do
+    for p in "$dir/$(basename "$f").text"/*; do
+        size=$(wc -c < "$p")
+        at=$BUF_SIZE
+        while [ $((at + 8)) -le $size ]; do
+            l=$(boundary_literal "$p" $at)
+            [ -n "$l" ] && lits="$lits$l
+"
+            at=$((at + BUF_SIZE))
+        done
+    done
+done
+lits=$(printf '%s' "$lits" | sort -u | head -n 6)
+[ -n "$lits" ] || { echo "FAIL: No text straddles a buffer boundary"; exit 1; }
+
+printf '%s\n%s\n' "$PATTERNS" "$lits" > "$dir/patterns"
+lits=$(printf '%s\n' "$lits" | sed 's/ /[[:space:]]/g')
+printf '%s\n%s\n' "$EXPRS" "$lits" > "$dir/exprs"
+printf '%s\n' "$lits" | sed 's/.*/(&|zzz)/' >> "$dir/exprs"
+
+# The index, written once for all of the expressions
+$SEARCH "$@" -b "$dir/index" -j 4 > /dev/null || exit 1
+
+# The copies of the pdfs that get the sidecars (their names have no spaces)
+copies=
+rm -rf "$dir/sidecar" && mkdir "$dir/sidecar" || exit 1
+for f in "$@"; do
+    cp "$f" "$dir/sidecar/" || exit 1
+    copies="$copies $dir/sidecar/$(basename "$f")"
+done
+
+# -e: Each expression, over each pdf and all of them at once
+while IFS= read -r e; do
+    expect_expr "$e" "$@" > "$dir/expected"
+    [ -s "$dir/expected" ] && n_found=$((n_found + 1))
+
+    $SEARCH "$@" -e "$e" > "$dir/out"
+    check "-e '$e'" "$dir/expected" "$dir/out"
+
+    $SEARCH "$@" -e "$e" -j 4 > "$dir/out"
+    check "-e '$e' -j 4" "$dir/expected" "$dir/out"
+
+    $SEARCH -q "$dir/index" -e "$e" > "$dir/out"
+    check "-q -e '$e'" "$dir/expected" "$dir/out"
+
+    expect_expr "$e" $copies > "$dir/expected"
+    $SEARCH $copies -e "$e" -j 4 -s > "$dir/out"
+    check "-e '$e' -s" "$dir/expected" "$dir/out"
+done < "$dir/exprs"
+
+# -f: All of the patterns at once
+expect_patterns "$dir/patterns" "$@" > "$dir/expected"
+$SEARCH "$@" -f "$dir/patterns" -j 4 | sort > "$dir/out"
+check "-f" "$dir/expected" "$dir/out"
+$SEARCH -q "$dir/index" -f "$dir/patterns" | sort > "$dir/out"
+check "-q -f" "$dir/expected" "$dir/out"
+expect_patterns "$dir/patterns" $copies > "$dir/expected"
+$SEARCH $copies -f "$dir/patterns" -j 4 -s | sort > "$dir/out"
+check "-f -s" "$dir/expected" "$dir/out"
+
+# Only the copies have sidecars
+for f in "$@"; do
+    n_checks=$((n_checks + 1))
+    if [ -e "$f.pagetext" ]; then
+        n_fails=$((n_fails + 1))
+        echo "FAIL: Searching $f wrote $f.pagetext"
+    fi
+    n_checks=$((n_checks + 1))
+    if ! [ -s "$dir/sidecar/$(basename "$f").pagetext" ]; then
+        n_fails=$((n_fails + 1))
+        echo "FAIL: -s wrote no sidecar for $f"
+    fi
+done
+
+echo "$n_checks checks, $n_fails failed ($n_found of $(wc -l < "$dir/exprs") expressions match somewhere)"
+[ $n_fails -eq 0 ]
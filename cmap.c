@@ -0,0 +1,689 @@
+/******************************************************************************
+ * cmap.c
+ *
+ * libnachopdf - A basic PDF text extraction library
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* ToUnicode CMaps: The bfchar and bfrange mappings of a font's CMap are read
+ * and compiled into a table for one byte codes, or sorted ranges for two byte
+ * codes.  A CMap is loaded the first time its font is used and kept (in the
+ * pdf_t) for all of the pages using that font.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include "pdf.h"
+
+
+/* Longest hex string read (a mapping to 32 UTF-16 code units) */
+#define MAX_HEX 64
+
+
+/* Where a CMap being read is (between begin... and end...) */
+enum {IN_NONE, IN_CODESPACE, IN_BFCHAR, IN_BFRANGE};
+
+
+/* Tokens of a CMap */
+enum {TOK_END, TOK_HEX, TOK_ARRAY, TOK_ARRAY_END, TOK_WORD};
+
+
+/* A CMap being read: Its mappings as they are found, then compiled */
+typedef struct
+{
+    cmap_t *cmap;
+    int     max_ranges;
+    size_t  text_max;
+    int     codespace_bytes, src_bytes; /* Longest codes seen */
+} builder_t;
+
+
+typedef struct
+{
+    unsigned char hex[MAX_HEX];
+    int           n_hex;
+    const char   *word;
+    size_t        word_len;
+} token_t;
+
+
+static int hex_val(char c)
+{
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+}
+
+
+/* Read the next token at '*p', skipping whitespace and comments */
+static int next_token(const char **p, const char *end, token_t *tok)
+{
+    int v, hi = -1;
+    const char *c = *p;
+
+    for ( ;; )
+    {
+        while (c < end && isspace((unsigned char)*c))
+          ++c;
+        if (c < end && *c == '%')
+        {
+            while (c < end && *c != '\n' && *c != '\r')
+              ++c;
+            continue;
+        }
+        break;
+    }
+
+    if (c >= end)
+      return TOK_END;
+
+    /* <hex>, skipping dictionaries' "<<" and ">>" as words */
+    if (*c == '<' && c+1 < end && c[1] != '<')
+    {
+        tok->n_hex = 0;
+        for (++c; c<end && *c!='>'; ++c)
+        {
+            if ((v = hex_val(*c)) < 0)
+              continue;
+            if (hi < 0)
+              hi = v;
+            else
+            {
+                if (tok->n_hex < MAX_HEX)
+                  tok->hex[tok->n_hex++] = hi << 4 | v;
+                hi = -1;
+            }
+        }
+        if (hi >= 0 && tok->n_hex < MAX_HEX) /* Odd digit count: 0 follows */
+          tok->hex[tok->n_hex++] = hi << 4;
+        *p = (c < end) ? c + 1 : c;
+        return TOK_HEX;
+    }
+    if (*c == '[' || *c == ']')
+    {
+        *p = c + 1;
+        return (*c == '[') ? TOK_ARRAY : TOK_ARRAY_END;
+    }
+
+    /* Anything else: Up to the next delimiter (at least one character) */
+    tok->word = c;
+    for (++c; c<end && !isspace((unsigned char)*c) && !strchr("<>[]/%()", *c);
+         ++c)
+      ;
+    tok->word_len = c - tok->word;
+    *p = c;
+    return TOK_WORD;
+}
+
+
+static _Bool is_word(const token_t *tok, const char *word)
+{
+    return tok->word_len == strlen(word) &&
+           memcmp(tok->word, word, tok->word_len) == 0;
+}
+
+
+static unsigned get_code(const token_t *tok)
+{
+    int i;
+    unsigned code = 0;
+
+    for (i=0; i<tok->n_hex && i<4; ++i)
+      code = code << 8 | tok->hex[i];
+    return code;
+}
+
+
+/* Append code point 'cp' to 'out' as UTF-8, returns its length */
+static int put_utf8(char *out, unsigned cp)
+{
+    if (cp < 0x80)
+    {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800)
+    {
+        out[0] = 0xC0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000)
+    {
+        out[0] = 0xE0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3F);
+    out[2] = 0x80 | (cp >> 6 & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+
+/* Code points of the UTF-16BE string 'utf16' into 'cps', returns how many */
+static int get_code_points(const unsigned char *utf16, int len, unsigned *cps)
+{
+    int i, n = 0;
+    unsigned u, lo;
+
+    for (i=0; i+1<len; i+=2)
+    {
+        u = utf16[i] << 8 | utf16[i+1];
+        if (u >= 0xD800 && u < 0xDC00 && i+3 < len)
+        {
+            lo = utf16[i+2] << 8 | utf16[i+3];
+            if (lo >= 0xDC00 && lo < 0xE000)
+            {
+                u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+        }
+        cps[n++] = u;
+    }
+
+    return n;
+}
+
+
+static cmap_range_t *add_range(builder_t *b)
+{
+    cmap_range_t *tmp;
+    cmap_t *cmap = b->cmap;
+
+    if (cmap->n_ranges == b->max_ranges)
+    {
+        b->max_ranges = b->max_ranges ? b->max_ranges * 2 : 64;
+        if (!(tmp = realloc(cmap->ranges, sizeof(cmap_range_t)*b->max_ranges)))
+          return NULL;
+        cmap->ranges = tmp;
+    }
+
+    return &cmap->ranges[cmap->n_ranges++];
+}
+
+
+/* Add the UTF-8 text of code points 'cps' to the CMap's text, returns where
+ * it starts (or -1 if out of memory)
+ */
+static long add_text(builder_t *b, const unsigned *cps, int n_cps)
+{
+    int i;
+    char *tmp;
+    size_t off, max;
+    cmap_t *cmap = b->cmap;
+
+    if (cmap->text_len + n_cps * 4 > b->text_max)
+    {
+        for (max=b->text_max ? b->text_max : 1024;
+             max<cmap->text_len+n_cps*4; )
+          max *= 2;
+        if (!(tmp = realloc(cmap->text, max)))
+          return -1;
+        cmap->text = tmp;
+        b->text_max = max;
+    }
+
+    off = cmap->text_len;
+    for (i=0; i<n_cps; ++i)
+      cmap->text_len += put_utf8(cmap->text + cmap->text_len, cps[i]);
+    if (cmap->text_len - off > cmap->max_len)
+      cmap->max_len = cmap->text_len - off;
+    return off;
+}
+
+
+/* Map codes 'lo' to 'hi' to the UTF-16BE string 'dst': The last code point of
+ * it is incremented for each code after 'lo'.
+ */
+static void add_mapping(
+    builder_t           *b,
+    unsigned             lo,
+    unsigned             hi,
+    const unsigned char *dst,
+    int                  dst_len)
+{
+    long off;
+    unsigned code, cps[MAX_HEX / 2];
+    int n_cps;
+    cmap_range_t *r;
+
+    if (hi < lo || hi - lo > 0xFFFF ||
+        (n_cps = get_code_points(dst, dst_len, cps)) == 0)
+      return;
+
+    /* One code point each: A range */
+    if (n_cps == 1)
+    {
+        if ((r = add_range(b)))
+        {
+            r->lo = lo;
+            r->hi = hi;
+            r->uni = cps[0];
+            r->off = r->len = 0;
+        }
+        return;
+    }
+
+    /* A string each (e.g. ligatures) */
+    for (code=lo; code<=hi; ++code, ++cps[n_cps-1])
+    {
+        if ((off = add_text(b, cps, n_cps)) < 0 || !(r = add_range(b)))
+          return;
+        r->lo = r->hi = code;
+        r->uni = 0;
+        r->off = off;
+        r->len = b->cmap->text_len - off;
+    }
+}
+
+
+/* Read the mappings of CMap 'data' */
+static void parse_cmap(builder_t *b, const char *data, size_t len)
+{
+    int t, in = IN_NONE, n_ops = 0;
+    _Bool in_array = false;
+    unsigned lo = 0, hi = 0, code = 0;
+    token_t tok;
+    const char *p = data, *end = data + len;
+
+    while ((t = next_token(&p, end, &tok)) != TOK_END)
+    {
+        if (t == TOK_WORD)
+        {
+            if (is_word(&tok, "begincodespacerange"))
+              in = IN_CODESPACE;
+            else if (is_word(&tok, "beginbfchar"))
+              in = IN_BFCHAR;
+            else if (is_word(&tok, "beginbfrange"))
+              in = IN_BFRANGE;
+            else if (tok.word_len > 3 && memcmp(tok.word, "end", 3) == 0)
+              in = IN_NONE;
+            n_ops = 0;
+            continue;
+        }
+
+        /* A bfrange's destinations can be an array, one for each code */
+        if (t == TOK_ARRAY || t == TOK_ARRAY_END)
+        {
+            in_array = (t == TOK_ARRAY && in == IN_BFRANGE && n_ops == 2);
+            code = lo;
+            n_ops = 0;
+            continue;
+        }
+
+        switch (in)
+        {
+            /* <lo> <hi> */
+            case IN_CODESPACE:
+                if (tok.n_hex > b->codespace_bytes)
+                  b->codespace_bytes = tok.n_hex;
+                break;
+
+            /* <src> <dst> */
+            case IN_BFCHAR:
+                if (n_ops++ == 0)
+                {
+                    lo = get_code(&tok);
+                    if (tok.n_hex > b->src_bytes)
+                      b->src_bytes = tok.n_hex;
+                }
+                else
+                {
+                    add_mapping(b, lo, lo, tok.hex, tok.n_hex);
+                    n_ops = 0;
+                }
+                break;
+
+            /* <lo> <hi> <dst> or <lo> <hi> [<dst> <dst> ...] */
+            case IN_BFRANGE:
+                if (in_array)
+                {
+                    if (code <= hi)
+                      add_mapping(b, code, code, tok.hex, tok.n_hex);
+                    ++code;
+                }
+                else if (n_ops == 0)
+                {
+                    lo = get_code(&tok);
+                    if (tok.n_hex > b->src_bytes)
+                      b->src_bytes = tok.n_hex;
+                    n_ops = 1;
+                }
+                else if (n_ops == 1)
+                {
+                    hi = get_code(&tok);
+                    n_ops = 2;
+                }
+                else
+                {
+                    add_mapping(b, lo, hi, tok.hex, tok.n_hex);
+                    n_ops = 0;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+
+/* Next code from 'code' on that no range has been given yet ('next' leads
+ * past runs of given codes, and is shortened as it is followed)
+ */
+static unsigned next_free(unsigned *next, unsigned code)
+{
+    unsigned root, tmp;
+
+    for (root=code; next[root]!=root; root=next[root])
+      ;
+    for ( ; next[code]!=root; code=tmp)
+    {
+        tmp = next[code];
+        next[code] = root;
+    }
+    return root;
+}
+
+
+/* Two byte codes: Split the ranges so that none overlap, the mapping read
+ * last winning where they do (as it does for one byte codes), in order of
+ * their codes.  Each code goes to the last range that has it: Ranges are
+ * gone through from the last, each taking the codes no later one took.
+ * Returns 'false' if out of memory.
+ */
+static _Bool flatten_ranges(cmap_t *cmap)
+{
+    int i, n = 0, *owner;
+    unsigned code, end, hi, *next;
+    cmap_range_t *ranges, *r;
+
+    owner = malloc(sizeof(int) * 0x10000);
+    next = malloc(sizeof(unsigned) * 0x10001);
+    ranges = malloc(sizeof(cmap_range_t) * 2 * cmap->n_ranges);
+    if (!owner || !next || !ranges)
+    {
+        free(owner);
+        free(next);
+        free(ranges);
+        return false;
+    }
+
+    for (code=0; code<0x10000; ++code)
+    {
+        owner[code] = -1;
+        next[code] = code;
+    }
+    next[0x10000] = 0x10000;
+
+    for (i=cmap->n_ranges-1; i>=0; --i)
+    {
+        r = &cmap->ranges[i];
+        hi = (r->hi > 0xFFFF) ? 0xFFFF : r->hi;
+        if (r->lo > hi)
+          continue;
+        for (code=next_free(next, r->lo); code<=hi;
+             code=next_free(next, code+1))
+        {
+            owner[code] = i;
+            next[code] = code + 1;
+        }
+    }
+
+    /* Each run of codes from the same range is a range (range ends are where
+     * runs can change, so there are at most twice as many)
+     */
+    for (code=0; code<0x10000; code=end)
+    {
+        for (end=code+1; end<0x10000 && owner[end]==owner[code]; ++end)
+          ;
+        if (owner[code] < 0)
+          continue;
+        r = &ranges[n++];
+        *r = cmap->ranges[owner[code]];
+        if (!r->len)
+          r->uni += code - r->lo;
+        r->lo = code;
+        r->hi = end - 1;
+    }
+
+    free(owner);
+    free(next);
+    free(cmap->ranges);
+    cmap->ranges = ranges;
+    cmap->n_ranges = n;
+    return true;
+}
+
+
+/* Make the mappings read into lookup tables */
+static void compile_cmap(builder_t *b)
+{
+    int i;
+    long off;
+    unsigned code, cp;
+    cmap_range_t *r;
+    cmap_t *cmap = b->cmap;
+
+    cmap->code_bytes = b->codespace_bytes ? b->codespace_bytes : b->src_bytes;
+    if (cmap->n_ranges == 0 || cmap->code_bytes > 2)
+    {
+        cmap->code_bytes = 0; /* Nothing we can use */
+        free(cmap->ranges);
+        cmap->ranges = NULL;
+        cmap->n_ranges = 0;
+        return;
+    }
+    if (cmap->max_len < 4)
+      cmap->max_len = 4;
+
+    if (cmap->code_bytes == 2)
+    {
+        if (!flatten_ranges(cmap))
+        {
+            cmap->code_bytes = 0;
+            free(cmap->ranges);
+            cmap->ranges = NULL;
+            cmap->n_ranges = 0;
+        }
+        return;
+    }
+
+    /* One byte codes: Look each up directly */
+    for (i=0; i<cmap->n_ranges; ++i)
+    {
+        r = &cmap->ranges[i];
+        for (code=r->lo; code<=r->hi && code<256; ++code)
+        {
+            if (r->len)
+              cmap->direct[code] = r->off << 8 | r->len;
+            else
+            {
+                cp = r->uni + (code - r->lo);
+                if ((off = add_text(b, &cp, 1)) < 0)
+                  break;
+                cmap->direct[code] = off << 8 | (cmap->text_len - off);
+            }
+        }
+    }
+    free(cmap->ranges);
+    cmap->ranges = NULL;
+    cmap->n_ranges = 0;
+}
+
+
+/* Load the ToUnicode CMap of font object 'font_id' (cmap_lock held) */
+static cmap_t *load_cmap(const pdf_t *pdf, off_t font_id)
+{
+    char *data;
+    size_t len;
+    obj_t obj;
+    stream_t stream;
+    iter_t *itr;
+    builder_t b;
+
+    memset(&b, 0, sizeof(builder_t));
+    if (!(b.cmap = calloc(1, sizeof(cmap_t))))
+      return NULL;
+
+    /* No ToUnicode (or it is a name, e.g. /Identity-H): Strings are text */
+    itr = iter_new(pdf);
+    if (!pdf_get_object(pdf, font_id, &obj) ||
+        !find_value_in_object(itr, obj, "/ToUnicode") ||
+        !ITR_IN_BOUNDS(itr) || !isdigit(ITR_VAL(itr)) ||
+        !pdf_get_stream(pdf, ITR_VAL_INT(itr), &stream) ||
+        !(data = pdf_decode_stream(pdf, &stream, &len)))
+    {
+        iter_destroy(itr);
+        return b.cmap;
+    }
+    iter_destroy(itr);
+
+    parse_cmap(&b, data, len);
+    compile_cmap(&b);
+    free(data);
+
+    D("Font %lu: ToUnicode CMap of %d byte codes", font_id,
+      b.cmap->code_bytes);
+    return b.cmap;
+}
+
+
+const cmap_t *font_cmap_get(const pdf_t *pdf, off_t font_id)
+{
+    cmap_t *cmap;
+    pdf_t *p = (pdf_t *)pdf;
+
+    if (font_id <= 0 || font_id >= pdf->n_objects)
+      return NULL;
+
+    pthread_mutex_lock(&p->cmap_lock);
+    if (!p->cmaps)
+      p->cmaps = calloc(pdf->n_objects, sizeof(cmap_t *));
+    if (!p->cmaps)
+      cmap = NULL;
+    else if (!(cmap = p->cmaps[font_id]))
+      cmap = p->cmaps[font_id] = load_cmap(pdf, font_id);
+    pthread_mutex_unlock(&p->cmap_lock);
+
+    return cmap;
+}
+
+
+/* Text that two byte 'code' maps to, into 'buf' if it is a code point */
+static const char *lookup(const cmap_t *cmap, unsigned code, char *buf,
+                          size_t *len)
+{
+    int lo = 0, hi = cmap->n_ranges - 1, mid;
+    const cmap_range_t *r;
+
+    /* Last range starting at or before 'code' (they do not overlap) */
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (cmap->ranges[mid].lo <= code)
+          lo = mid;
+        else
+          hi = mid - 1;
+    }
+
+    r = &cmap->ranges[lo];
+    if (code < r->lo || code > r->hi)
+    {
+        *len = 0;
+        return NULL;
+    }
+    if (r->len)
+    {
+        *len = r->len;
+        return cmap->text + r->off;
+    }
+    *len = put_utf8(buf, r->uni + (code - r->lo));
+    return buf;
+}
+
+
+size_t cmap_map(const cmap_t *cmap, const char *in, size_t len,
+                char **out, size_t *out_max, size_t *n_codes)
+{
+    char *tmp, buf[4];
+    const char *text;
+    size_t i, n, max, used = 0;
+    unsigned code, d;
+    const unsigned char *s = (const unsigned char *)in;
+
+    *n_codes = len / cmap->code_bytes;
+    if ((max = *n_codes * cmap->max_len) > *out_max)
+    {
+        if (!(tmp = realloc(*out, max)))
+          return 0;
+        *out = tmp;
+        *out_max = max;
+    }
+
+    if (cmap->code_bytes == 1)
+    {
+        for (i=0; i<len; ++i)
+        {
+            if ((d = cmap->direct[s[i]]))
+            {
+                memcpy(*out + used, cmap->text + (d >> 8), d & 0xFF);
+                used += d & 0xFF;
+            }
+            else if (s[i] < 0x80) /* Unmapped: ASCII is most likely right */
+              (*out)[used++] = s[i];
+        }
+        return used;
+    }
+
+    for (i=0; i+1<len; i+=2)
+    {
+        code = s[i] << 8 | s[i+1];
+        if ((text = lookup(cmap, code, buf, &n)))
+        {
+            memcpy(*out + used, text, n);
+            used += n;
+        }
+    }
+    return used;
+}
+
+
+void font_cmaps_free(pdf_t *pdf)
+{
+    off_t id;
+
+    for (id=0; pdf->cmaps && id<pdf->n_objects; ++id)
+      if (pdf->cmaps[id])
+      {
+          free(pdf->cmaps[id]->ranges);
+          free(pdf->cmaps[id]->text);
+          free(pdf->cmaps[id]);
+      }
+    free(pdf->cmaps);
+    pdf->cmaps = NULL;
+}
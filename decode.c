@@ -26,322 +26,1354 @@
 #include <ctype.h>
 #include <zlib.h>
 #include <math.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include "pdf.h"
 
 
-/* If the value idx is greater than the buffer size,
- * issue a callback to the decode listner.
- * 
- * 'buf_idx' -- Should have the current buffer size, it will be updated if the
- *              callback is issued.
+/* Bytes inflated at a time, unless the decode object says otherwise */
+#define DEFAULT_WINDOW_SIZE (64 * 1024)
+
+
+/* Streams that inflate to more than this are inflated a window at a time */
+#define MAX_WHOLE_SIZE (64 * 1024 * 1024)
+
+
+/* Copy decoded text into the user's buffer, calling back whenever it is full */
+static decode_exit_e emit(decode_t *decode, const char *text, size_t len)
+{
+    size_t n;
+
+    if (!decode->buffer)
+      return DECODE_CONTINUE; /* Only after text runs */
+
+    while (len)
+    {
+        if (decode->buffer_used >= decode->buffer_length)
+        {
+            STATS_ADD(decode->pdf, callbacks, 1);
+            if (decode->callback(decode) == DECODE_DONE ||
+                decode->buffer_used >= decode->buffer_length)
+              return DECODE_DONE;
+        }
+
+        n = decode->buffer_length - decode->buffer_used;
+        if (n > len)
+          n = len;
+        memcpy(decode->buffer + decode->buffer_used, text, n);
+        decode->buffer_used += n;
+        text += n;
+        len -= n;
+    }
+
+    return DECODE_CONTINUE;
+}
+
+
+static inline void stack_push(operand_stack_t *stack, double val)
+{
+    /* Full: Drop the oldest, operators use the most recent operands */
+    if (stack->n_vals == MAX_OPERANDS)
+    {
+        memmove(stack->vals, stack->vals + 1,
+                sizeof(double) * (MAX_OPERANDS - 1));
+        --stack->n_vals;
+    }
+    stack->vals[stack->n_vals++] = val;
+}
+
+
+/* Missing operands are 0 */
+static inline double stack_pop(operand_stack_t *stack)
+{
+    return stack->n_vals ? stack->vals[--stack->n_vals] : 0.0;
+}
+
+
+/*
+ * Content stream lexer: Splits decoded content stream data into tokens and
+ * runs the text operators on them.  A stream can be fed to it in any number
+ * of pieces, as everything it is in the middle of is kept in decode->lex.
+ */
+
+/* Byte classes */
+#define CL_SPACE  0x01 /* PDF whitespace                        */
+#define CL_DELIM  0x02 /* Ends a number, name or operator       */
+#define CL_STRING 0x04 /* Special within a literal string       */
+#define CL_EOL    0x08 /* Ends a comment                        */
+#define CL_HEX    0x10 /* Hex digit                             */
+#define CL_END    (CL_SPACE | CL_DELIM)
+
+static const unsigned char byte_class[256] =
+{
+    ['\0'] = CL_SPACE, ['\t'] = CL_SPACE, ['\f'] = CL_SPACE, [' '] = CL_SPACE,
+    ['\n'] = CL_SPACE | CL_EOL, ['\r'] = CL_SPACE | CL_EOL,
+    ['('] = CL_DELIM | CL_STRING, [')'] = CL_DELIM | CL_STRING,
+    ['\\'] = CL_STRING,
+    ['<'] = CL_DELIM, ['>'] = CL_DELIM, ['['] = CL_DELIM, [']'] = CL_DELIM,
+    ['{'] = CL_DELIM, ['}'] = CL_DELIM, ['/'] = CL_DELIM, ['%'] = CL_DELIM,
+    ['0'] = CL_HEX, ['1'] = CL_HEX, ['2'] = CL_HEX, ['3'] = CL_HEX,
+    ['4'] = CL_HEX, ['5'] = CL_HEX, ['6'] = CL_HEX, ['7'] = CL_HEX,
+    ['8'] = CL_HEX, ['9'] = CL_HEX,
+    ['a'] = CL_HEX, ['b'] = CL_HEX, ['c'] = CL_HEX, ['d'] = CL_HEX,
+    ['e'] = CL_HEX, ['f'] = CL_HEX,
+    ['A'] = CL_HEX, ['B'] = CL_HEX, ['C'] = CL_HEX, ['D'] = CL_HEX,
+    ['E'] = CL_HEX, ['F'] = CL_HEX,
+};
+
+
+/* What the lexer is in the middle of (lex_state_t.state) */
+enum
+{
+    LEX_SPACE,   /* Between tokens                                  */
+    LEX_REGULAR, /* Number or operator (into lex->tok)              */
+    LEX_NAME,    /* Name (into lex->tok)                            */
+    LEX_STRING,  /* Literal string (into lex->str)                  */
+    LEX_HEX,     /* Hex string (into lex->str)                      */
+    LEX_LT,      /* Read a '<': A hex string or the '<<' of a dict  */
+    LEX_GT,      /* Read a '>': Of the '>>' of a dict               */
+    LEX_COMMENT, /* Until the end of the line                       */
+    LEX_INLINE,  /* Inline image data, until "EI" (progress in depth) */
+};
+
+
+/* Escape sequence within a literal string (lex_state_t.esc) */
+enum {ESC_NONE, ESC_BACKSLASH, ESC_OCT1, ESC_OCT2, ESC_CR};
+
+
+/* Rough width of a glyph, in text space units (ems), for placing the text
+ * after a run: The fonts' glyph widths are not read.
  */
-static decode_exit_e cb_if_full(decode_t *decode, size_t *buf_idx)
+#define EST_GLYPH_WIDTH 0.5
+
+
+/* Matrices are [a b 0, c d 0, e f 1], stored as {a, b, c, d, e, f} */
+static void mat_identity(double *m)
+{
+    m[0] = m[3] = 1.0;
+    m[1] = m[2] = m[4] = m[5] = 0.0;
+}
+
+
+/* r = a x b ('r' can be either of them) */
+static void mat_mul(double *r, const double *a, const double *b)
+{
+    double t[6];
+
+    t[0] = a[0]*b[0] + a[1]*b[2];
+    t[1] = a[0]*b[1] + a[1]*b[3];
+    t[2] = a[2]*b[0] + a[3]*b[2];
+    t[3] = a[2]*b[1] + a[3]*b[3];
+    t[4] = a[4]*b[0] + a[5]*b[2] + b[4];
+    t[5] = a[4]*b[1] + a[5]*b[3] + b[5];
+    memcpy(r, t, sizeof(t));
+}
+
+
+/* Start over for a new page */
+static void text_reset(text_state_t *ts)
+{
+    memset(ts, 0, sizeof(text_state_t));
+    mat_identity(ts->Tm);
+    mat_identity(ts->Tlm);
+    mat_identity(ts->ctm);
+    ts->Th = 1.0;
+}
+
+
+/* Start a new line offset by (tx, ty) from the start of the current one */
+static void text_move(text_state_t *ts, double tx, double ty)
+{
+    ts->Tlm[4] += tx * ts->Tlm[0] + ty * ts->Tlm[2];
+    ts->Tlm[5] += tx * ts->Tlm[1] + ty * ts->Tlm[3];
+    memcpy(ts->Tm, ts->Tlm, sizeof(ts->Tm));
+}
+
+
+/* Hand the batch of text runs to the user and start a new one */
+static decode_exit_e flush_runs(decode_t *decode)
+{
+    decode_exit_e de = DECODE_CONTINUE;
+    text_runs_t *runs = decode->runs;
+
+    if (runs && runs->n_runs)
+    {
+        STATS_ADD(decode->pdf, callbacks, 1);
+        de = decode->run_callback(decode, runs);
+    }
+    if (runs)
+      runs->n_runs = runs->arena_used = 0;
+    return de;
+}
+
+
+/* Add a text run starting at the current text position */
+static decode_exit_e add_run(decode_t *decode, const char *text, size_t len)
 {
-    if (*buf_idx >= decode->buffer_length)
+    int i;
+    char *tmp;
+    size_t max;
+    double m[6];
+    text_runs_t *runs = decode->runs;
+    const text_state_t *ts = &decode->text;
+
+    if (!runs && !(runs = decode->runs = calloc(1, sizeof(text_runs_t))))
+      return DECODE_CONTINUE; /* Drop it, it is only text */
+
+    if (runs->arena_used + len > runs->arena_max)
     {
-        decode->buffer_used = *buf_idx;
-        if ((decode->callback(decode)) == DECODE_DONE)
-          return DECODE_DONE;
-        *buf_idx = decode->buffer_used;
+        for (max=runs->arena_max ? runs->arena_max : TEXT_RUN_ARENA;
+             max<runs->arena_used+len; )
+          max *= 2;
+        if (!(tmp = realloc(runs->arena, max)))
+          return DECODE_CONTINUE;
+        runs->arena = tmp;
+        runs->arena_max = max;
     }
 
+    /* Text space to user space */
+    mat_mul(m, ts->Tm, ts->ctm);
+
+    i = runs->n_runs++;
+    runs->x[i] = m[4];
+    runs->y[i] = m[5];
+    runs->size[i] = ts->Tfs * sqrt(m[2]*m[2] + m[3]*m[3]);
+    runs->start[i] = runs->arena_used;
+    runs->len[i] = len;
+    runs->page[i] = decode->pg_num;
+    memcpy(runs->arena + runs->arena_used, text, len);
+    runs->arena_used += len;
+
+    if (runs->n_runs == TEXT_RUN_BATCH || runs->arena_used >= TEXT_RUN_ARENA)
+      return flush_runs(decode);
     return DECODE_CONTINUE;
 }
 
 
-typedef struct 
+/* The CMap of the font just set by Tf.  The page's last few fonts are kept,
+ * as pages tend to go back and forth between a handful.
+ */
+static const cmap_t *font_cmap(decode_t *decode)
 {
-    unsigned short next_top;
-#define MAX_STACK_VALS 32
-    double vals[MAX_STACK_VALS]; /* 0 is the bottom, 32 is the top */
-} stack_t;
+    int i;
+    text_state_t *ts = &decode->text;
+
+    for (i=0; i<ts->n_fonts && i<MAX_PAGE_FONTS; ++i)
+      if (strcmp(ts->fonts[i].name, ts->font) == 0)
+        return ts->fonts[i].cmap;
+
+    i = ts->n_fonts++ % MAX_PAGE_FONTS;
+    memcpy(ts->fonts[i].name, ts->font, sizeof(ts->font));
+    ts->fonts[i].cmap = font_cmap_get(
+        decode->pdf, pdf_get_font(decode->pdf, decode->pg_num, ts->font));
+    return ts->fonts[i].cmap;
+}
 
 
-static inline void stack_push(stack_t *stack, double val)
+/* Show the string operands, then move past them */
+static decode_exit_e show_text(decode_t *decode)
 {
-    stack->vals[stack->next_top++ % MAX_STACK_VALS] = val;
+    size_t i, n_spaces, len, n_codes;
+    double tx;
+    decode_exit_e de;
+    const char *text;
+    text_state_t *ts = &decode->text;
+    lex_state_t *lex = &decode->lex;
+
+    /* Codes to text */
+    text = lex->str;
+    len = n_codes = lex->str_len;
+    if (ts->cmap && ts->cmap->code_bytes)
+    {
+        len = cmap_map(ts->cmap, lex->str, lex->str_len,
+                       &lex->text, &lex->text_max, &n_codes);
+        text = lex->text;
+    }
+
+    de = emit(decode, text, len);
+    if (de == DECODE_CONTINUE && decode->run_callback && len)
+      de = add_run(decode, text, len);
+
+    /* Word spacing only applies to single byte code 32 */
+    n_spaces = 0;
+    if (ts->Tw != 0.0 && n_codes == lex->str_len)
+      for (i=0; i<lex->str_len; ++i)
+        if (lex->str[i] == ' ')
+          ++n_spaces;
+    tx = ((EST_GLYPH_WIDTH * ts->Tfs + ts->Tc) * n_codes +
+          ts->Tw * n_spaces - ts->Tj / 1000.0 * ts->Tfs) * ts->Th;
+    ts->Tm[4] += tx * ts->Tm[0];
+    ts->Tm[5] += tx * ts->Tm[1];
+
+    return de;
 }
 
 
-static inline double stack_pop(stack_t *stack)
+/* Add to the string operands */
+static void str_append(lex_state_t *lex, const void *data, size_t len)
 {
-    return stack->vals[--stack->next_top % MAX_STACK_VALS];
+    char *tmp;
+    size_t max;
+
+    if (lex->str_len + len > lex->str_max)
+    {
+        for (max=lex->str_max ? lex->str_max : 256; max<lex->str_len+len; )
+          max *= 2;
+        if (!(tmp = realloc(lex->str, max)))
+          return; /* Drop it, it is only text */
+        lex->str = tmp;
+        lex->str_max = max;
+    }
+
+    memcpy(lex->str + lex->str_len, data, len);
+    lex->str_len += len;
 }
 
 
-static decode_exit_e decode_ps(
-    unsigned char *data,
-    off_t          length,
-    decode_t      *decode)
+static void str_putc(lex_state_t *lex, char c)
+{
+    str_append(lex, &c, 1);
+}
+
+
+/* Start over for a new page, keeping the string buffers */
+static void lex_reset(lex_state_t *lex)
+{
+    char *str = lex->str, *text = lex->text;
+    size_t str_max = lex->str_max, text_max = lex->text_max;
+
+    memset(lex, 0, sizeof(lex_state_t));
+    lex->str = str;
+    lex->str_max = str_max;
+    lex->text = text;
+    lex->text_max = text_max;
+}
+
+
+/* Run the operator 'op', which uses up the operands read since the last one */
+static decode_exit_e do_operator(decode_t *decode, const char *op, int len)
 {
-#define TX 4 /* a,b,c,d,e,f from Tm, tx is 'e' */
     int v;
-    unsigned char c;
-    off_t i=0;
-    static _Bool in_array;
-    static double val, Tm[6] = {0.0};
-    static double Tc, Tj, Tfs, Th, Tw, last_tx;
-    static int last_pg_num = -1;
-    size_t bufidx = decode->buffer_used;
-    char *buf = decode->buffer;
-    stack_t vals;
+    double tx, ty, m[6];
+    decode_exit_e de = DECODE_CONTINUE;
+    text_state_t *ts = &decode->text;
+    lex_state_t *lex = &decode->lex;
+    operand_stack_t *vals = &lex->vals;
 
-#ifdef DEBUG_PS
-    for (i=0; i<length; ++i)
-      putc(data[i], stdout);
-    i = 0;
-#endif
+#define IS_OP(_a, _b) (len == 2 && op[0] == (_a) && op[1] == (_b))
 
-    /* Initialize (if we hit a new page) */
-    if (last_pg_num != decode->pg_num)
+    /* Show text (on a new line for ' and ") */
+    if (IS_OP('T', 'j') || IS_OP('T', 'J'))
+      de = show_text(decode);
+    else if (len == 1 && (op[0] == '\'' || op[0] == '"'))
     {
-        in_array = false;
-        memset(Tm, 0, sizeof(Tm));
-        Tc = Tj = Tfs = Th = Tw = last_tx = 0.0;
-        last_pg_num = decode->pg_num;
+        if (op[0] == '"')
+        {
+            ts->Tc = stack_pop(vals);
+            ts->Tw = stack_pop(vals);
+        }
+        text_move(ts, 0.0, -ts->TL);
+        if ((de = emit(decode, "\n", 1)) == DECODE_CONTINUE)
+          de = show_text(decode);
     }
 
-    /* Parse... */
-    for ( ; i < length; ++i)
+    /* Move to the next line (a newline if it really moves down or up) */
+    else if (IS_OP('T', '*'))
+    {
+        text_move(ts, 0.0, -ts->TL);
+        de = emit(decode, "\n", 1);
+    }
+    else if (IS_OP('T', 'd') || IS_OP('T', 'D'))
     {
-        /* If we have filled the buffer... callback */
-        if (cb_if_full(decode, &bufidx) == DECODE_DONE)
-          return DECODE_DONE;
+        ty = stack_pop(vals);
+        tx = stack_pop(vals);
+        if (op[1] == 'D')
+          ts->TL = -ty;
+        text_move(ts, tx, ty);
+        if (ty != 0.0)
+          de = emit(decode, "\n", 1);
+    }
 
-        c = data[i];
-        if (isspace(c))
-          continue;
+    /* Text state */
+    else if (IS_OP('T', 'm'))
+    {
+        for (v=6; v>0; --v)
+          ts->Tm[v-1] = stack_pop(vals);
+        memcpy(ts->Tlm, ts->Tm, sizeof(ts->Tlm));
+    }
+    else if (IS_OP('T', 'c'))
+      ts->Tc = stack_pop(vals);
+    else if (IS_OP('T', 'w'))
+      ts->Tw = stack_pop(vals);
+    else if (IS_OP('T', 'L'))
+      ts->TL = stack_pop(vals);
+    else if (IS_OP('T', 'z'))
+      ts->Th = stack_pop(vals) / 100.0;
+    else if (IS_OP('T', 'f'))
+    {
+        ts->Tfs = stack_pop(vals);
+        memcpy(ts->font, lex->name, sizeof(ts->font));
+        ts->cmap = font_cmap(decode);
+    }
+    else if (IS_OP('B', 'T'))
+    {
+        mat_identity(ts->Tm);
+        mat_identity(ts->Tlm);
+    }
+
+    /* Graphics state: Only the transformation matrix matters (for where text
+     * is on the page)
+     */
+    else if (IS_OP('c', 'm'))
+    {
+        for (v=6; v>0; --v)
+          m[v-1] = stack_pop(vals);
+        mat_mul(ts->ctm, m, ts->ctm);
+    }
+    else if (len == 1 && op[0] == 'q')
+    {
+        if (ts->n_saved < MAX_GSTATE)
+          memcpy(ts->saved_ctm[ts->n_saved], ts->ctm, sizeof(ts->ctm));
+        ++ts->n_saved;
+    }
+    else if (len == 1 && op[0] == 'Q' && ts->n_saved > 0)
+    {
+        if (--ts->n_saved < MAX_GSTATE)
+          memcpy(ts->ctm, ts->saved_ctm[ts->n_saved], sizeof(ts->ctm));
+    }
+
+    /* Skip over inline image data, it can look like anything */
+    else if (IS_OP('I', 'D'))
+    {
+        lex->state = LEX_INLINE;
+        lex->depth = 0;
+    }
+#undef IS_OP
+
+    lex->str_len = 0;
+    vals->n_vals = 0;
+    ts->Tj = 0.0;
+    return de;
+}
+
+
+/* The number, name or operator 'tok' (of 'len' bytes) is complete */
+static decode_exit_e end_token(decode_t *decode, const char *tok, int len)
+{
+    double val;
+    char c = tok[0];
+    text_state_t *ts = &decode->text;
+    lex_state_t *lex = &decode->lex;
+
+    if (lex->state == LEX_NAME)
+    {
+        lex->state = LEX_SPACE;
+        if (len > MAX_TOKEN - 1)
+          len = MAX_TOKEN - 1;
+        memcpy(lex->name, tok, len);
+        lex->name[len] = '\0';
+        return DECODE_CONTINUE;
+    }
+    lex->state = LEX_SPACE;
+
+    /* Not a number: An operator */
+    if (!((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.'))
+      return do_operator(decode, tok, len);
+
+    if (!pdf_parse_number(tok, len, &val))
+      val = 0.0; /* Just a sign or a '.' */
+
+    /* Not a position adjustment within a TJ array: An operand */
+    if (!ts->in_array)
+      stack_push(&lex->vals, val);
+    else
+      ts->Tj += val;
 
-        /* Array, really for just handling TJ operator */
-        if (c == '[')
+    return DECODE_CONTINUE;
+}
+
+
+/* Read a literal string from 'data' (starting after its '(', or where the last
+ * piece of data left off).  Returns how much of 'data' was used.
+ */
+static size_t lex_string(lex_state_t *lex, const unsigned char *data,
+                         size_t len)
+{
+    int c;
+    size_t i = 0, n;
+
+    while (i < len)
+    {
+        c = data[i];
+        switch (lex->esc)
         {
-            in_array = true;
-            last_tx = Tm[TX];
+            case ESC_NONE:
+                /* Copy everything up to the next '(', ')' or '\' at once */
+                for (n=i; n<len && !(byte_class[data[n]] & CL_STRING); ++n)
+                  ;
+                if (n > i)
+                  str_append(lex, data + i, n - i);
+                if ((i = n) == len)
+                  return len;
+
+                c = data[i++];
+                if (c == '\\')
+                  lex->esc = ESC_BACKSLASH;
+                else if (c == '(')
+                {
+                    ++lex->depth;
+                    str_putc(lex, c);
+                }
+                else if (lex->depth)
+                {
+                    --lex->depth;
+                    str_putc(lex, c);
+                }
+                else
+                {
+                    lex->state = LEX_SPACE;
+                    return i;
+                }
+                break;
+
+            case ESC_BACKSLASH:
+                ++i;
+                lex->esc = ESC_NONE;
+                switch (c)
+                {
+                    case 'n':  str_putc(lex, '\n'); break;
+                    case 'r':  str_putc(lex, '\r'); break;
+                    case 't':  str_putc(lex, '\t'); break;
+                    case 'b':  str_putc(lex, '\b'); break;
+                    case 'f':  str_putc(lex, '\f'); break;
+                    case '\n': break; /* Line continuation */
+                    case '\r': lex->esc = ESC_CR; break;
+                    default:
+                        if (c >= '0' && c <= '7')
+                        {
+                            lex->esc = ESC_OCT1;
+                            lex->esc_val = c - '0';
+                        }
+                        else
+                          str_putc(lex, c); /* \( \) \\ (or unknown) */
+                }
+                break;
+
+            case ESC_CR: /* Line continuation: "\<CR>" or "\<CR><LF>" */
+                if (c == '\n')
+                  ++i;
+                lex->esc = ESC_NONE;
+                break;
+
+            case ESC_OCT1:
+            case ESC_OCT2: /* Up to three octal digits */
+                if (c >= '0' && c <= '7')
+                {
+                    ++i;
+                    lex->esc_val = lex->esc_val * 8 + (c - '0');
+                    if (lex->esc == ESC_OCT1)
+                    {
+                        lex->esc = ESC_OCT2;
+                        break;
+                    }
+                }
+                str_putc(lex, lex->esc_val);
+                lex->esc = ESC_NONE;
+                break;
         }
-        else if (c == ']')
-          in_array = false;
+    }
+
+    return i;
+}
 
-        /* Text to display */
-        if (c == '(')
+
+/* Read a hex string from 'data'.  Returns how much of 'data' was used. */
+static size_t lex_hex(lex_state_t *lex, const unsigned char *data, size_t len)
+{
+    int c, v;
+    size_t i;
+
+    for (i=0; i<len; ++i)
+    {
+        c = data[i];
+        if (c == '>')
         {
-            /* TODO figure out a better way to calculate spacing */
-            //if (Tm[TX] - last_tx > 0.2) /* How to calc a proper space? */
-            //  buf[bufidx++] = ' ';
-            ++i;
-            while (data[i] != ')')
-            {
-                if (cb_if_full(decode, &bufidx) == DECODE_DONE)
-                  return DECODE_DONE;
-                buf[bufidx++] = data[i];
-                ++i;
-                if (i > length)
-                  break;
-            }
+            /* An odd number of digits: The last one is followed by a 0 */
+            if (lex->hex >= 0)
+              str_putc(lex, lex->hex << 4);
+            lex->state = LEX_SPACE;
+            return i + 1;
         }
+        if (!(byte_class[c] & CL_HEX))
+          continue; /* Whitespace (or junk) */
 
-        /* Position value */
-        else if (isdigit(c) || c == '-')
+        v = (c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10;
+        if (lex->hex < 0)
+          lex->hex = v;
+        else
         {
-            stack_push(&vals, atof((char *)data + i));
-            while (isdigit(data[i]) || data[i] == '.' || data[i] == '-')
-              ++i;
-            --i; /* Place i at the most recent (last number) character */
+            str_putc(lex, (lex->hex << 4) | v);
+            lex->hex = -1;
+        }
+    }
 
-            if (in_array)
+    return len;
+}
+
+
+/* Skip inline image data, which ends at "EI" between whitespace.  Returns how
+ * much of 'data' was used.  lex->depth is how much of " EI " has been seen.
+ */
+static size_t lex_inline(lex_state_t *lex, const unsigned char *data,
+                         size_t len)
+{
+    int c;
+    size_t i;
+
+    for (i=0; i<len; ++i)
+    {
+        c = data[i];
+        if (lex->depth == 3)
+        {
+            if (byte_class[c] & CL_END)
             {
-                Tfs = Tm[3];
-                Th = Tm[0] / Tfs;
-                Tj = stack_pop(&vals);
-                last_tx = Tm[TX];
-                Tm[TX] = (-(Tj / 1000.0) * Tfs + Tc + Tw) * Th;
+                lex->state = LEX_SPACE;
+                return i;
             }
+            lex->depth = 0;
         }
 
-        /* New line (skip other display options like Tf and Tj */
-        else if (c == 'T') 
+        if (byte_class[c] & CL_SPACE)
+          lex->depth = 1;
+        else if ((lex->depth == 1 && c == 'E') || (lex->depth == 2 && c == 'I'))
+          ++lex->depth;
+        else
+          lex->depth = 0;
+    }
+
+    return len;
+}
+
+
+/* Lex (and run) the next 'len' bytes of the content stream */
+static decode_exit_e lex(decode_t *decode, const unsigned char *data,
+                         size_t len)
+{
+    int c;
+    size_t i = 0, n;
+    decode_exit_e de = DECODE_CONTINUE;
+    text_state_t *ts = &decode->text;
+    lex_state_t *lex = &decode->lex;
+
+    if (lex->done)
+      return DECODE_DONE;
+    STATS_ADD(decode->pdf, ps_runs, 1);
+    STATS_ADD(decode->pdf, ps_bytes, len);
+
+#ifdef DEBUG_PS
+    fwrite(data, 1, len, stdout);
+#endif
+
+    while (i < len)
+    {
+        switch (lex->state)
         {
-            c = data[++i];
+            case LEX_SPACE:
+                /* Tokens are mostly a single space apart, only go wide for
+                 * longer runs of whitespace.
+                 */
+                for (n=i+4; i<len && i<n && (byte_class[data[i]] & CL_SPACE); )
+                  ++i;
+                if (i == n)
+                  i += pdf_span_space((const char *)data + i, len - i);
+                if (i == len)
+                  break;
 
-            /* Newline (or space) */
-            if (c == '*')
-              buf[bufidx++] = '\n';
-            else if ((c=='D' || c=='d'))
-            {
-                val = stack_pop(&vals);
-                if (val != 0.0)
-                  buf[bufidx++] = '\n';
-            }
-            else if (c == 'm') /* Tm */
+                /* Start of a number or operator */
+                if (!(byte_class[data[i]] & CL_DELIM))
+                {
+                    lex->state = LEX_REGULAR;
+                    lex->tok_len = 0;
+                    goto regular;
+                }
+
+                switch ((c = data[i++]))
+                {
+                    case '(':
+                        lex->state = LEX_STRING;
+                        lex->depth = 0;
+                        lex->esc = ESC_NONE;
+                        break;
+                    case '<': lex->state = LEX_LT;      break;
+                    case '>': lex->state = LEX_GT;      break;
+                    case '%': lex->state = LEX_COMMENT; break;
+                    case '/':
+                        lex->state = LEX_NAME;
+                        lex->tok_len = 0;
+                        break;
+                    case '[':
+                        ts->in_array = true;
+                        break;
+                    case ']':
+                        ts->in_array = false;
+                        break;
+                    default: /* ')', '{' or '}' */
+                        break;
+                }
+                break;
+
+            case LEX_REGULAR:
+            case LEX_NAME:
+            regular:
+                for (n=i; n<len && !(byte_class[data[n]] & CL_END); ++n)
+                  ;
+
+                /* All of the token is here: Use it where it is */
+                if (n < len && lex->tok_len == 0)
+                  de = end_token(decode, (const char *)data + i, n - i);
+                else
+                {
+                    /* Keep it, it might carry on in the next piece of data */
+                    if (n - i > MAX_TOKEN - 1 - lex->tok_len)
+                      c = MAX_TOKEN - 1 - lex->tok_len; /* Too long */
+                    else
+                      c = n - i;
+                    memcpy(lex->tok + lex->tok_len, data + i, c);
+                    lex->tok_len += c;
+                    if (n < len)
+                      de = end_token(decode, lex->tok, lex->tok_len);
+                }
+
+                i = n;
+                if (de == DECODE_DONE)
+                {
+                    lex->done = true;
+                    return DECODE_DONE;
+                }
+                break;
+
+            case LEX_STRING:
+                i += lex_string(lex, data + i, len - i);
+                break;
+
+            case LEX_HEX:
+                i += lex_hex(lex, data + i, len - i);
+                break;
+
+            case LEX_LT:
+                if (data[i] == '<')
+                {
+                    ++i;
+                    lex->state = LEX_SPACE; /* Dictionary */
+                }
+                else
+                {
+                    lex->state = LEX_HEX;
+                    lex->hex = -1;
+                }
+                break;
+
+            case LEX_GT:
+                if (data[i] == '>')
+                  ++i;
+                lex->state = LEX_SPACE;
+                break;
+
+            case LEX_COMMENT:
+                while (i < len && !(byte_class[data[i]] & CL_EOL))
+                  ++i;
+                if (i < len)
+                  lex->state = LEX_SPACE;
+                break;
+
+            case LEX_INLINE:
+                i += lex_inline(lex, data + i, len - i);
+                break;
+        }
+    }
+
+    return DECODE_CONTINUE;
+}
+
+
+/* The end of a content stream also ends the token (or comment) being read.
+ * A page's contents can be split over several streams: Anything else, such as
+ * a string, carries over into the next one.
+ */
+static decode_exit_e lex_end(decode_t *decode)
+{
+    lex_state_t *lex = &decode->lex;
+
+    if (lex->done)
+      return DECODE_DONE;
+    if ((lex->state == LEX_REGULAR || lex->state == LEX_NAME) &&
+        end_token(decode, lex->tok, lex->tok_len) == DECODE_DONE)
+    {
+        lex->done = true;
+        return DECODE_DONE;
+    }
+
+    if (lex->state == LEX_REGULAR || lex->state == LEX_NAME ||
+        lex->state == LEX_COMMENT)
+      lex->state = LEX_SPACE;
+    return DECODE_CONTINUE;
+}
+
+
+/* Inflate state of a decode object, kept between streams so that the inflate
+ * backends are only set up once per decode object (see pdf_decode_release).
+ */
+typedef struct
+{
+    z_stream       zs;
+    _Bool          zs_ready;
+    unsigned char *window;      /* Streamed data is lexed from here       */
+    size_t         window_size;
+    unsigned char *out;         /* Whole-buffer data is inflated into here */
+    size_t         out_size;
+#ifdef HAVE_LIBDEFLATE
+    struct libdeflate_decompressor *ld;
+#endif
+} inflate_t;
+
+
+/* Get 'inf' ready to inflate a new stream.  Returns 'false' on error. */
+static _Bool inflate_ready(inflate_t *inf)
+{
+    if (inf->zs_ready)
+      return inflateReset(&inf->zs) == Z_OK;
+    if (inflateInit(&inf->zs) != Z_OK)
+      return false;
+    inf->zs_ready = true;
+
+#ifdef HAVE_LIBDEFLATE
+    if (!inf->ld && !(inf->ld = libdeflate_alloc_decompressor()))
+      return false;
+#endif
+    return true;
+}
+
+
+static void inflate_free(inflate_t *inf)
+{
+    if (inf->zs_ready)
+      inflateEnd(&inf->zs);
+#ifdef HAVE_LIBDEFLATE
+    if (inf->ld)
+      libdeflate_free_decompressor(inf->ld);
+#endif
+    free(inf->window);
+    free(inf->out);
+}
+
+
+/*
+ * Whole-buffer inflate backends: When all of a stream's data is at hand (it
+ * always is, the pdf is mapped) it can be inflated in one call rather than a
+ * window at a time.  Each backend inflates [in, in+in_len) into 'out', which
+ * has room for '*out_len' bytes, and sets '*out_len' to the bytes inflated.
+ */
+
+typedef enum {INFLATE_OK, INFLATE_SHORT, INFLATE_ERR} inflate_e;
+
+
+static inflate_e inflate_zlib(
+    inflate_t           *inf,
+    const unsigned char *in,
+    size_t               in_len,
+    unsigned char       *out,
+    size_t              *out_len)
+{
+    int ret;
+
+    if (inflateReset(&inf->zs) != Z_OK)
+      return INFLATE_ERR;
+    inf->zs.next_in = (unsigned char *)in;
+    inf->zs.avail_in = in_len;
+    inf->zs.next_out = out;
+    inf->zs.avail_out = *out_len;
+    ret = inflate(&inf->zs, Z_FINISH);
+    *out_len = inf->zs.total_out;
+
+    if (ret == Z_STREAM_END)
+      return INFLATE_OK;
+    if (ret == Z_OK || ret == Z_BUF_ERROR) /* Out of room or out of input */
+      return inf->zs.avail_out ? INFLATE_OK : INFLATE_SHORT;
+    return INFLATE_ERR;
+}
+
+
+#ifdef HAVE_LIBDEFLATE
+static inflate_e inflate_libdeflate(
+    inflate_t           *inf,
+    const unsigned char *in,
+    size_t               in_len,
+    unsigned char       *out,
+    size_t              *out_len)
+{
+    size_t n_in, n_out;
+
+    /* The _ex version, as /Length often covers a trailing end of line */
+    switch (libdeflate_zlib_decompress_ex(
+                inf->ld, in, in_len, out, *out_len, &n_in, &n_out))
+    {
+        case LIBDEFLATE_SUCCESS:
+            *out_len = n_out;
+            return INFLATE_OK;
+        case LIBDEFLATE_INSUFFICIENT_SPACE:
+            return INFLATE_SHORT;
+        default:
+            return INFLATE_ERR; /* Corrupt or truncated */
+    }
+}
+#endif /* HAVE_LIBDEFLATE */
+
+
+/* Inflate backends, fastest first.  The last one inflates a window at a time
+ * (see decode_flate) and is what all of the others fall back on.
+ */
+typedef struct
+{
+    const char *name;
+    inflate_e (*inflate)(inflate_t *inf, const unsigned char *in,
+                         size_t in_len, unsigned char *out, size_t *out_len);
+} inflater_t;
+
+static const inflater_t inflaters[] =
+{
+#ifdef HAVE_LIBDEFLATE
+    {"libdeflate", inflate_libdeflate},
+#endif
+    {"zlib", inflate_zlib},
+    {"zlib-stream", NULL},
+};
+static const int n_inflaters = sizeof(inflaters) / sizeof(inflaters[0]);
+
+
+const char *pdf_inflater_name(int idx)
+{
+    return (idx >= 0 && idx < n_inflaters) ? inflaters[idx].name : NULL;
+}
+
+
+/* Inflate [in, in+in_len) into inf->out (NUL terminated) with the whole-buffer
+ * backends, starting with 'inflater' and falling back on the ones after it.
+ * 'hint' is the expected inflated size (e.g. from /DL) or 0 if unknown.
+ * Returns the bytes inflated, or -1 if the data would be more than 'max' bytes
+ * or none of the backends could inflate it.
+ */
+static long long inflate_whole(
+    inflate_t           *inf,
+    int                  inflater,
+    const unsigned char *in,
+    size_t               in_len,
+    size_t               hint,
+    size_t               max)
+{
+    size_t n, size;
+    unsigned char *tmp;
+    inflate_e ret;
+
+    size = hint ? hint : in_len * 4;
+    for ( ; inflater<n_inflaters && inflaters[inflater].inflate; ++inflater)
+    {
+        for ( ;; )
+        {
+            /* The buffer is kept between streams, only ever growing */
+            if (size > inf->out_size)
             {
-                for (v=6; v>0; --v)
-                  Tm[v-1] = stack_pop(&vals);
+                if (size > max || !(tmp = realloc(inf->out, size + 1)))
+                  return -1;
+                inf->out = tmp;
+                inf->out_size = size;
             }
-            else if (c == 'c')
-              Tc = stack_pop(&vals);
-            else if (c == 'w')
-              Tw = stack_pop(&vals);
-            else
-              stack_pop(&vals);
+
+            n = inf->out_size;
+            ret = inflaters[inflater].inflate(inf, in, in_len, inf->out, &n);
+            if (ret != INFLATE_SHORT)
+              break;
+            size = inf->out_size * 2;
         }
 
-        /* New line */
-        else if (c == '\'' || c == '"')
-          buf[bufidx++] = '\n';
+        if (ret == INFLATE_OK)
+        {
+            inf->out[n] = '\0';
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Get the decode object's inflate state ready for a new stream */
+static inflate_t *get_inflate(decode_t *decode)
+{
+    unsigned char *tmp;
+    inflate_t *inf = decode->inflate;
+    size_t size = decode->window_size ? decode->window_size :
+                                        DEFAULT_WINDOW_SIZE;
+
+    if (!inf)
+    {
+        if (!(inf = calloc(1, sizeof(inflate_t))))
+          return NULL;
+        decode->inflate = inf;
+    }
+    if (!inflate_ready(inf))
+      return NULL;
+
+    if (inf->window_size != size)
+    {
+        if (!(tmp = realloc(inf->window, size)))
+          return NULL;
+        inf->window = tmp;
+        inf->window_size = size;
     }
 
-    /* Done decoding call the callback */
-    decode->buffer_used = bufidx;
-    return decode->callback(decode);
+    return inf;
 }
 
 
-static decode_exit_e decode_flate(
-    decode_t *decode,
-    iter_t   *itr,
-    size_t    length)
+/* Inflate the stream straight out of the mapped pdf: In one go if it is not
+ * too big (and the decode object's backend can), otherwise a window at a time.
+ */
+static decode_exit_e decode_flate(decode_t *decode, const stream_t *stream)
 {
     int ret;
-    off_t n_read, to_read;
-    decode_exit_e de;
-    const off_t block_size = 1024;
-    unsigned char in[block_size], out[block_size];
-    z_stream stream;
+    size_t n;
+    long long len;
+    uint64_t start;
+    inflate_t *inf;
+    decode_exit_e de = DECODE_CONTINUE;
+    const unsigned char *in;
 
-    memset(&stream, 0, sizeof(z_stream));
-    if ((ret = inflateInit(&stream)) != Z_OK)
+    if (!(inf = get_inflate(decode)))
       return DECODE_DONE;
+    in = (unsigned char *)decode->pdf->data + stream->offset;
+
+    start = trace_on ? stats_now() : 0;
+    len = inflate_whole(inf, decode->inflater, in, stream->length,
+                        stream->decoded_length, MAX_WHOLE_SIZE);
+    if (len >= 0)
+    {
+        TRACE_SPAN("inflate", start, stream->id);
+        STATS_ADD(decode->pdf, bytes_compressed, stream->length);
+        STATS_ADD(decode->pdf, bytes_inflated, len);
+        return lex(decode, inf->out, len);
+    }
 
-    n_read = 0;
+    /* Streaming fallback */
+    inflateReset(&inf->zs);
+    inf->zs.next_in = (unsigned char *)in;
+    inf->zs.avail_in = stream->length;
 
-    /* Thanks to http://www.zlib.net/zpipe.c for the following */
     do
     {
-        to_read = block_size - (n_read % block_size);
-        stream.avail_in = to_read;
-        memcpy(in, ITR_ADDR(itr) + n_read, to_read);
-        stream.next_in = in;
-        n_read += to_read;
-        do
+        inf->zs.next_out = inf->window;
+        inf->zs.avail_out = inf->window_size;
+        ret = inflate(&inf->zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+          break; /* Corrupt, or truncated (Z_BUF_ERROR) */
+
+        /* Decode the inflated data (ps format) */
+        n = inf->window_size - inf->zs.avail_out;
+        STATS_ADD(decode->pdf, bytes_inflated, n);
+        if (n && (de = lex(decode, inf->window, n)) != DECODE_CONTINUE)
+          break;
+    } while (ret == Z_OK);
+
+    /* (The span takes in the decoding of each window, in between) */
+    TRACE_SPAN("inflate", start, stream->id);
+    STATS_ADD(decode->pdf, bytes_compressed,
+              stream->length - inf->zs.avail_in);
+    return de;
+}
+
+
+void pdf_decode_init(decode_t *decode, const pdf_t *pdf)
+{
+    memset(decode, 0, sizeof(decode_t));
+    decode->pdf = pdf;
+}
+
+
+void pdf_decode_release(decode_t *decode)
+{
+    free(decode->lex.str);
+    decode->lex.str = NULL;
+    decode->lex.str_len = decode->lex.str_max = 0;
+    free(decode->lex.text);
+    decode->lex.text = NULL;
+    decode->lex.text_max = 0;
+
+    if (decode->runs)
+    {
+        free(decode->runs->arena);
+        free(decode->runs);
+        decode->runs = NULL;
+    }
+
+    if (!decode->inflate)
+      return;
+    inflate_free(decode->inflate);
+    free(decode->inflate);
+    decode->inflate = NULL;
+}
+
+
+/* Paeth predictor (from the PNG spec) */
+static unsigned char paeth(unsigned char a, unsigned char b, unsigned char c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+      return a;
+    return (pb <= pc) ? b : c;
+}
+
+
+/* Undo a PNG predictor (/Predictor 10 through 15).  Each row of the data is a
+ * filter type byte followed by the row's bytes.  Returns a newly allocated,
+ * NUL terminated, buffer and updates 'length', or NULL on error.
+ */
+static char *png_unpredict(
+    const unsigned char *in,
+    size_t              *length,
+    const stream_t      *stream)
+{
+    size_t r, i, n_rows, row_len, bpp;
+    unsigned char a, b, c, x, *out, *row;
+    const unsigned char *prev, *src;
+
+    bpp = (stream->colors * stream->bpc + 7) / 8;
+    row_len = (stream->columns * stream->colors * stream->bpc + 7) / 8;
+    if (bpp == 0 || row_len == 0)
+      return NULL;
+    n_rows = *length / (row_len + 1);
+
+    if (!(out = malloc(n_rows * row_len + 1)))
+      return NULL;
+
+    for (r=0; r<n_rows; ++r)
+    {
+        src = in + r * (row_len + 1) + 1;
+        row = out + r * row_len;
+        prev = r ? row - row_len : NULL;
+        for (i=0; i<row_len; ++i)
         {
-            stream.avail_out = block_size;
-            stream.next_out = out;
-            ret = inflate(&stream, Z_NO_FLUSH);
-            switch (ret)
+            x = src[i];
+            a = (i >= bpp) ? row[i - bpp] : 0;
+            b = prev ? prev[i] : 0;
+            c = (prev && i >= bpp) ? prev[i - bpp] : 0;
+            switch (src[-1])
             {
-                case Z_NEED_DICT:
-                case Z_DATA_ERROR:
-                case Z_MEM_ERROR:
-                    inflateEnd(&stream);
-                    return DECODE_DONE;
+                case 0: row[i] = x;                 break; /* None    */
+                case 1: row[i] = x + a;             break; /* Sub     */
+                case 2: row[i] = x + b;             break; /* Up      */
+                case 3: row[i] = x + (a + b) / 2;   break; /* Average */
+                case 4: row[i] = x + paeth(a, b, c); break; /* Paeth  */
+                default:
+                    free(out);
+                    return NULL;
             }
+        }
+    }
+
+    *length = n_rows * row_len;
+    out[*length] = '\0';
+    return (char *)out;
+}
 
-            /* Decode the compressed data (ps format) */
-            de = decode_ps(out, block_size - stream.avail_out, decode);
-            if (de != DECODE_CONTINUE)
-              return de;
 
-        /* If more data... keep on decompressing */
-        } while (stream.avail_out == 0);
-    } while (ret != Z_STREAM_END);
+/* Inflate all of [data, data+length) into a newly allocated, NUL terminated,
+ * buffer.  Returns NULL on error.
+ */
+static char *inflate_all(const unsigned char *data, size_t length,
+                         size_t hint, size_t *out_len)
+{
+    long long n;
+    char *out = NULL;
+    inflate_t inf;
+
+    memset(&inf, 0, sizeof(inflate_t));
+    if (inflate_ready(&inf) &&
+        (n = inflate_whole(&inf, 0, data, length, hint, (size_t)-1)) >= 0)
+    {
+        out = (char *)inf.out;
+        inf.out = NULL;
+        *out_len = n;
+    }
 
-    inflateEnd(&stream);
-    return DECODE_DONE;
+    inflate_free(&inf);
+    return out;
+}
+
+
+char *pdf_decode_stream(
+    const pdf_t    *pdf,
+    const stream_t *stream,
+    size_t         *length)
+{
+    size_t len;
+    uint64_t start;
+    char *data, *tmp;
+    const unsigned char *st = (unsigned char *)pdf->data + stream->offset;
+
+    if (stream->offset >= pdf->len)
+      return NULL;
+    len = stream->length;
+    if (len > pdf->len - stream->offset)
+      len = pdf->len - stream->offset;
+
+    /* Not encoded: Just a copy */
+    if (stream->n_filters == 0)
+    {
+        if (!(data = malloc(len + 1)))
+          return NULL;
+        memcpy(data, st, len);
+        data[len] = '\0';
+        *length = len;
+        return data;
+    }
+
+    /* We only handle a single FlateDecode */
+    if (stream->n_filters > 1 || stream->filters[0] != FILTER_FLATE)
+      return NULL;
+    start = trace_on ? stats_now() : 0;
+    if (!(data = inflate_all(st, len, stream->decoded_length, length)))
+      return NULL;
+    TRACE_SPAN("inflate", start, stream->id);
+    STATS_ADD(pdf, bytes_compressed, len);
+    STATS_ADD(pdf, bytes_inflated, *length);
+
+    /* Undo the PNG predictor */
+    if (stream->predictor >= 10)
+    {
+        tmp = png_unpredict((unsigned char *)data, length, stream);
+        free(data);
+        data = tmp;
+    }
+    else if (stream->predictor > 1) /* TIFF predictor is not supported */
+    {
+        free(data);
+        data = NULL;
+    }
+
+    return data;
 }
 
 
 typedef struct _decoder_t
 {
     const char *name;
-    decode_exit_e (*do_decode)(decode_t *decode, iter_t *itr, size_t length);
+    filter_e    filter;
+    decode_exit_e (*do_decode)(decode_t *decode, const stream_t *stream);
 } decoder_t;
 
 static decoder_t decoders[] = 
 {
-    {"FlateDecode", decode_flate},
+    {"FlateDecode", FILTER_FLATE, decode_flate},
 };
 static const int n_decoders = 1;
 
 
-/* Given a page object, figure out how it is decoded and call the proper decode
- * routine on it.
- */
-static int find_and_decode(obj_t obj, decode_t *decode)
+/* Given a page's content stream, call the decode routine for its filter */
+static int decode_stream(const stream_t *stream, decode_t *decode)
 {
     int i;
-    size_t pg_length;
-    char name[32] = {0};
-    iter_t *itr = iter_new(decode->pdf);
-    
-    /* Get the pages data */
-    if (!find_in_object(itr, obj, "/Length"))
-    {
-        iter_destroy(itr);
-        return PDF_ERR; /* Could not find length of the pages data */
-    }
-    seek_next_nonwhitespace(itr);
-    pg_length = ITR_VAL_INT(itr);
-    D("Decoding page %d (%lu bytes)", decode->pg_num, pg_length);
+    const cached_stream_t *cs;
+
+    D("Decoding page %d (%lu bytes)", decode->pg_num, stream->length);
 
-    /* Locate the Filter type (e.g. FlateDecode) */
-    if (!find_in_object(itr, obj, "/Filter"))
+    /* Decoded before (or decode it all and keep it for next time) */
+    if (stream->n_filters && (cs = stream_cache_get(decode->pdf, stream)))
     {
-        iter_destroy(itr);
-        return PDF_ERR;
+        lex(decode, (unsigned char *)cs->data, cs->len);
+        stream_cache_release(decode->pdf, cs);
+        return PDF_OK;
     }
-    seek_next(itr, '/');
 
-    /* Get the Filte name */
-    i = 0;
-    iter_next(itr);
-    while (i<sizeof(name)-1 && isalnum(ITR_VAL(itr)))
+    /* Not encoded: The stream data is the ps itself */
+    if (stream->n_filters == 0)
     {
-        name[i++] = ITR_VAL(itr);
-        iter_next(itr);
+        lex(decode, (unsigned char *)decode->pdf->data + stream->offset,
+            stream->length);
+        return PDF_OK;
     }
 
-    /* Get the start of the stream */
-    seek_string(itr, "stream");
-    seek_next(itr, '\n');
-    iter_next(itr);
+    /* We only handle a single filter */
+    if (stream->n_filters > 1)
+      return PDF_ERR;
 
     /* Look through all decoders until we find the corresponding one */
     for (i=0; i<n_decoders; ++i)
-      if (strncmp(decoders[i].name, name, strlen(name)) == 0)
+      if (decoders[i].filter == stream->filters[0])
       {
-          if (decoders[i].do_decode(decode, itr, pg_length) == DECODE_DONE)
-          {
-              iter_destroy(itr);
-              return PDF_OK;
-          }
+          decoders[i].do_decode(decode, stream);
+          return PDF_OK;
       }
 
-    iter_destroy(itr);
     return PDF_ERR; /* Could not locate decoder */
 }
 
 
 int pdf_decode_page(decode_t *decode)
 {
-    const kid_t *k;
-    obj_t obj;
-    iter_t *itr = iter_new(decode->pdf);
+    int i, ret = PDF_OK;
+    size_t len;
+    uint64_t start;
+    const char *text;
+    const page_t *page;
 
-    for (k=decode->pdf->kids; k; k=k->next)
-      if (k->pg_num == decode->pg_num)
-        break;
+    /* From a sidecar: The text is all there already */
+    if (decode->sidecar)
+    {
+        if (!(text = pdf_sidecar_page(decode->sidecar, decode->pg_num, &len)))
+          return PDF_ERR;
+        if (emit(decode, text, len) == DECODE_CONTINUE && decode->callback)
+          decode->callback(decode);
+        return PDF_OK;
+    }
 
-    if (!k)
+    start = TIMING_ON(decode->pdf) ? stats_now() : 0;
+    if (trace_on)
+      trace_page(decode->pg_num);
+    if (!(page = pdf_get_page(decode->pdf, decode->pg_num)))
       return PDF_ERR; /* Page not found */
 
-    /* Get contents */
-    if (!pdf_get_object(decode->pdf, k->id, &obj))
-      return PDF_ERR; /* Could not locate page object */
-    if (!find_in_object(itr, obj, "/Contents"))
-      return PDF_ERR; /* Could not locate page contents */
-    seek_next_nonwhitespace(itr);
-    if (!pdf_get_object(decode->pdf, ITR_VAL_INT(itr), &obj))
-      return PDF_ERR; /* Could not locate page */
-    
-    /* Decode the data */
-    return find_and_decode(obj, decode);
+    /* Fresh text and lexer state for each page */
+    text_reset(&decode->text);
+    lex_reset(&decode->lex);
+    if (decode->runs)
+      decode->runs->n_runs = decode->runs->arena_used = 0;
+
+    /* Decode the parts of the contents in turn, as if they were one stream.
+     * A part that cannot be decoded is skipped (but is still an error).
+     */
+    for (i=0; i<page->n_contents && !decode->lex.done; ++i)
+    {
+        if (decode_stream(&page->contents[i], decode) != PDF_OK)
+          ret = PDF_ERR;
+        lex_end(decode);
+    }
+
+    /* Done decoding: Hand over the last text runs and call the callback
+     * (unless either already said to stop)
+     */
+    if (!decode->lex.done && decode->run_callback &&
+        flush_runs(decode) == DECODE_DONE)
+      decode->lex.done = true;
+    if (!decode->lex.done && decode->callback)
+    {
+        STATS_ADD(decode->pdf, callbacks, 1);
+        decode->callback(decode);
+    }
+    STATS_ADD(decode->pdf, decode_ns, stats_now() - start);
+    TRACE_SPAN("decode", start, page->id);
+    if (trace_on)
+      trace_page(0);
+    return ret;
 }
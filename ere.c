@@ -0,0 +1,1158 @@
+/******************************************************************************
+ * ere.c
+ *
+ * pdfsearch - Search PDF text-contents from shell
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of pdfsearch.
+ * pdfsearch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pdfsearch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pdfsearch.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Streaming extended regular expressions: A pattern is parsed into a tree and
+ * compiled into a Thompson NFA, which is shared.  Each scanner builds the DFA
+ * for it lazily, a state (set of NFA states) and transition at a time as the
+ * text needs them, so text is matched with one table lookup per byte and
+ * nothing is ever looked at twice.
+ *
+ * Matching is per line, as grep does it: '\n' is never matched and is where
+ * '^' and '$' match.  The search is unanchored, every position of a line
+ * starts a new match attempt (the start state is part of every DFA state).
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include "pdf.h"
+#include "search.h"
+
+
+/* Limits: Bounded repetition count, NFA size and the DFA states a scanner
+ * keeps (it starts over when it has this many)
+ */
+#define MAX_REPEAT     1000
+#define MAX_NFA        20000
+#define MAX_DFA_STATES 4096
+
+
+/* Parse tree */
+enum {T_SET, T_CAT, T_ALT, T_REPEAT, T_BOL, T_EOL, T_EMPTY};
+typedef struct _tree_t
+{
+    int             type;
+    int             min, max; /* T_REPEAT (max -1 is unbounded) */
+    unsigned char   set[32];  /* T_SET                          */
+    struct _tree_t *l, *r;
+} tree_t;
+
+
+typedef struct
+{
+    const char *p;
+    const char *error;
+    int         depth;
+} parser_t;
+
+
+#define SET_ADD(_s, _c) ((_s)[(unsigned char)(_c) >> 3] |= 1 << ((_c) & 7))
+#define SET_HAS(_s, _c) ((_s)[(unsigned char)(_c) >> 3] & (1 << ((_c) & 7)))
+
+
+static tree_t *new_tree(parser_t *ps, int type, tree_t *l, tree_t *r)
+{
+    tree_t *t;
+
+    if (!(t = calloc(1, sizeof(tree_t))))
+    {
+        ps->error = "out of memory";
+        return NULL;
+    }
+    t->type = type;
+    t->l = l;
+    t->r = r;
+    return t;
+}
+
+
+static void free_tree(tree_t *t)
+{
+    if (!t)
+      return;
+    free_tree(t->l);
+    free_tree(t->r);
+    free(t);
+}
+
+
+/* Add the bytes of character class 'name' ("alpha" from "[:alpha:]") */
+static _Bool add_class(unsigned char *set, const char *name, size_t len)
+{
+    int c, k;
+    static const struct {const char *name; int (*is)(int);} classes[] =
+    {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+        {"upper", isupper}, {"lower", islower}, {"space", isspace},
+        {"punct", ispunct}, {"xdigit", isxdigit}, {"print", isprint},
+        {"graph", isgraph}, {"cntrl", iscntrl}, {"blank", isblank},
+    };
+
+    for (k=0; k<sizeof(classes)/sizeof(classes[0]); ++k)
+      if (strlen(classes[k].name) == len &&
+          memcmp(classes[k].name, name, len) == 0)
+        break;
+    if (k == sizeof(classes)/sizeof(classes[0]))
+      return false;
+
+    for (c=0; c<128; ++c)
+      if (classes[k].is(c))
+        SET_ADD(set, c);
+    return true;
+}
+
+
+static void invert(unsigned char *set)
+{
+    int i;
+
+    for (i=0; i<32; ++i)
+      set[i] = ~set[i];
+}
+
+
+/* \w \W \s \S (as glibc has them), anything else escaped is itself */
+static void add_escape(unsigned char *set, char c)
+{
+    int i;
+    unsigned char cl[32] = {0};
+
+    switch (c)
+    {
+        case 'w': case 'W':
+            add_class(cl, "alnum", 5);
+            SET_ADD(cl, '_');
+            break;
+        case 's': case 'S':
+            add_class(cl, "space", 5);
+            break;
+        default:
+            SET_ADD(set, c);
+            return;
+    }
+
+    if (isupper((unsigned char)c))
+      invert(cl);
+    for (i=0; i<32; ++i)
+      set[i] |= cl[i];
+}
+
+
+/* Bracket expression, after the '[' */
+static tree_t *parse_bracket(parser_t *ps)
+{
+    int c, last;
+    _Bool negate = false, first;
+    const char *en;
+    tree_t *t;
+
+    if (!(t = new_tree(ps, T_SET, NULL, NULL)))
+      return NULL;
+    if (*ps->p == '^')
+    {
+        negate = true;
+        ++ps->p;
+    }
+
+    /* A ']' first is literal */
+    for (first=true, last=-1; *ps->p && (*ps->p != ']' || first); first=false)
+    {
+        c = (unsigned char)*ps->p++;
+
+        /* [:class:] */
+        if (c == '[' && *ps->p == ':' && (en = strstr(ps->p + 1, ":]")))
+        {
+            if (!add_class(t->set, ps->p + 1, en - ps->p - 1))
+            {
+                ps->error = "unknown character class";
+                free_tree(t);
+                return NULL;
+            }
+            ps->p = en + 2;
+            last = 256; /* Not the start of a range */
+            continue;
+        }
+
+        /* Range: a-z */
+        if (c == '-' && last >= 0 && last < 256 && *ps->p && *ps->p != ']')
+        {
+            c = (unsigned char)*ps->p++;
+            if (c < last)
+            {
+                ps->error = "invalid range";
+                free_tree(t);
+                return NULL;
+            }
+            for ( ; last<=c; ++last)
+              SET_ADD(t->set, last);
+            last = 256;
+            continue;
+        }
+
+        SET_ADD(t->set, c);
+        last = c;
+    }
+
+    if (*ps->p != ']')
+    {
+        ps->error = "unmatched [";
+        free_tree(t);
+        return NULL;
+    }
+    ++ps->p;
+
+    if (negate)
+      invert(t->set);
+    return t;
+}
+
+
+static tree_t *parse_alt(parser_t *ps);
+
+
+static tree_t *parse_atom(parser_t *ps)
+{
+    tree_t *t;
+    char c = *ps->p++;
+
+    switch (c)
+    {
+        case '(':
+            if (++ps->depth > 1000)
+            {
+                ps->error = "too deeply nested";
+                return NULL;
+            }
+            if (!(t = parse_alt(ps)))
+              return NULL;
+            --ps->depth;
+            if (*ps->p != ')')
+            {
+                ps->error = "unmatched (";
+                free_tree(t);
+                return NULL;
+            }
+            ++ps->p;
+            return t;
+
+        case '[':
+            return parse_bracket(ps);
+
+        case '^':
+            return new_tree(ps, T_BOL, NULL, NULL);
+        case '$':
+            return new_tree(ps, T_EOL, NULL, NULL);
+
+        case '.':
+            if ((t = new_tree(ps, T_SET, NULL, NULL)))
+              memset(t->set, 0xFF, sizeof(t->set));
+            return t;
+
+        case '\\':
+            if (!*ps->p)
+            {
+                ps->error = "trailing \\";
+                return NULL;
+            }
+            if ((t = new_tree(ps, T_SET, NULL, NULL)))
+              add_escape(t->set, *ps->p++);
+            return t;
+
+        case '*': case '+': case '?': case '{':
+            ps->error = "repetition of nothing";
+            return NULL;
+
+        default:
+            if ((t = new_tree(ps, T_SET, NULL, NULL)))
+              SET_ADD(t->set, c);
+            return t;
+    }
+}
+
+
+/* "{m}", "{m,}" or "{m,n}" after the '{' */
+static _Bool parse_bounds(parser_t *ps, int *min, int *max)
+{
+    char *en;
+
+    *min = strtol(ps->p, &en, 10);
+    if (en == ps->p)
+      return false;
+    ps->p = en;
+    *max = *min;
+    if (*ps->p == ',')
+    {
+        ++ps->p;
+        *max = -1;
+        if (isdigit((unsigned char)*ps->p))
+        {
+            *max = strtol(ps->p, &en, 10);
+            ps->p = en;
+        }
+    }
+    if (*ps->p != '}')
+      return false;
+    ++ps->p;
+    return true;
+}
+
+
+static tree_t *parse_piece(parser_t *ps)
+{
+    int min, max;
+    tree_t *t, *rep;
+
+    if (!(t = parse_atom(ps)))
+      return NULL;
+
+    while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?' || *ps->p == '{')
+    {
+        switch (*ps->p++)
+        {
+            case '*': min = 0; max = -1; break;
+            case '+': min = 1; max = -1; break;
+            case '?': min = 0; max = 1;  break;
+            default:
+                if (!parse_bounds(ps, &min, &max) || min > MAX_REPEAT ||
+                    max > MAX_REPEAT || (max >= 0 && max < min))
+                {
+                    ps->error = "invalid repetition";
+                    free_tree(t);
+                    return NULL;
+                }
+                break;
+        }
+
+        if (!(rep = new_tree(ps, T_REPEAT, t, NULL)))
+        {
+            free_tree(t);
+            return NULL;
+        }
+        rep->min = min;
+        rep->max = max;
+        t = rep;
+    }
+
+    return t;
+}
+
+
+static tree_t *parse_cat(parser_t *ps)
+{
+    tree_t *t = NULL, *piece, *cat;
+
+    while (*ps->p && *ps->p != '|' && *ps->p != ')')
+    {
+        if (!(piece = parse_piece(ps)))
+        {
+            free_tree(t);
+            return NULL;
+        }
+        if (!t)
+          t = piece;
+        else if ((cat = new_tree(ps, T_CAT, t, piece)))
+          t = cat;
+        else
+        {
+            free_tree(t);
+            free_tree(piece);
+            return NULL;
+        }
+    }
+
+    return t ? t : new_tree(ps, T_EMPTY, NULL, NULL);
+}
+
+
+static tree_t *parse_alt(parser_t *ps)
+{
+    tree_t *t, *r, *alt;
+
+    if (!(t = parse_cat(ps)))
+      return NULL;
+
+    while (*ps->p == '|')
+    {
+        ++ps->p;
+        if (!(r = parse_cat(ps)))
+        {
+            free_tree(t);
+            return NULL;
+        }
+        if (!(alt = new_tree(ps, T_ALT, t, r)))
+        {
+            free_tree(t);
+            free_tree(r);
+            return NULL;
+        }
+        t = alt;
+    }
+
+    return t;
+}
+
+
+/*
+ * NFA
+ */
+
+static int new_node(ere_t *re, int type, int out, int out1)
+{
+    ere_node_t *tmp;
+
+    if (re->n_nodes == MAX_NFA)
+      return -1;
+    if (re->n_nodes == re->max_nodes)
+    {
+        re->max_nodes = re->max_nodes ? re->max_nodes * 2 : 64;
+        if (!(tmp = realloc(re->nodes, sizeof(ere_node_t) * re->max_nodes)))
+          return -1;
+        re->nodes = tmp;
+    }
+
+    re->nodes[re->n_nodes].type = type;
+    re->nodes[re->n_nodes].out = out;
+    re->nodes[re->n_nodes].out1 = out1;
+    re->nodes[re->n_nodes].set = -1;
+    return re->n_nodes++;
+}
+
+
+static int new_set(ere_t *re, const unsigned char *set)
+{
+    unsigned char (*tmp)[32];
+
+    if (re->n_sets == re->max_sets)
+    {
+        re->max_sets = re->max_sets ? re->max_sets * 2 : 16;
+        if (!(tmp = realloc(re->sets, 32 * re->max_sets)))
+          return -1;
+        re->sets = tmp;
+    }
+
+    memcpy(re->sets[re->n_sets], set, 32);
+    return re->n_sets++;
+}
+
+
+/* Compile 't' into nodes that go on to node 'next' once 't' has matched.
+ * Returns the node to start 't' from, or -1 if it is too big.
+ */
+static int compile(ere_t *re, const tree_t *t, int next)
+{
+    int i, s, n, opt;
+
+    if (next < 0)
+      return -1;
+
+    switch (t->type)
+    {
+        case T_SET:
+            if ((s = new_node(re, ERE_SET, next, -1)) >= 0 &&
+                (re->nodes[s].set = new_set(re, t->set)) < 0)
+              return -1;
+            return s;
+
+        case T_CAT:
+            return compile(re, t->l, compile(re, t->r, next));
+
+        case T_ALT:
+            if ((s = new_node(re, ERE_SPLIT, -1, -1)) < 0)
+              return -1;
+            n = compile(re, t->l, next);
+            re->nodes[s].out = n;
+            n = compile(re, t->r, next);
+            re->nodes[s].out1 = n;
+            return (re->nodes[s].out < 0 || n < 0) ? -1 : s;
+
+        case T_BOL:
+            return new_node(re, ERE_BOL, next, -1);
+        case T_EOL:
+            return new_node(re, ERE_EOL, next, -1);
+        case T_EMPTY:
+            return next;
+
+        default: /* T_REPEAT: x{min,max} is 'min' x's, then the rest */
+            if (t->max < 0)
+            {
+                /* x*: Loop back to a split between x and going on */
+                if ((s = new_node(re, ERE_SPLIT, -1, next)) < 0 ||
+                    (n = compile(re, t->l, s)) < 0)
+                  return -1;
+                re->nodes[s].out = n;
+                opt = s;
+            }
+            else
+            {
+                /* Up to max-min more: (x(x(x)?)?)? */
+                for (opt=next, i=t->min; i<t->max && opt>=0; ++i)
+                  if ((n = compile(re, t->l, opt)) < 0 ||
+                      (opt = new_node(re, ERE_SPLIT, n, next)) < 0)
+                    return -1;
+            }
+
+            for (i=0; i<t->min && opt>=0; ++i)
+              opt = compile(re, t->l, opt);
+            return opt;
+    }
+}
+
+
+/* Split the bytes into classes that every set either has all or none of.
+ * '\n' is in a class of its own (it is never looked up).
+ */
+static void make_classes(ere_t *re)
+{
+    int i, c, n, map[512];
+    unsigned char cl[256];
+
+    memset(cl, 0, sizeof(cl));
+    cl['\n'] = 1;
+    re->n_classes = 2;
+
+    for (i=0; i<re->n_sets; ++i)
+    {
+        for (c=0; c<512; ++c)
+          map[c] = -1;
+        for (n=0, c=0; c<256; ++c)
+        {
+            int k = cl[c] * 2 + (SET_HAS(re->sets[i], c) ? 1 : 0);
+            if (map[k] < 0)
+              map[k] = n++;
+            cl[c] = map[k];
+        }
+        re->n_classes = n;
+    }
+
+    memcpy(re->classes, cl, sizeof(cl));
+    re->newline_class = cl['\n'];
+}
+
+
+/*
+ * Required literals: Strings that every match contains, worked out from the
+ * parse tree as codesearch does (each part's exact string if it only ever
+ * matches one, else what every match of it starts and ends with and has
+ * somewhere).  They are kept to MAX_LIT bytes: A piece of a required string
+ * is still required.
+ */
+
+#define MAX_LIT  64
+#define MAX_MUST 8
+
+typedef struct
+{
+    int  len;
+    char s[MAX_LIT];
+} lit_t;
+
+typedef struct
+{
+    _Bool exact;          /* Only ever matches 'pre' (and 'suf' is the same) */
+    lit_t pre, suf;       /* What every match starts and ends with          */
+    int   n_must;
+    lit_t must[MAX_MUST]; /* What every match has somewhere                 */
+} info_t;
+
+
+/* 'a' followed by 'b', keeping the start (or the end) if it is too long */
+static void lit_cat(lit_t *out, const lit_t *a, const lit_t *b, _Bool keep_end)
+{
+    int i, len = a->len + b->len, skip = 0;
+    char buf[2 * MAX_LIT];
+
+    memcpy(buf, a->s, a->len);
+    memcpy(buf + a->len, b->s, b->len);
+    if (len > MAX_LIT)
+    {
+        skip = keep_end ? len - MAX_LIT : 0;
+        len = MAX_LIT;
+    }
+    for (i=0; i<len; ++i)
+      out->s[i] = buf[skip + i];
+    out->len = len;
+}
+
+
+/* Add 'lit' to what 'info' requires, replacing the shortest when full */
+static void add_must(info_t *info, const lit_t *lit)
+{
+    int i, shortest = 0;
+
+    if (lit->len == 0)
+      return;
+    for (i=0; i<info->n_must; ++i)
+    {
+        if (info->must[i].len == lit->len &&
+            memcmp(info->must[i].s, lit->s, lit->len) == 0)
+          return;
+        if (info->must[i].len < info->must[shortest].len)
+          shortest = i;
+    }
+
+    if (info->n_must < MAX_MUST)
+      info->must[info->n_must++] = *lit;
+    else if (info->must[shortest].len < lit->len)
+      info->must[shortest] = *lit;
+}
+
+
+/* An exact string that was cut short is only known to start and end so */
+static void set_exact(info_t *info, const lit_t *pre, const lit_t *suf,
+                      _Bool fits)
+{
+    info->exact = fits;
+    info->pre = *pre;
+    info->suf = *suf;
+    if (!fits)
+    {
+        add_must(info, pre);
+        add_must(info, suf);
+    }
+}
+
+
+static void analyze(const tree_t *t, info_t *info)
+{
+    int i, c, n;
+    info_t *l, *r;
+    lit_t pre, suf;
+
+    memset(info, 0, sizeof(info_t));
+
+    switch (t->type)
+    {
+        case T_SET:
+            for (n=0, c=0; c<256; ++c)
+              if (SET_HAS(t->set, c) && n++ == 0)
+                info->pre.s[0] = c;
+            info->exact = (n == 1 && info->pre.s[0] != '\n');
+            info->pre.len = info->exact;
+            info->suf = info->pre;
+            return;
+
+        case T_BOL: case T_EOL: case T_EMPTY:
+            info->exact = true;
+            return;
+
+        case T_REPEAT:
+            if (t->min == 0)
+              return;
+            analyze(t->l, info);
+            if (!info->exact)
+              return;
+
+            /* Exact child: 'min' of it are certain */
+            pre = suf = info->pre;
+            for (i=1; i<t->min && pre.len<MAX_LIT; ++i)
+            {
+                lit_cat(&pre, &pre, &info->pre, false);
+                lit_cat(&suf, &info->suf, &suf, true);
+            }
+            set_exact(info, &pre, &suf, t->min == t->max &&
+                      info->pre.len * t->min <= MAX_LIT);
+            if (!info->exact)
+              add_must(info, &pre);
+            return;
+
+        default:
+            break;
+    }
+
+    /* T_CAT and T_ALT */
+    if (!(l = malloc(2 * sizeof(info_t))))
+      return; /* Nothing known is still right */
+    r = l + 1;
+    analyze(t->l, l);
+    analyze(t->r, r);
+
+    if (t->type == T_ALT)
+    {
+        /* Only what both sides start and end with */
+        info->exact = l->exact && r->exact && l->pre.len == r->pre.len &&
+                      memcmp(l->pre.s, r->pre.s, l->pre.len) == 0;
+        for (n=0; n<l->pre.len && n<r->pre.len && l->pre.s[n]==r->pre.s[n];
+             ++n)
+          info->pre.s[n] = l->pre.s[n];
+        info->pre.len = n;
+        for (n=0; n<l->suf.len && n<r->suf.len &&
+             l->suf.s[l->suf.len-1-n] == r->suf.s[r->suf.len-1-n]; ++n)
+          ;
+        memcpy(info->suf.s, l->suf.s + l->suf.len - n, n);
+        info->suf.len = n;
+    }
+    else if (l->exact && r->exact)
+    {
+        lit_cat(&pre, &l->pre, &r->pre, false);
+        lit_cat(&suf, &l->suf, &r->suf, true);
+        set_exact(info, &pre, &suf, l->pre.len + r->pre.len <= MAX_LIT);
+    }
+    else
+    {
+        /* Both sides' requirements, and where they meet */
+        for (i=0; i<l->n_must; ++i)
+          add_must(info, &l->must[i]);
+        for (i=0; i<r->n_must; ++i)
+          add_must(info, &r->must[i]);
+        lit_cat(&pre, &l->suf, &r->pre, false);
+        add_must(info, &pre);
+
+        if (l->exact)
+          lit_cat(&info->pre, &l->pre, &r->pre, false);
+        else
+          info->pre = l->pre;
+        if (r->exact)
+          lit_cat(&info->suf, &l->suf, &r->suf, true);
+        else
+          info->suf = r->suf;
+    }
+
+    free(l);
+}
+
+
+/* Keep the literals of the whole pattern in 're' (leaving out any that is
+ * part of another)
+ */
+static _Bool set_literals(ere_t *re, const tree_t *t)
+{
+    int i, j;
+    info_t *info;
+    const lit_t *a, *b;
+
+    if (!(info = malloc(sizeof(info_t))))
+      return false;
+    analyze(t, info);
+    add_must(info, &info->pre);
+    add_must(info, &info->suf);
+
+    if (!(re->literals = calloc(info->n_must + 1, sizeof(char *))))
+    {
+        free(info);
+        return false;
+    }
+
+    for (i=0; i<info->n_must; ++i)
+    {
+        a = &info->must[i];
+        for (j=0; j<info->n_must; ++j)
+        {
+            b = &info->must[j];
+            if (j != i && b->len >= a->len &&
+                (b->len > a->len || j < i) &&
+                pdf_memmem(b->s, b->len, a->s, a->len))
+              break;
+        }
+        if (j < info->n_must)
+          continue;
+
+        if (!(re->literals[re->n_literals] = malloc(a->len + 1)))
+        {
+            free(info);
+            return false;
+        }
+        memcpy(re->literals[re->n_literals], a->s, a->len);
+        re->literals[re->n_literals++][a->len] = '\0';
+    }
+
+    free(info);
+    return true;
+}
+
+
+ere_t *ere_compile(const char *pattern, const char **error)
+{
+    tree_t *t;
+    ere_t *re;
+    parser_t ps;
+
+    memset(&ps, 0, sizeof(parser_t));
+    ps.p = pattern;
+    *error = NULL;
+
+    t = parse_alt(&ps);
+    if (t && *ps.p)
+      ps.error = "unmatched )";
+    if (!t || ps.error)
+    {
+        free_tree(t);
+        *error = ps.error ? ps.error : "out of memory";
+        return NULL;
+    }
+
+    if (!(re = calloc(1, sizeof(ere_t))))
+    {
+        free_tree(t);
+        *error = "out of memory";
+        return NULL;
+    }
+
+    re->match = new_node(re, ERE_MATCH, -1, -1);
+    re->start = compile(re, t, re->match);
+    if (!set_literals(re, t))
+    {
+        free_tree(t);
+        ere_free(re);
+        *error = "out of memory";
+        return NULL;
+    }
+    free_tree(t);
+    if (re->match < 0 || re->start < 0)
+    {
+        ere_free(re);
+        *error = "pattern is too big";
+        return NULL;
+    }
+
+    make_classes(re);
+    return re;
+}
+
+
+void ere_free(ere_t *re)
+{
+    int i;
+
+    if (!re)
+      return;
+    for (i=0; re->literals && i<re->n_literals; ++i)
+      free(re->literals[i]);
+    free(re->literals);
+    free(re->nodes);
+    free(re->sets);
+    free(re);
+}
+
+
+/*
+ * Lazy DFA
+ */
+
+#define F_ACCEPT     0x1 /* A match ends here                  */
+#define F_ACCEPT_EOL 0x2 /* A match ends here if the line does */
+
+
+/* Add the closure of node 'n' to the scanner's scratch set: Everything
+ * reachable without reading a byte.  '^' only passes at the start of a line
+ * and '$' at the end.
+ */
+static void closure(ere_dfa_t *dfa, int n, _Bool bol, _Bool eol)
+{
+    int sp = 0;
+    const ere_node_t *node;
+    const ere_t *re = dfa->re;
+
+    dfa->stack[sp++] = n;
+    while (sp)
+    {
+        n = dfa->stack[--sp];
+        if (n < 0 || dfa->mark[n] == dfa->gen)
+          continue;
+        dfa->mark[n] = dfa->gen;
+
+        node = &re->nodes[n];
+        switch (node->type)
+        {
+            case ERE_SPLIT:
+                dfa->stack[sp++] = node->out1;
+                dfa->stack[sp++] = node->out;
+                break;
+            case ERE_BOL:
+                if (bol)
+                  dfa->stack[sp++] = node->out;
+                break;
+            case ERE_EOL:
+                dfa->set[dfa->set_len++] = n; /* For the end of line check */
+                if (eol)
+                  dfa->stack[sp++] = node->out;
+                break;
+            default: /* ERE_SET and ERE_MATCH */
+                dfa->set[dfa->set_len++] = n;
+                break;
+        }
+    }
+}
+
+
+static int cmp_ints(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+
+static unsigned hash_set(const int *set, int len)
+{
+    int i;
+    unsigned h = 2166136261u;
+
+    for (i=0; i<len; ++i)
+      h = (h ^ set[i]) * 16777619u;
+    return h;
+}
+
+
+/* Forget all DFA states */
+static void clear_states(ere_dfa_t *dfa)
+{
+    dfa->n_states = 0;
+    dfa->sets_used = 0;
+    memset(dfa->hash, 0, sizeof(int) * dfa->hash_size);
+    ++dfa->flushes;
+}
+
+
+/* Whether the NFA states in the scratch set reach a match if the line ends */
+static _Bool accepts_at_eol(ere_dfa_t *dfa, int first, int len)
+{
+    int i, n, *set;
+    _Bool accept = false;
+
+    for (i=0; i<len; ++i)
+      if (dfa->re->nodes[dfa->set[first + i]].type == ERE_EOL)
+        break;
+    if (i == len)
+      return false;
+
+    /* Follow the '$'s (after what is in the set) and look for the match */
+    set = dfa->set + first;
+    ++dfa->gen;
+    n = dfa->set_len;
+    for (i=0; i<len; ++i)
+      if (dfa->re->nodes[set[i]].type == ERE_EOL)
+        closure(dfa, dfa->re->nodes[set[i]].out, false, true);
+    for (i=n; i<dfa->set_len; ++i)
+      if (dfa->set[i] == dfa->re->match)
+        accept = true;
+    dfa->set_len = n;
+    return accept;
+}
+
+
+/* The DFA state for the NFA states in the scratch set (sorting it), adding it
+ * if it is new.  Returns -1 if there is no room for it.
+ */
+static int add_state(ere_dfa_t *dfa)
+{
+    int i, h, s, len = dfa->set_len, *tmp;
+    const int *set;
+
+    qsort(dfa->set, len, sizeof(int), cmp_ints);
+
+    /* Known? */
+    h = hash_set(dfa->set, len) & (dfa->hash_size - 1);
+    for ( ; (s = dfa->hash[h] - 1) >= 0; h=(h+1)&(dfa->hash_size-1))
+    {
+        set = dfa->sets + dfa->set_off[s];
+        if (dfa->set_lens[s] == len &&
+            memcmp(set, dfa->set, sizeof(int) * len) == 0)
+          return s;
+    }
+
+    if (dfa->n_states == MAX_DFA_STATES)
+      return -1;
+
+    if (dfa->sets_used + len > dfa->sets_max)
+    {
+        for (i=dfa->sets_max ? dfa->sets_max : 1024;
+             i<dfa->sets_used+len; )
+          i *= 2;
+        if (!(tmp = realloc(dfa->sets, sizeof(int) * i)))
+          return -1;
+        dfa->sets = tmp;
+        dfa->sets_max = i;
+    }
+
+    s = dfa->n_states++;
+    dfa->hash[h] = s + 1;
+    dfa->set_off[s] = dfa->sets_used;
+    dfa->set_lens[s] = len;
+    memcpy(dfa->sets + dfa->sets_used, dfa->set, sizeof(int) * len);
+    dfa->sets_used += len;
+    for (i=0; i<dfa->re->n_classes; ++i)
+      dfa->trans[s * dfa->re->n_classes + i] = -1;
+
+    dfa->flags[s] = 0;
+    for (i=0; i<len; ++i)
+      if (dfa->set[i] == dfa->re->match)
+        dfa->flags[s] |= F_ACCEPT;
+    dfa->set_len = len;
+    if (accepts_at_eol(dfa, 0, len))
+      dfa->flags[s] |= F_ACCEPT_EOL;
+
+    return s;
+}
+
+
+/* States 0 and 1: At the start of a line, and anywhere else (which every
+ * state includes, so the match can start anywhere)
+ */
+static void add_start_states(ere_dfa_t *dfa)
+{
+    dfa->set_len = 0;
+    ++dfa->gen;
+    closure(dfa, dfa->re->start, true, false);
+    add_state(dfa);
+
+    dfa->set_len = 0;
+    ++dfa->gen;
+    closure(dfa, dfa->re->start, false, false);
+    add_state(dfa);
+}
+
+
+/* Work out the transition of state 's' on byte 'c' */
+static int step(ere_dfa_t *dfa, int s, unsigned char c)
+{
+    int i, t, len, *set;
+    const ere_node_t *node;
+    const ere_t *re = dfa->re;
+
+    /* The set is copied out (past where closures can reach), so that starting
+     * over does not lose it
+     */
+    len = dfa->set_lens[s];
+    set = dfa->set + 2 * re->n_nodes;
+    memcpy(set, dfa->sets + dfa->set_off[s], sizeof(int) * len);
+
+    dfa->set_len = 0;
+    ++dfa->gen;
+    for (i=0; i<len; ++i)
+    {
+        node = &re->nodes[set[i]];
+        if (node->type == ERE_SET && SET_HAS(re->sets[node->set], c))
+          closure(dfa, node->out, false, false);
+    }
+    closure(dfa, re->start, false, false);
+
+    if ((t = add_state(dfa)) < 0)
+    {
+        /* Full: Start over with just the start states and this one */
+        len = dfa->set_len;
+        memcpy(set, dfa->set, sizeof(int) * len);
+        clear_states(dfa);
+        add_start_states(dfa);
+        memcpy(dfa->set, set, sizeof(int) * len);
+        dfa->set_len = len;
+        return add_state(dfa);
+    }
+
+    dfa->trans[s * re->n_classes + re->classes[c]] = t;
+    return t;
+}
+
+
+ere_dfa_t *ere_dfa_new(const ere_t *re)
+{
+    ere_dfa_t *dfa;
+
+    if (!(dfa = calloc(1, sizeof(ere_dfa_t))))
+      return NULL;
+    dfa->re = re;
+    dfa->hash_size = 2 * MAX_DFA_STATES;
+    dfa->trans = malloc(sizeof(int) * MAX_DFA_STATES * re->n_classes);
+    dfa->flags = malloc(MAX_DFA_STATES);
+    dfa->set_off = malloc(sizeof(int) * MAX_DFA_STATES);
+    dfa->set_lens = malloc(sizeof(int) * MAX_DFA_STATES);
+    dfa->hash = calloc(dfa->hash_size, sizeof(int));
+    dfa->mark = calloc(re->n_nodes, sizeof(unsigned));
+    dfa->stack = malloc(sizeof(int) * (re->n_nodes * 2 + 2));
+    dfa->set = malloc(sizeof(int) * re->n_nodes * 3); /* See step() */
+    if (!dfa->trans || !dfa->flags || !dfa->set_off || !dfa->set_lens ||
+        !dfa->hash || !dfa->mark || !dfa->stack || !dfa->set)
+    {
+        ere_dfa_free(dfa);
+        return NULL;
+    }
+
+    add_start_states(dfa);
+    dfa->flushes = 0;
+    ere_dfa_reset(dfa);
+    return dfa;
+}
+
+
+void ere_dfa_free(ere_dfa_t *dfa)
+{
+    if (!dfa)
+      return;
+    free(dfa->trans);
+    free(dfa->flags);
+    free(dfa->set_off);
+    free(dfa->set_lens);
+    free(dfa->hash);
+    free(dfa->sets);
+    free(dfa->mark);
+    free(dfa->stack);
+    free(dfa->set);
+    free(dfa);
+}
+
+
+void ere_dfa_reset(ere_dfa_t *dfa)
+{
+    dfa->state = 0;
+    dfa->matched = (dfa->flags[0] & F_ACCEPT) != 0;
+}
+
+
+_Bool ere_dfa_scan(ere_dfa_t *dfa, const char *text, size_t len)
+{
+    int s = dfa->state, t;
+    const int n_classes = dfa->re->n_classes;
+    const unsigned char *p = (const unsigned char *)text, *end = p + len;
+    const unsigned char *classes = dfa->re->classes;
+
+    if (dfa->matched)
+      return true;
+
+    while (p < end)
+    {
+        if (*p == '\n')
+        {
+            if (dfa->flags[s] & F_ACCEPT_EOL)
+              break;
+            s = 0;
+        }
+        else if ((t = dfa->trans[s * n_classes + classes[*p]]) >= 0)
+          s = t;
+        else
+          s = step(dfa, s, *p);
+        ++p;
+
+        if (dfa->flags[s] & F_ACCEPT)
+          break;
+    }
+
+    dfa->state = s;
+    if (p < end || (dfa->flags[s] & F_ACCEPT))
+      dfa->matched = true;
+    return dfa->matched;
+}
+
+
+_Bool ere_dfa_end(ere_dfa_t *dfa)
+{
+    if (dfa->flags[dfa->state] & F_ACCEPT_EOL)
+      dfa->matched = true;
+    return dfa->matched;
+}
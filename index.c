@@ -0,0 +1,564 @@
+/******************************************************************************
+ * index.c
+ *
+ * pdfsearch - Search PDF text-contents from shell
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of pdfsearch.
+ * pdfsearch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pdfsearch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pdfsearch.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Trigram index: The text of every page of a set of documents, and for each
+ * trigram of that text the pages it is on.  A query looks up the trigrams of
+ * what it needs, intersects their pages and then only has to check the text of
+ * the pages left, which is all in the index (the PDFs are not read).
+ *
+ * The file is laid out to be used straight from a mapping:
+ *
+ *   header    index_header_t
+ *   text      The text of all pages, one after the other
+ *   pages     n_pages + 1 offsets (into text) of where each page starts
+ *   docs      index_doc_t for each document, in the order indexed
+ *   names     The documents' file names, NUL terminated
+ *   trigrams  index_trigram_t for each trigram, in order of trigram
+ *   postings  For each trigram its pages (numbered across all documents) as
+ *             varints, each the difference from the page before (plus one)
+ *
+ * Numbers are in the byte order of the machine that wrote it (the header has
+ * a magic number to catch a mismatch) and the tables are 8 byte aligned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "search.h"
+
+
+#define INDEX_MAGIC   "NachoIdx"
+#define INDEX_VERSION 1
+#define INDEX_ENDIAN  0x01020304 /* Reads differently on the wrong machine */
+
+
+#define ALIGN8(_n) (((_n) + 7) & ~(uint64_t)7)
+
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+int index_trigrams(const char *text, size_t len, uint32_t **tris, int *max)
+{
+    int i, n = 0, have = 0;
+    size_t j;
+    uint32_t t = 0, *tmp;
+
+    for (j=0; j<len; ++j)
+    {
+        /* Spaces and tabs are left out, trigrams do not cross lines */
+        if (text[j] == ' ' || text[j] == '\t')
+          continue;
+        if (text[j] == '\n')
+        {
+            have = 0;
+            continue;
+        }
+
+        t = ((t << 8) | (unsigned char)text[j]) & 0xFFFFFF;
+        if (++have < 3)
+          continue;
+
+        if (n == *max)
+        {
+            i = *max ? *max * 2 : 1024;
+            if (!(tmp = realloc(*tris, sizeof(uint32_t) * i)))
+              return -1;
+            *tris = tmp;
+            *max = i;
+        }
+        (*tris)[n++] = t;
+    }
+
+    /* Each once, in order */
+    if (n > 1)
+      qsort(*tris, n, sizeof(uint32_t), cmp_u32);
+    for (i=0, j=0; i<n; ++i)
+      if (j == 0 || (*tris)[i] != (*tris)[j-1])
+        (*tris)[j++] = (*tris)[i];
+    return (int)j;
+}
+
+
+/*
+ * Writing
+ */
+
+/* Write 'len' bytes, 'false' if that failed */
+static _Bool put(index_writer_t *w, const void *data, size_t len)
+{
+    if (len && fwrite(data, 1, len, w->fp) != len)
+      w->failed = true;
+    w->pos += len;
+    return !w->failed;
+}
+
+
+/* Pad to the next multiple of 8 */
+static void pad(index_writer_t *w)
+{
+    static const char zeros[8] = {0};
+    put(w, zeros, ALIGN8(w->pos) - w->pos);
+}
+
+
+index_writer_t *index_create(const char *fname)
+{
+    index_writer_t *w;
+    index_header_t hdr;
+
+    if (!(w = calloc(1, sizeof(index_writer_t))))
+      return NULL;
+    if (!(w->fp = fopen(fname, "wb")))
+    {
+        free(w);
+        return NULL;
+    }
+
+    /* The header is filled in at the end */
+    memset(&hdr, 0, sizeof(hdr));
+    put(w, &hdr, sizeof(hdr));
+    return w;
+}
+
+
+/* Make room for one more in array '_a' of 'w' (returning if out of memory) */
+#define GROW(_a, _n, _max, _first) \
+    if ((_n) == (_max)) \
+    { \
+        size_t _new = (_max) ? (_max) * 2 : (_first); \
+        void *_tmp = realloc((_a), sizeof(*(_a)) * _new); \
+        if (!_tmp) \
+        { \
+            w->failed = true; \
+            return false; \
+        } \
+        (_a) = _tmp; \
+        (_max) = _new; \
+    }
+
+
+_Bool index_add_doc(index_writer_t *w, const char *fname)
+{
+    size_t len = strlen(fname) + 1;
+
+    GROW(w->docs, w->n_docs, w->max_docs, 64);
+    while (w->names_len + len > w->names_max)
+    {
+        char *tmp = realloc(w->names, w->names_max ? w->names_max * 2 : 4096);
+        if (!tmp)
+        {
+            w->failed = true;
+            return false;
+        }
+        w->names = tmp;
+        w->names_max = w->names_max ? w->names_max * 2 : 4096;
+    }
+
+    w->docs[w->n_docs].name = w->names_len;
+    w->docs[w->n_docs].first_page = w->n_pages;
+    w->docs[w->n_docs].n_pages = 0;
+    ++w->n_docs;
+    memcpy(w->names + w->names_len, fname, len);
+    w->names_len += len;
+    return true;
+}
+
+
+_Bool index_add_page(
+    index_writer_t *w,
+    const char     *text,
+    size_t          len,
+    const uint32_t *tris,
+    int             n_tris)
+{
+    int i;
+
+    if (!w->n_docs || w->n_pages == UINT32_MAX - 1)
+      return false;
+
+    GROW(w->pages, w->n_pages, w->max_pages, 1024);
+    w->pages[w->n_pages] = w->pos - sizeof(index_header_t);
+    if (!put(w, text, len))
+      return false;
+
+    for (i=0; i<n_tris; ++i)
+    {
+        GROW(w->pairs, w->n_pairs, w->max_pairs, 1 << 16);
+        w->pairs[w->n_pairs++] = ((uint64_t)tris[i] << 32) | w->n_pages;
+    }
+
+    ++w->n_pages;
+    ++w->docs[w->n_docs - 1].n_pages;
+    return true;
+}
+
+
+/* Add 'v' to 'buf' as a varint (7 bits a byte, low first, the top bit set on
+ * all but the last byte)
+ */
+static int put_varint(unsigned char *buf, uint32_t v)
+{
+    int n = 0;
+
+    while (v >= 0x80)
+    {
+        buf[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+
+_Bool index_finish(index_writer_t *w)
+{
+    size_t i, j;
+    int n;
+    uint32_t prev;
+    uint64_t postings_len = 0, text_end;
+    unsigned char vbuf[8];
+    index_header_t hdr;
+    index_trigram_t tri;
+    _Bool ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = INDEX_VERSION;
+    hdr.endian = INDEX_ENDIAN;
+    hdr.n_docs = w->n_docs;
+    hdr.n_pages = w->n_pages;
+
+    /* Page offsets, ending with the end of the text */
+    text_end = w->pos - sizeof(index_header_t);
+    pad(w);
+    hdr.pages_off = w->pos;
+    put(w, w->pages, sizeof(uint64_t) * w->n_pages);
+    put(w, &text_end, sizeof(uint64_t));
+
+    hdr.docs_off = w->pos;
+    put(w, w->docs, sizeof(index_doc_t) * w->n_docs);
+    hdr.names_off = w->pos;
+    put(w, w->names, w->names_len);
+    pad(w);
+
+    /* Trigram table: The pairs sorted give each trigram's pages in order */
+    if (w->n_pairs > 1)
+      qsort(w->pairs, w->n_pairs, sizeof(uint64_t), cmp_u64);
+    hdr.trigrams_off = w->pos;
+    for (i=0; i<w->n_pairs; i=j)
+    {
+        tri.trigram = w->pairs[i] >> 32;
+        for (j=i; j<w->n_pairs && (w->pairs[j] >> 32) == tri.trigram; ++j)
+          ;
+        tri.n_pages = j - i;
+        tri.postings = postings_len;
+        for (prev=0; i<j; ++i)
+        {
+            postings_len += put_varint(vbuf, (uint32_t)w->pairs[i] - prev);
+            prev = (uint32_t)w->pairs[i] + 1;
+        }
+        put(w, &tri, sizeof(tri));
+        ++hdr.n_trigrams;
+    }
+
+    /* Postings, in the same order */
+    hdr.postings_off = w->pos;
+    for (i=0; i<w->n_pairs; i=j)
+      for (prev=0, j=i; j<w->n_pairs && (w->pairs[j]>>32)==(w->pairs[i]>>32);
+           ++j)
+      {
+          n = put_varint(vbuf, (uint32_t)w->pairs[j] - prev);
+          prev = (uint32_t)w->pairs[j] + 1;
+          put(w, vbuf, n);
+      }
+    hdr.size = w->pos;
+
+    /* Now the header */
+    if (fseek(w->fp, 0, SEEK_SET) != 0 ||
+        fwrite(&hdr, sizeof(hdr), 1, w->fp) != 1)
+      w->failed = true;
+    if (fclose(w->fp) != 0)
+      w->failed = true;
+
+    ok = !w->failed;
+    free(w->pages);
+    free(w->docs);
+    free(w->names);
+    free(w->pairs);
+    free(w);
+    return ok;
+}
+
+
+/*
+ * Reading
+ */
+
+index_t *index_open(const char *fname, const char **error)
+{
+    int fd;
+    struct stat st;
+    index_t *idx;
+    const index_header_t *hdr;
+
+    *error = "out of memory";
+    if (!(idx = calloc(1, sizeof(index_t))))
+      return NULL;
+
+    *error = "could not open it";
+    if ((fd = open(fname, O_RDONLY)) == -1)
+    {
+        free(idx);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(index_header_t) ||
+        (idx->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+        MAP_FAILED)
+    {
+        if (fstat(fd, &st) == 0 && st.st_size < sizeof(index_header_t))
+          *error = "not an index";
+        close(fd);
+        free(idx);
+        return NULL;
+    }
+    close(fd);
+    idx->len = st.st_size;
+
+    /* Check everything is where it is said to be */
+    hdr = idx->hdr = (const index_header_t *)idx->data;
+    *error = "not an index";
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0)
+      goto bad;
+    *error = "written by another version or machine";
+    if (hdr->version != INDEX_VERSION || hdr->endian != INDEX_ENDIAN)
+      goto bad;
+    *error = "truncated or corrupt";
+    if (hdr->size != idx->len ||
+        hdr->pages_off % 8 || hdr->trigrams_off % 8 ||
+        hdr->pages_off + sizeof(uint64_t) * (hdr->n_pages + 1ULL) >
+        hdr->docs_off ||
+        hdr->docs_off + sizeof(index_doc_t) * (uint64_t)hdr->n_docs >
+        hdr->names_off ||
+        hdr->names_off > hdr->trigrams_off ||
+        hdr->trigrams_off + sizeof(index_trigram_t) *
+        (uint64_t)hdr->n_trigrams > hdr->postings_off ||
+        hdr->postings_off > hdr->size)
+      goto bad;
+
+    idx->text = (const char *)idx->data + sizeof(index_header_t);
+    idx->pages = (const uint64_t *)((const char *)idx->data + hdr->pages_off);
+    idx->docs = (const index_doc_t *)((const char *)idx->data + hdr->docs_off);
+    idx->names = (const char *)idx->data + hdr->names_off;
+    idx->trigrams = (const index_trigram_t *)
+        ((const char *)idx->data + hdr->trigrams_off);
+    idx->postings = (const unsigned char *)idx->data + hdr->postings_off;
+    if (idx->pages[hdr->n_pages] > hdr->pages_off - sizeof(index_header_t))
+      goto bad;
+
+    *error = NULL;
+    return idx;
+
+bad:
+    munmap((void *)idx->data, idx->len);
+    free(idx);
+    return NULL;
+}
+
+
+void index_close(index_t *idx)
+{
+    if (!idx)
+      return;
+    munmap((void *)idx->data, idx->len);
+    free(idx);
+}
+
+
+const char *index_page_text(const index_t *idx, uint32_t page, size_t *len)
+{
+    uint64_t start = idx->pages[page], end = idx->pages[page + 1];
+
+    /* A bad offset gives an empty page rather than a crash */
+    if (start > end || end > idx->pages[idx->hdr->n_pages])
+      end = start = 0;
+    *len = end - start;
+    return idx->text + start;
+}
+
+
+uint32_t index_doc_of(const index_t *idx, uint32_t page)
+{
+    uint32_t lo = 0, hi = idx->hdr->n_docs, mid;
+
+    /* Last document starting at or before 'page' */
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (idx->docs[mid].first_page <= page)
+          lo = mid;
+        else
+          hi = mid;
+    }
+    return lo;
+}
+
+
+const char *index_doc_name(const index_t *idx, uint32_t doc)
+{
+    uint64_t names_len = idx->hdr->trigrams_off - idx->hdr->names_off;
+
+    if (idx->docs[doc].name >= names_len ||
+        !memchr(idx->names + idx->docs[doc].name, '\0',
+                names_len - idx->docs[doc].name))
+      return "?";
+    return idx->names + idx->docs[doc].name;
+}
+
+
+static const index_trigram_t *find_trigram(const index_t *idx, uint32_t t)
+{
+    uint32_t lo = 0, hi = idx->hdr->n_trigrams, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (idx->trigrams[mid].trigram < t)
+          lo = mid + 1;
+        else if (idx->trigrams[mid].trigram > t)
+          hi = mid;
+        else
+          return &idx->trigrams[mid];
+    }
+    return NULL;
+}
+
+
+/* Keep the pages (sorted) in 'pages' that are in the postings of 'tri' */
+static int64_t intersect(
+    const index_t         *idx,
+    const index_trigram_t *tri,
+    uint32_t              *pages,
+    int64_t                n)
+{
+    int shift;
+    int64_t i = 0, kept = 0;
+    uint32_t k, v, page = 0;
+    const unsigned char *p = idx->postings + tri->postings;
+    const unsigned char *end = (const unsigned char *)idx->data + idx->len;
+
+    for (k=0; k<tri->n_pages && i<n; ++k)
+    {
+        for (v=0, shift=0; p<end && shift<35; shift+=7)
+        {
+            v |= (uint32_t)(*p & 0x7F) << shift;
+            if (!(*p++ & 0x80))
+              break;
+        }
+        page += v;
+
+        while (i < n && pages[i] < page)
+          ++i;
+        if (i < n && pages[i] == page)
+          pages[kept++] = pages[i++];
+        ++page;
+    }
+
+    return kept;
+}
+
+
+int64_t index_filter(
+    const index_t *idx,
+    const char    *lit,
+    size_t         len,
+    uint32_t     **pages,
+    int64_t        n)
+{
+    int i, j, n_tris, max = 0;
+    uint32_t *tris = NULL, pg;
+    const index_trigram_t **found, *tmp;
+
+    if ((n_tris = index_trigrams(lit, len, &tris, &max)) <= 0)
+    {
+        free(tris);
+        return n_tris < 0 ? -2 : n; /* Too short to narrow anything down */
+    }
+
+    /* Rarest first, so the list is as short as can be early on */
+    if (!(found = malloc(sizeof(index_trigram_t *) * n_tris)))
+    {
+        free(tris);
+        return -2;
+    }
+    for (i=0; i<n_tris; ++i)
+      if (!(found[i] = find_trigram(idx, tris[i])))
+        break;
+    free(tris);
+    if (i < n_tris)
+    {
+        free(found);
+        return 0; /* A trigram no page has */
+    }
+    for (i=1; i<n_tris; ++i)
+      for (j=i; j>0 && found[j]->n_pages < found[j-1]->n_pages; --j)
+      {
+          tmp = found[j];
+          found[j] = found[j-1];
+          found[j-1] = tmp;
+      }
+
+    /* Every page to start with */
+    if (n < 0)
+    {
+        if (!(*pages = malloc(sizeof(uint32_t) * (idx->hdr->n_pages + 1))))
+        {
+            free(found);
+            return -2;
+        }
+        for (pg=0; pg<idx->hdr->n_pages; ++pg)
+          (*pages)[pg] = pg;
+        n = idx->hdr->n_pages;
+    }
+
+    for (i=0; i<n_tris && n; ++i)
+      n = intersect(idx, found[i], *pages, n);
+
+    free(found);
+    return n;
+}
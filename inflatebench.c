@@ -0,0 +1,156 @@
+/******************************************************************************
+ * inflatebench.c
+ *
+ * inflatebench - Compare libnachopdf's inflate backends
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Decodes every page of each pdf given with each inflate backend, and once
+ * more from the stream cache (so nothing is inflated), which is the cost of
+ * parsing alone.  The difference is what each backend spends inflating.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* clock_gettime */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "pdf.h"
+
+
+#undef TAG
+#define TAG "inflatebench"
+
+
+#define P(...) do {printf(__VA_ARGS__); putc('\n', stdout);} while(0)
+
+
+static void usage(const char *execname)
+{
+    printf("Usage: %s [-r rounds] <file> [file ...]\n", execname);
+    exit(EXIT_SUCCESS);
+}
+
+
+/* Throw the decoded text away */
+static decode_exit_e discard_callback(decode_t *decode)
+{
+    decode->buffer_used = 0;
+    return DECODE_CONTINUE;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Seconds to decode all pages 'rounds' times with backend 'inflater' */
+static double time_pages(const pdf_t *pdf, int inflater, int rounds)
+{
+    int r, pg;
+    double start;
+    char buf[4096];
+    decode_t decode;
+
+    pdf_decode_init(&decode, pdf);
+    decode.callback = discard_callback;
+    decode.buffer = buf;
+    decode.buffer_length = sizeof(buf);
+    decode.inflater = inflater;
+
+    start = now();
+    for (r=0; r<rounds; ++r)
+      for (pg=1; pg<=pdf->n_pages; ++pg)
+      {
+          decode.pg_num = pg;
+          pdf_decode_page(&decode);
+      }
+
+    pdf_decode_release(&decode);
+    return now() - start;
+}
+
+
+static void bench(const char *fname, int rounds)
+{
+    int i, j, pg;
+    pdf_t *pdf;
+    size_t in_bytes = 0;
+    double parse, t;
+    const page_t *page;
+
+    pdf = pdf_new(fname);
+    for (pg=1; pg<=pdf->n_pages; ++pg)
+      for (j=0; (page = pdf_get_page(pdf, pg)) && j<page->n_contents; ++j)
+        if (page->contents[j].n_filters)
+          in_bytes += page->contents[j].length;
+
+    /* Parsing alone: Everything comes out of the (warmed up) stream cache */
+    pdf_set_stream_cache(pdf, (size_t)-1);
+    time_pages(pdf, 0, 1);
+    parse = time_pages(pdf, 0, rounds);
+    pdf_set_stream_cache(pdf, 0);
+
+    P("%s: %d pages, %.2f MB compressed, %d rounds", fname, pdf->n_pages,
+      in_bytes / 1e6, rounds);
+    P("  %-12s %10.2f ms", "parse only", parse * 1e3);
+
+    for (i=0; pdf_inflater_name(i); ++i)
+    {
+        time_pages(pdf, i, 1); /* Warm up */
+        t = time_pages(pdf, i, rounds);
+        P("  %-12s %10.2f ms %10.1f MB/s compressed (inflate only)",
+          pdf_inflater_name(i), t * 1e3,
+          (t > parse) ? (in_bytes * rounds / 1e6) / (t - parse) : 0.0);
+    }
+
+    pdf_destroy(pdf);
+}
+
+
+int main(int argc, char **argv)
+{
+    int i, rounds = 10, n_files = 0;
+
+    for (i=1; i<argc; ++i)
+    {
+        if (strcmp(argv[i], "-r") == 0 && i+1<argc)
+          rounds = atoi(argv[++i]);
+        else if (argv[i][0] == '-')
+          usage(argv[0]);
+        else
+          ++n_files;
+    }
+
+    if (!n_files || rounds < 1)
+      usage(argv[0]);
+
+    for (i=1; i<argc; ++i)
+    {
+        if (strcmp(argv[i], "-r") == 0)
+          ++i;
+        else
+          bench(argv[i], rounds);
+    }
+
+    return 0;
+}
@@ -25,10 +25,13 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "pdf.h"
 
 
@@ -44,27 +47,37 @@ void iter_next(iter_t *itr)
 }
 
 
-/* Keep moving backwards until we hit 'match' */
+/* Keep moving forwards until we hit 'match' (or run off the end) */
 void seek_next(iter_t *itr, char match)
 {
-    /* If we are already on the character, backup one */
+    const char *en;
+
+    /* If we are already on the character, skip it */
     if (ITR_IN_BOUNDS(itr) && ITR_VAL(itr) == match)
       iter_next(itr);
 
-    while (ITR_IN_BOUNDS(itr) && ITR_VAL(itr) != match)
-      iter_next(itr);
+    if (!ITR_IN_BOUNDS(itr))
+      return;
+
+    en = pdf_memchr(ITR_ADDR(itr), match, itr->len - ITR_POS(itr));
+    itr->idx = en ? en - itr->data : itr->len;
 }
 
 
-/* Keep moving backwards until we hit 'match' */
+/* Keep moving backwards until we hit 'match' (or run off the front) */
 void seek_prev(iter_t *itr, char match)
 {
+    const char *en;
+
     /* If we are already on the character, backup one */
     if (ITR_IN_BOUNDS(itr) && ITR_VAL(itr) == match)
       iter_prev(itr);
 
-    while (ITR_IN_BOUNDS(itr) && ITR_VAL(itr) != match)
-      iter_prev(itr);
+    if (!ITR_IN_BOUNDS(itr))
+      return;
+
+    en = pdf_memrchr(itr->data, match, ITR_POS(itr) + 1);
+    itr->idx = en ? en - itr->data : -1;
 }
 
 
@@ -88,6 +101,8 @@ static iter_t *_iter_new(const pdf_t *pdf, off_t start_offset)
     iter_t *itr = malloc(sizeof(iter_t));
     itr->idx = start_offset;
     itr->pdf = pdf;
+    itr->data = pdf->data;
+    itr->len = pdf->len;
     if (!ITR_IN_BOUNDS(itr))
       abort();
     return itr;
@@ -112,6 +127,34 @@ void iter_destroy(iter_t *itr)
 }
 
 
+/* The integer at the start of [s, s+len), read as atoll() would but never
+ * past the end (the pdf's data is not NUL terminated).  0 if there is none.
+ */
+static long long parse_int(const char *s, size_t len)
+{
+    size_t i;
+    double val;
+
+    for (i=0; i<len && isspace((unsigned char)s[i]); ++i)
+      ;
+    if (i == len || !pdf_parse_number(s + i, len - i, &val))
+      return 0;
+    if (val >= (double)LLONG_MAX)
+      return LLONG_MAX;
+    if (val <= (double)LLONG_MIN)
+      return LLONG_MIN;
+    return (long long)val;
+}
+
+
+long long iter_int(const iter_t *itr)
+{
+    if (!ITR_IN_BOUNDS(itr))
+      return 0;
+    return parse_int(ITR_ADDR(itr), itr->len - ITR_POS(itr));
+}
+
+
 void iter_set(iter_t *itr, off_t offset)
 {
     itr->idx = offset;
@@ -120,21 +163,41 @@ void iter_set(iter_t *itr, off_t offset)
 }
 
 
-/* Returns true if found, false if not found */
-_Bool seek_string(iter_t *itr, const char *search)
+/* Search for 'search' in [itr, itr+len).  If found the iterator is moved to
+ * the start of the match.
+ */
+static _Bool seek_string_bounded(iter_t *itr, const char *search, size_t len)
 {
-    const char *en, *st = ITR_ADDR(itr);
-    if (!(en = strstr(st, search)))
+    const char *en;
+
+    if (!ITR_IN_BOUNDS(itr))
       return false;
-    iter_set(itr, ITR_POS(itr) + en - st);
+    if (len > itr->len - ITR_POS(itr))
+      len = itr->len - ITR_POS(itr);
+
+    en = pdf_memmem(ITR_ADDR(itr), len, search, strlen(search));
+    STATS_ADD(itr->pdf, bytes_scanned,
+              en ? (size_t)(en - ITR_ADDR(itr)) + strlen(search) : len);
+    if (!en)
+      return false;
+    itr->idx = en - itr->data;
     return true;
 }
 
 
+/* Returns true if found, false if not found */
+_Bool seek_string(iter_t *itr, const char *search)
+{
+    return seek_string_bounded(itr, search, itr->len);
+}
+
+
+/* Stops at the last character of the pdf */
 void skip_whitespace(iter_t *itr)
 {
-    while (isspace(ITR_VAL(itr)) && ITR_IN_BOUNDS_V(itr, 1))
-      iter_next(itr);
+    if (ITR_IN_BOUNDS_V(itr, 1))
+      itr->idx += pdf_span_space(
+          ITR_ADDR(itr), itr->len - ITR_POS(itr) - 1);
 }
 
 
@@ -143,145 +206,634 @@ void skip_whitespace(iter_t *itr)
  */
 void seek_next_nonwhitespace(iter_t *itr)
 {
-    while (!isspace(ITR_VAL(itr)) && ITR_IN_BOUNDS_V(itr, 1))
-      iter_next(itr);
+    if (ITR_IN_BOUNDS_V(itr, 1))
+      itr->idx += pdf_span_nonspace(
+          ITR_ADDR(itr), itr->len - ITR_POS(itr) - 1);
     skip_whitespace(itr);
 }
 
 
-/* Creates a fresh object from "<<" to ">>" */
-_Bool pdf_get_object(const pdf_t *pdf, off_t obj_id, obj_t *obj)
+/* Creates a fresh object from "<<" to ">>" for the object that starts (with
+ * "<id> <generation> obj") at 'offset' in the pdf.
+ */
+static _Bool object_at(const pdf_t *pdf, off_t offset, off_t obj_id, obj_t *obj)
 {
-    int i;
-    off_t idx;
     iter_t *itr;
-    const xref_t *xref;
-  
-    /* Find the proper xref table */
-    for (i=0; i<pdf->n_xrefs; ++i)
-    {
-        xref = pdf->xrefs[i];
-        if (obj_id >= xref->first_entry_id && 
-            obj_id < xref->first_entry_id + xref->n_entries)
-          break;
-        xref = NULL;
-    }
 
-    if (!xref)
+    if (offset >= pdf->len)
       return false;
 
     /* Create an object between "<<" and ">>" */
-    idx = obj_id - xref->first_entry_id;
-    itr = iter_new_offset(pdf, xref->entries[idx].offset);
+    itr = iter_new_offset(pdf, offset);
     seek_next(itr, ' '); /* Skip obj number     */
     seek_next(itr, ' '); /* Skip obj generation */
     iter_next(itr);
 
-    if (strncmp("obj ", ITR_VAL_STR(itr), strlen("obj")) != 0)
-      return false; /* Could not locate object */
-    seek_string(itr, "<<");
+    if (!ITR_IN_BOUNDS_V(itr, strlen("obj")) ||
+        strncmp("obj", ITR_VAL_STR(itr), strlen("obj")) != 0)
+    {
+        iter_destroy(itr);
+        return false; /* Could not locate object */
+    }
+    iter_set(itr, ITR_POS(itr) + strlen("obj"));
     obj->begin = ITR_POS(itr);
-    seek_string(itr, ">>");
-    seek_string(itr, "endobj");
+
+    /* The object ends at "endobj" */
+    if (!seek_string(itr, "endobj"))
+    {
+        iter_destroy(itr);
+        return false;
+    }
     obj->end = ITR_POS(itr);
+
+    /* Dictionaries start at "<<", anything else (e.g. a number) right after
+     * the "obj" keyword.
+     */
+    iter_set(itr, obj->begin);
+    if (seek_string_bounded(itr, "<<", obj->end - obj->begin))
+      obj->begin = ITR_POS(itr);
+
     obj->id = obj_id;
+    obj->data = pdf->data;
+    obj->len = pdf->len;
     iter_destroy(itr);
     return true;
 }
 
 
+static _Bool resolve_stream(const pdf_t *pdf, obj_t obj, stream_t *stream);
+
+
+/* Decode object stream 'id' and index the objects in it.  Returns NULL if it
+ * cannot be loaded.
+ */
+static objstm_t *load_objstm(const pdf_t *pdf, off_t id)
+{
+    int i;
+    off_t first;
+    obj_t obj;
+    stream_t stream;
+    objstm_t *os;
+    char *c, *en;
+    iter_t *itr;
+
+    /* Object streams cannot themselves be compressed */
+    if (id >= pdf->n_objects || pdf->objects[id].is_free ||
+        pdf->objects[id].objstm ||
+        !object_at(pdf, pdf->objects[id].offset, id, &obj) ||
+        !resolve_stream(pdf, obj, &stream))
+      return NULL;
+
+    /* Number of objects and where the first one starts */
+    itr = iter_new(pdf);
+    os = calloc(1, sizeof(objstm_t));
+    first = -1;
+    if (find_value_in_object(itr, obj, "/N"))
+    {
+        os->n_objs = ITR_VAL_INT(itr);
+    }
+    if (find_value_in_object(itr, obj, "/First"))
+    {
+        first = ITR_VAL_INT(itr);
+    }
+    iter_destroy(itr);
+
+    if (os->n_objs <= 0 || first < 0 ||
+        !(os->data = pdf_decode_stream(pdf, &stream, &os->len)) ||
+        first > os->len)
+    {
+        free(os->data);
+        free(os);
+        return NULL;
+    }
+
+    /* The stream starts with 'N' pairs of "<id> <offset from /First>" */
+    os->ids = malloc(sizeof(off_t) * os->n_objs);
+    os->offsets = malloc(sizeof(off_t) * os->n_objs);
+    for (i=0, c=os->data; i<os->n_objs; ++i)
+    {
+        os->ids[i] = strtoll(c, &en, 10);
+        c = en;
+        os->offsets[i] = first + strtoll(c, &en, 10);
+        c = en;
+        if (os->offsets[i] > os->len)
+          os->offsets[i] = os->len;
+    }
+
+    D("Object stream %lu holds %d objects", id, os->n_objs);
+    return os;
+}
+
+
+/* Creates a fresh object from "<<" to ">>" */
+_Bool pdf_get_object(const pdf_t *pdf, off_t obj_id, obj_t *obj)
+{
+    int i;
+    objstm_t *os;
+    const xref_entry_t *entry;
+  
+    /* Look the object up in the object index */
+    if (obj_id < 0 || obj_id >= pdf->n_objects ||
+        pdf->objects[obj_id].is_free)
+      return false;
+    entry = &pdf->objects[obj_id];
+    STATS_ADD(pdf, objects_resolved, 1);
+
+    if (!entry->objstm)
+      return object_at(pdf, entry->offset, obj_id, obj);
+
+    /* Compressed object: Decode its object stream, just once.  A stream that
+     * cannot be loaded is kept as an empty one, so it is not tried again.
+     */
+    if (entry->objstm >= pdf->n_objects)
+      return false;
+    pthread_mutex_lock((pthread_mutex_t *)&pdf->objstm_lock);
+    if (!(os = pdf->objstms[entry->objstm]))
+    {
+        if (!(os = load_objstm(pdf, entry->objstm)))
+          os = calloc(1, sizeof(objstm_t));
+        pdf->objstms[entry->objstm] = os;
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)&pdf->objstm_lock);
+    if (!os || os->n_objs == 0)
+      return false;
+
+    /* 'offset' is the object's index within the stream */
+    i = entry->offset;
+    if (i >= os->n_objs || os->ids[i] != obj_id)
+      for (i=0; i<os->n_objs && os->ids[i]!=obj_id; ++i)
+        ;
+    if (i == os->n_objs)
+      return false;
+
+    obj->id = obj_id;
+    obj->begin = os->offsets[i];
+    obj->end = (i+1 < os->n_objs) ? os->offsets[i+1] : os->len;
+    obj->data = os->data;
+    obj->len = os->len;
+    return obj->begin < os->len;
+}
+
+
 /* Locate string in object.  If it cannot be found 'false' is returned else, the
- * iterator is updated an 'true' is returned.
+ * iterator is updated an 'true' is returned.  The match has to start within
+ * the object, nothing past it is scanned.  On success the iterator indexes the
+ * object's data from then on.
  */
 _Bool find_in_object(iter_t *itr, obj_t obj, const char *search)
 {
-    const char *en;
-    off_t orig = ITR_POS(itr);
+    iter_t orig = *itr;
 
+    itr->data = obj.data;
+    itr->len = obj.len;
     iter_set(itr, obj.begin);
-    if ((en = strstr(ITR_ADDR(itr), search)) &&
-        ((en - itr->pdf->data) <= obj.end))
+    if (obj.end >= obj.begin &&
+        seek_string_bounded(itr, search, obj.end-obj.begin + strlen(search)))
+      return true;
+
+    *itr = orig;
+    return false;
+}
+
+
+/* Locate the key 'search' in an object and point the iterator at its value
+ * (the first non-whitespace after the key).
+ */
+_Bool find_value_in_object(iter_t *itr, obj_t obj, const char *search)
+{
+    char c;
+
+    /* The key must be followed by a delimiter ("/N" is not "/Names") */
+    while (find_in_object(itr, obj, search))
     {
-        seek_string(itr, search);
-        return true;
+        itr->idx += strlen(search);
+        c = ITR_IN_BOUNDS(itr) ? ITR_VAL(itr) : ' ';
+        if (!isalnum(c) && c != '_' && c != '.' && c != '-' && c != '#')
+        {
+            skip_whitespace(itr);
+            return true;
+        }
+        obj.begin = ITR_POS(itr);
     }
 
-    iter_set(itr, orig);
     return false;
 }
 
 
 
-static void add_kid(pdf_t *pdf, obj_t kid)
+/* Map a filter name (the characters following the '/') to its type */
+static filter_e filter_from_name(const char *name, size_t len)
 {
-    kid_t *new_kid;
-    static int pg_num_pool;
+    if (len == strlen("FlateDecode") && strncmp(name, "FlateDecode", len) == 0)
+      return FILTER_FLATE;
+    return FILTER_UNKNOWN;
+}
+
+
+/* Read the filter name at 'itr' (pointing at the '/') into the stream */
+static void add_filter(iter_t *itr, stream_t *stream)
+{
+    off_t st;
+
+    iter_next(itr);
+    st = ITR_POS(itr);
+    while (ITR_IN_BOUNDS(itr) && isalnum(ITR_VAL(itr)))
+      iter_next(itr);
+
+    if (stream->n_filters < MAX_FILTERS)
+      stream->filters[stream->n_filters++] =
+          filter_from_name(itr->data + st, ITR_POS(itr) - st);
+}
+
+
+/* Returns the integer following 'key' in 'obj', or 'def' if there is none */
+static off_t get_int(iter_t *itr, obj_t obj, const char *key, off_t def)
+{
+    if (!find_value_in_object(itr, obj, key))
+      return def;
+    return ITR_VAL_INT(itr);
+}
+
+
+/* If the value at 'itr' is an indirect reference ("<id> <generation> R")
+ * return the object number it refers to, otherwise -1.
+ */
+static off_t get_reference(const iter_t *itr)
+{
+    off_t id = 0, i = itr->idx;
+    const char *d = itr->data;
+    size_t sp;
+
+    if (i >= itr->len || !isdigit(d[i]))
+      return -1;
+    for ( ; i<itr->len && isdigit(d[i]); ++i)
+      id = id * 10 + (d[i] - '0');
+
+    /* Generation, then 'R' */
+    if (!(sp = pdf_span_space(d + i, itr->len - i)))
+      return -1;
+    for (i+=sp; i<itr->len && isdigit(d[i]); ++i)
+      ;
+    if (!(sp = pdf_span_space(d + i, itr->len - i)))
+      return -1;
+    i += sp;
+    if (i >= itr->len || d[i] != 'R')
+      return -1;
+
+    return id;
+}
+
+
+/* Get the integer value of the dictionary key 'key', which may be given
+ * directly or as an indirect reference to an integer object (e.g. /Length is
+ * often written after the stream as "/Length 12 0 R").  Returns -1 if there is
+ * no such key or the object it refers to cannot be found.
+ */
+static off_t get_int_or_ref(const pdf_t *pdf, iter_t *itr, obj_t obj,
+                            const char *key)
+{
+    off_t id;
+    obj_t ref;
+
+    if (!find_value_in_object(itr, obj, key))
+      return -1;
+    if ((id = get_reference(itr)) == -1)
+      return ITR_VAL_INT(itr);
+
+    if (!pdf_get_object(pdf, id, &ref))
+      return -1;
+    ref.begin += pdf_span_space(ref.data + ref.begin, ref.len - ref.begin);
+    if (ref.begin >= ref.end || !isdigit(ref.data[ref.begin]))
+      return -1;
+    return parse_int(ref.data + ref.begin, ref.end - ref.begin);
+}
+
+
+/* Fill in the stream descriptor for the stream object 'obj'.  Returns 'false'
+ * if this does not look like a stream.
+ */
+static _Bool resolve_stream(const pdf_t *pdf, obj_t obj, stream_t *stream)
+{
+    off_t length;
+    obj_t dict;
     iter_t *itr = iter_new(pdf);
-    static kid_t *last;
 
-    if (!find_in_object(itr, kid, "/Page"))
+    memset(stream, 0, sizeof(stream_t));
+    stream->id = obj.id;
+
+    /* Get the start of the stream (follows the dictionary).  Only look at the
+     * dictionary from here on, not the stream data.
+     */
+    if (!find_in_object(itr, obj, "stream"))
     {
         iter_destroy(itr);
-        return;
+        return false;
     }
+    dict = obj;
+    dict.end = ITR_POS(itr);
+    seek_next(itr, '\n');
+    iter_next(itr);
+    stream->offset = ITR_POS(itr);
 
-    new_kid = calloc(1, sizeof(kid_t));
-    new_kid->pg_num = ++pg_num_pool;
-    new_kid->id = kid.id;
+    /* Get the length of the stream's data, never running past the pdf */
+    if ((length = get_int_or_ref(pdf, itr, dict, "/Length")) < 0 ||
+        stream->offset > pdf->len)
+    {
+        iter_destroy(itr);
+        return false;
+    }
+    stream->length = length;
+    if (stream->length > pdf->len - stream->offset)
+      stream->length = pdf->len - stream->offset;
+
+    /* Locate the filter chain: /Filter /Name or /Filter [/Name1 /Name2] */
+    if (find_value_in_object(itr, dict, "/Filter"))
+    {
+        if (ITR_VAL(itr) == '[')
+        {
+            iter_next(itr);
+            skip_whitespace(itr);
+            while (ITR_IN_BOUNDS(itr) && ITR_VAL(itr) == '/')
+            {
+                add_filter(itr, stream);
+                skip_whitespace(itr);
+            }
+        }
+        else if (ITR_VAL(itr) == '/')
+          add_filter(itr, stream);
+    }
 
-    if (last)
-      last->next = new_kid;
-    last = new_kid;
+    /* Predictor parameters (from /DecodeParms) */
+    stream->predictor = get_int(itr, dict, "/Predictor", 1);
+    stream->columns = get_int(itr, dict, "/Columns", 1);
+    stream->colors = get_int(itr, dict, "/Colors", 1);
+    stream->bpc = get_int(itr, dict, "/BitsPerComponent", 8);
 
-    if (!pdf->kids)
-      pdf->kids = new_kid;
+    /* Size of the decoded data, if the writer was kind enough to say */
+    if ((length = get_int(itr, dict, "/DL", 0)) > 0)
+      stream->decoded_length = length;
 
     iter_destroy(itr);
+    return true;
 }
 
 
-/* This should be a parent with /Count and /Kids entries */
-static _Bool pages_from_parent(pdf_t *pdf, obj_t obj)
+/* Read the object ids in the array of references ("[<id> <gen> R ...]") at
+ * (or after) 'itr' into a newly allocated array (caller frees).  The array must
+ * end before 'end'.  Returns the number of ids.
+ */
+static int get_ref_array(iter_t *itr, off_t end, off_t **ids)
 {
-    off_t next_id;
-    obj_t search;
+    int n_ids = 0, max_ids = 0;
+
+    *ids = NULL;
+    if (!ITR_IN_BOUNDS(itr) || ITR_VAL(itr) != '[')
+      seek_next(itr, '[');
+    iter_next(itr);
+    for ( ;; )
+    {
+        skip_whitespace(itr);
+        if (!ITR_IN_BOUNDS(itr) || ITR_POS(itr) >= end ||
+            !isdigit(ITR_VAL(itr)))
+          break;
+
+        if (n_ids == max_ids)
+        {
+            max_ids = max_ids ? max_ids * 2 : 8;
+            ERR((*ids = realloc(*ids, sizeof(off_t) * max_ids)), ==NULL,
+                "Could not allocate reference array");
+        }
+        (*ids)[n_ids++] = ITR_VAL_INT(itr);
+
+        seek_next_nonwhitespace(itr); /* Skip to generation */
+        seek_next_nonwhitespace(itr); /* Skip to ref        */
+        iter_next(itr);
+    }
+
+    return n_ids;
+}
+
+
+/* Resolve the content streams with object ids 'ids' into the page's
+ * contents.  Parts that are not streams are dropped.
+ */
+static void resolve_contents(
+    const pdf_t *pdf,
+    page_t      *page,
+    const off_t *ids,
+    int          n_ids)
+{
+    int i;
+    obj_t obj;
+
+    if (n_ids <= 0)
+      return;
+
+    ERR((page->contents = malloc(sizeof(stream_t) * n_ids)), ==NULL,
+        "Could not allocate page contents");
+    for (i=0; i<n_ids; ++i)
+      if (pdf_get_object(pdf, ids[i], &obj) &&
+          resolve_stream(pdf, obj, &page->contents[page->n_contents]))
+        ++page->n_contents;
+}
+
+
+/* Fill in the page table entry for the page object 'obj' and resolve its
+ * contents.  Returns 'false' if 'obj' is not a page.
+ */
+static _Bool resolve_page(const pdf_t *pdf, obj_t obj, page_t *page)
+{
+    int n_ids = 0;
+    off_t id, *ids = NULL;
+    obj_t contents;
     iter_t *itr = iter_new(pdf);
-    
-    /* Get count */
-    if (!find_in_object(itr, obj, "/Count"))
+
+    if (!find_in_object(itr, obj, "/Page"))
     {
-        add_kid(pdf, obj);
-        return true;
+        iter_destroy(itr);
+        return false;
+    }
+
+    memset(page, 0, sizeof(page_t));
+    page->id = obj.id;
+    page->is_resolved = true;
+
+    /* Resolve the content streams now, so decoding is just a jump to them.
+     * /Contents is a stream, or an array of them (possibly an indirect one).
+     */
+    if (find_value_in_object(itr, obj, "/Contents"))
+    {
+        if (ITR_VAL(itr) == '[')
+          n_ids = get_ref_array(itr, obj.end, &ids);
+        else if (pdf_get_object(pdf, (id = ITR_VAL_INT(itr)), &contents))
+        {
+            if (find_in_object(itr, contents, "stream"))
+              resolve_contents(pdf, page, &id, 1);
+            else if (find_in_object(itr, contents, "["))
+              n_ids = get_ref_array(itr, contents.end, &ids);
+        }
+        resolve_contents(pdf, page, ids, n_ids);
+        free(ids);
+    }
+
+    iter_destroy(itr);
+    return true;
+}
+
+
+/* Append a page to the page table */
+static void add_page(pdf_t *pdf, obj_t obj)
+{
+    if (pdf->n_pages == pdf->max_pages)
+    {
+        pdf->max_pages = pdf->max_pages ? pdf->max_pages * 2 : 16;
+        ERR((pdf->pages = realloc(pdf->pages, sizeof(page_t)*pdf->max_pages)),
+            ==NULL, "Could not allocate page table");
     }
 
-    /* Get the child pages */
-    seek_next_nonwhitespace(itr);
+    if (resolve_page(pdf, obj, &pdf->pages[pdf->n_pages]))
+      ++pdf->n_pages;
+}
+
+
+/* Read the object ids in the /Kids array of a page tree node into a newly
+ * allocated array (caller frees).  Returns the number of kids, or -1 if 'obj'
+ * has no /Kids (so it is a page and not a /Pages node).
+ */
+static int get_kids(const pdf_t *pdf, obj_t obj, off_t **kids)
+{
+    int n_kids;
+    iter_t *itr = iter_new(pdf);
+
+    *kids = NULL;
     if (!find_in_object(itr, obj, "/Kids"))
     {
-        add_kid(pdf, obj);
-        return true;
+        iter_destroy(itr);
+        return -1;
     }
 
-    /* Must be a parent if we get here */
-    seek_next(itr, '[');
-    while (ITR_VAL(itr) != ']')
+    n_kids = get_ref_array(itr, obj.end, kids);
+    iter_destroy(itr);
+    return n_kids;
+}
+
+
+/* Returns the /Count of a /Pages node, or -1 if there is none */
+static off_t get_count(const pdf_t *pdf, obj_t obj)
+{
+    off_t count = -1;
+    iter_t *itr = iter_new(pdf);
+
+    if (find_value_in_object(itr, obj, "/Count"))
     {
-        /* Get decendents */
-        iter_next(itr);
-        skip_whitespace(itr);
-        if (ITR_VAL(itr) == ']')
+        count = ITR_VAL_INT(itr);
+    }
+
+    iter_destroy(itr);
+    return count;
+}
+
+
+/* Walk the whole page tree from 'root' adding pages in document order.  This
+ * is iterative (an explicit stack of nodes still to visit) so that deep trees
+ * cannot overflow the call stack.
+ */
+static int walk_page_tree(pdf_t *pdf, off_t root)
+{
+    int i, n_kids, n_stack, max_stack;
+    off_t id, *stack, *kids, visits = 0;
+    obj_t obj;
+
+    max_stack = 16;
+    ERR((stack = malloc(sizeof(off_t) * max_stack)), ==NULL,
+        "Could not allocate page tree stack");
+    stack[0] = root;
+    n_stack = 1;
+
+    while (n_stack)
+    {
+        /* More visits than objects means the tree has a cycle */
+        if (++visits > pdf->n_objects)
           break;
-        next_id = ITR_VAL_INT(itr);
-        seek_next_nonwhitespace(itr); /* Skip version */
-        seek_next_nonwhitespace(itr); /* Skip ref     */
-        iter_next(itr);
-        if (!pdf_get_object(pdf, next_id, &search))
+
+        id = stack[--n_stack];
+        if (!pdf_get_object(pdf, id, &obj))
+          continue;
+
+        if ((n_kids = get_kids(pdf, obj, &kids)) < 0)
+        {
+            add_page(pdf, obj);
+            continue;
+        }
+
+        /* Push the kids last to first, so the first kid is visited next */
+        if (n_stack + n_kids > max_stack)
+        {
+            max_stack = (n_stack + n_kids) * 2;
+            ERR((stack = realloc(stack, sizeof(off_t) * max_stack)), ==NULL,
+                "Could not allocate page tree stack");
+        }
+        for (i=n_kids-1; i>=0; --i)
+          stack[n_stack++] = kids[i];
+        free(kids);
+    }
+
+    free(stack);
+    return PDF_OK;
+}
+
+
+/* Lazy loading: Resolve page index 'idx' (page number - 1) by descending from
+ * the root, using each node's /Count to skip subtrees that cannot hold it.
+ * The page's siblings (they are touched anyway) are resolved along with it.
+ * Caller must hold the pdf lock.
+ */
+static _Bool load_page(pdf_t *pdf, int idx)
+{
+    int i, n_kids;
+    off_t node, next, base, count, *kids, depth;
+    obj_t obj, kid;
+
+    node = pdf->pages_root;
+    base = 0; /* Number of pages before the subtree at 'node' */
+
+    for (depth=0; depth<pdf->n_objects; ++depth)
+    {
+        if (!pdf_get_object(pdf, node, &obj))
+          return false;
+
+        /* The node is a page itself */
+        if ((n_kids = get_kids(pdf, obj, &kids)) < 0)
+          return base == idx && resolve_page(pdf, obj, &pdf->pages[idx]);
+
+        next = -1;
+        for (i=0; i<n_kids && next==-1; ++i)
+        {
+            if (!pdf_get_object(pdf, kids[i], &kid))
+              continue;
+
+            /* Pages count as one, /Pages nodes as their /Count */
+            if ((count = get_count(pdf, kid)) < 0)
+            {
+                if (base < pdf->n_pages && !pdf->pages[base].is_resolved)
+                  resolve_page(pdf, kid, &pdf->pages[base]);
+                ++base;
+            }
+            else if (idx < base + count)
+              next = kids[i];
+            else
+              base += count;
+        }
+        free(kids);
+
+        if (pdf->pages[idx].is_resolved)
+          return true;
+        if (next == -1)
           return false;
-        pages_from_parent(pdf, search);
+        node = next;
     }
 
-    iter_destroy(itr);
-    return true;
+    return false;
 }
 
 
@@ -289,58 +841,216 @@ static _Bool pages_from_parent(pdf_t *pdf, obj_t obj)
 static int get_page_tree(pdf_t *pdf)
 {
     obj_t obj;
+    off_t count;
     iter_t *itr = iter_new(pdf);
 
     /* Get the root object (might be /Pages or /Linearized) */
-    if (!pdf_get_object(pdf, pdf->xrefs[0]->root_obj, &obj))
-      return PDF_ERR;
+    if (!pdf_get_object(pdf, pdf->root_obj, &obj) ||
+        !find_value_in_object(itr, obj, "/Pages"))
+    {
+        iter_destroy(itr);
+        return PDF_ERR;
+    }
+
+    pdf->pages_root = ITR_VAL_INT(itr);
+    iter_destroy(itr);
 
-    if (!find_in_object(itr, obj, "/Pages"))
+    if (!pdf_get_object(pdf, pdf->pages_root, &obj))
       return PDF_ERR;
 
-    seek_next_nonwhitespace(itr);
+    /* Lazy: Size the page table from the root's /Count and resolve pages as
+     * they are asked for.  Each page is an object, so a /Count of more pages
+     * than there are objects is bad data.
+     */
+    if ((pdf->flags & PDF_LAZY_PAGES) && (count = get_count(pdf, obj)) > 0)
+    {
+        if (count > pdf->n_objects || count > INT_MAX ||
+            !(pdf->pages = calloc(count, sizeof(page_t))))
+          return PDF_ERR;
+        pdf->n_pages = pdf->max_pages = count;
+        return PDF_OK;
+    }
 
-    if (!pdf_get_object(pdf, ITR_VAL_INT(itr), &obj))
-      return PDF_ERR;
+    pdf->flags &= ~PDF_LAZY_PAGES;
+    return walk_page_tree(pdf, pdf->pages_root);
+}
+
+
+const page_t *pdf_get_page(const pdf_t *pdf, int pg_num)
+{
+    _Bool resolved;
+    uint64_t start;
+    page_t *page;
+
+    if (pg_num < 1 || pg_num > pdf->n_pages)
+      return NULL;
+
+    page = &pdf->pages[pg_num - 1];
+    if (!(pdf->flags & PDF_LAZY_PAGES))
+      return page;
+
+    /* Lazy loading modifies the page table, one thread at a time */
+    pthread_mutex_lock((pthread_mutex_t *)&pdf->lock);
+    if (!(resolved = page->is_resolved))
+    {
+        start = TIMING_ON(pdf) ? stats_now() : 0;
+        resolved = load_page((pdf_t *)pdf, pg_num - 1);
+        STATS_ADD(pdf, page_tree_ns, stats_now() - start);
+        TRACE_SPAN("page tree", start, page->id ? page->id : -1);
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)&pdf->lock);
+
+    return resolved ? page : NULL;
+}
+
+
+_Bool pdf_get_stream(const pdf_t *pdf, off_t obj_id, stream_t *stream)
+{
+    obj_t obj;
+
+    return pdf_get_object(pdf, obj_id, &obj) &&
+           resolve_stream(pdf, obj, stream);
+}
+
+
+/* Set 'obj' to the dictionary that is the value at 'itr' (within 'obj'),
+ * either the direct one ("<< ... >>") at 'itr' or the object it references.
+ */
+static _Bool get_dict(const pdf_t *pdf, iter_t *itr, obj_t *obj)
+{
+    int depth = 0;
+    off_t i, id;
+
+    if ((id = get_reference(itr)) != -1)
+      return pdf_get_object(pdf, id, obj);
+    if (!ITR_IN_BOUNDS(itr) || ITR_VAL(itr) != '<')
+      return false;
+
+    /* Direct: Up to the matching ">>" */
+    obj->begin = ITR_POS(itr);
+    for (i=obj->begin; i+1<obj->end; ++i)
+    {
+        if (obj->data[i] == '<' && obj->data[i+1] == '<')
+        {
+            ++depth;
+            ++i;
+        }
+        else if (obj->data[i] == '>' && obj->data[i+1] == '>')
+        {
+            ++i;
+            if (--depth == 0)
+              break;
+        }
+    }
+    if (i < obj->end)
+      obj->end = i + 1;
+    return true;
+}
+
+
+off_t pdf_get_font(const pdf_t *pdf, int pg_num, const char *name)
+{
+    off_t depth, id = -1;
+    obj_t obj;
+    char key[72];
+    iter_t *itr;
+    const page_t *page;
+
+    if (!(page = pdf_get_page(pdf, pg_num)) ||
+        !pdf_get_object(pdf, page->id, &obj))
+      return -1;
+
+    /* /Resources can be inherited from the page's ancestors */
+    itr = iter_new(pdf);
+    for (depth=0; depth<pdf->n_objects; ++depth)
+    {
+        if (find_value_in_object(itr, obj, "/Resources"))
+          break;
+        if (!find_value_in_object(itr, obj, "/Parent") ||
+            !pdf_get_object(pdf, ITR_VAL_INT(itr), &obj))
+          depth = pdf->n_objects;
+    }
+
+    /* /Resources << /Font << /<name> <id> 0 R ... >> ... >> */
+    snprintf(key, sizeof(key), "/%s", name);
+    if (depth < pdf->n_objects && get_dict(pdf, itr, &obj) &&
+        find_value_in_object(itr, obj, "/Font") &&
+        get_dict(pdf, itr, &obj) && find_value_in_object(itr, obj, key))
+      id = get_reference(itr);
 
-    pages_from_parent(pdf, obj);
     iter_destroy(itr);
-    return PDF_OK;
+    return id;
 }
 
 
 #if 0
 static void print_page_tree(const pdf_t *pdf)
 {
-    const kid_t *k;
-    for (k=pdf->kids; k; k=k->next)
-      D("Page %d: %ld", k->pg_num, k->id);
+    int i;
+    for (i=0; i<pdf->n_pages; ++i)
+      D("Page %d: %ld", i+1, pdf->pages[i].id);
 }
 #endif
 
 
-static int get_xref(pdf_t *pdf, iter_t *itr)
+/* Largest object number a pdf can have (an implementation limit of the spec),
+ * which keeps a bad xref from asking for a huge object index
+ */
+#define MAX_OBJECT_ID 8388607
+
+/* Bytes of each entry of an xref table */
+#define XREF_ENTRY_LEN 20
+
+
+/* True if 'n_entries' objects starting at 'first' can be in an xref */
+static _Bool valid_ids(off_t first, off_t n_entries)
+{
+    return first >= 0 && n_entries >= 0 && first <= MAX_OBJECT_ID &&
+           n_entries <= MAX_OBJECT_ID + 1 - first;
+}
+
+
+/* Append a blank xref for 'n_entries' objects starting at 'first_obj' */
+static xref_t *new_xref(pdf_t *pdf, off_t offset, off_t first, off_t n_entries)
 {
-    off_t i, first_obj, n_entries, trailer;
     xref_t *xref;
 
-    seek_next_line(itr);
+    D("xref starts at object %lu and contains %lu entries", first, n_entries);
+    ERR((pdf->xrefs = realloc(pdf->xrefs, sizeof(xref_t *)*(pdf->n_xrefs+1))),
+        ==NULL, "Could not allocate xref");
+    ERR((xref = pdf->xrefs[pdf->n_xrefs] = calloc(1, sizeof(xref_t))), ==NULL,
+        "Could not allocate xref");
+    ++pdf->n_xrefs;
+
+    xref->offset = offset;
+    xref->first_entry_id = first;
+    ERR((xref->entries = calloc(n_entries ? n_entries : 1,
+                                sizeof(xref_entry_t))), ==NULL,
+        "Could not allocate xref entries");
+    xref->n_entries = n_entries;
+    return xref;
+}
+
+
+/* Add the subsection at 'itr' ("<first id> <count>" line followed by 'count'
+ * entries) as an xref.  'itr' is left at the line following the subsection.
+ * Returns PDF_ERR if the subsection is bad (more entries than the rest of the
+ * pdf has room for, at 20 bytes each).
+ */
+static int get_xref_subsection(pdf_t *pdf, iter_t *itr, off_t offset)
+{
+    off_t i, first_obj, n_entries;
+    xref_t *xref;
+
     first_obj = ITR_VAL_INT(itr);
     seek_next(itr, ' ');
     n_entries = ITR_VAL_INT(itr);
-    D("xref starts at object %lu and contains %lu entries",
-      first_obj, n_entries);
-
-    /* Create a blank xref */
-    if (!pdf->xrefs)
-      pdf->xrefs = malloc(sizeof(xref_t *));
-    xref = pdf->xrefs[pdf->n_xrefs] = malloc(sizeof(xref_t));
-    ++pdf->n_xrefs;
+    if (!valid_ids(first_obj, n_entries) ||
+        n_entries > (off_t)(itr->len - ITR_POS(itr)) / XREF_ENTRY_LEN)
+      return PDF_ERR;
 
     /* Add the entries */
-    xref->first_entry_id = first_obj;
-    xref->entries = malloc(sizeof(xref_entry_t) * n_entries);
-    xref->n_entries = n_entries;
+    xref = new_xref(pdf, offset, first_obj, n_entries);
     for (i=0; i<n_entries; ++i)
     {
         /* Object offset */
@@ -355,38 +1065,293 @@ static int get_xref(pdf_t *pdf, iter_t *itr)
         /* Is free 'f' or in use 'n' */ 
         seek_next(itr, ' ');
         iter_next(itr);
-        xref->entries[i].is_free = ITR_VAL(itr) == 'f';
+        xref->entries[i].is_free = ITR_IN_BOUNDS(itr) && ITR_VAL(itr) == 'f';
     }
 
-    /* Get trailer */
     seek_next_line(itr);
-    if (strncmp("trailer", ITR_VAL_STR(itr), strlen("trailer")) != 0)
+    return PDF_OK;
+}
+
+
+/* True if the xref section at 'offset' has already been loaded */
+static _Bool have_xref(const pdf_t *pdf, off_t offset)
+{
+    int i;
+    for (i=0; i<pdf->n_xrefs; ++i)
+      if (pdf->xrefs[i]->offset == offset)
+        return true;
+    return false;
+}
+
+
+static int get_xref(pdf_t *pdf, iter_t *itr);
+
+
+/* Handle the /Root and /Prev of a trailer (or xref stream dictionary) */
+static int get_trailer(pdf_t *pdf, iter_t *itr, obj_t trailer)
+{
+    off_t offset;
+
+    /* Find /Root (the newest trailer's root is the one to use) */
+    if (find_value_in_object(itr, trailer, "/Root") && !pdf->root_obj)
+    {
+        pdf->root_obj = ITR_VAL_INT(itr);
+        D("Document root located at %lu", pdf->root_obj);
+    }
+
+    /* Find /Prev */
+    if (find_value_in_object(itr, trailer, "/Prev"))
+    {
+        offset = ITR_VAL_INT(itr);
+        if (offset < 0 || offset >= pdf->len || have_xref(pdf, offset))
+          return PDF_ERR; /* Bad or circular /Prev */
+        iter_set(itr, offset);
+        return get_xref(pdf, itr);
+    }
+
+    return PDF_OK;
+}
+
+
+/* Read the integers of array 'key' in 'obj' into 'vals' (at most 'max').
+ * Returns the number read, or -1 if there is no such array.
+ */
+static int get_int_array(iter_t *itr, obj_t obj, const char *key,
+                         off_t *vals, int max)
+{
+    int n = 0;
+
+    if (!find_in_object(itr, obj, key))
+      return -1;
+    seek_next(itr, '[');
+    iter_next(itr);
+
+    for ( ;; )
+    {
+        skip_whitespace(itr);
+        if (n == max || ITR_POS(itr) >= obj.end || !isdigit(ITR_VAL(itr)))
+          break;
+        vals[n++] = ITR_VAL_INT(itr);
+        while (ITR_IN_BOUNDS(itr) && isdigit(ITR_VAL(itr)))
+          iter_next(itr);
+    }
+
+    return n;
+}
+
+
+/* Big-endian field of 'width' bytes from an xref stream row */
+static off_t get_field(const unsigned char *row, int width)
+{
+    off_t val = 0;
+    while (width--)
+      val = (val << 8) | *row++;
+    return val;
+}
+
+
+/* Load the cross-reference stream (/Type /XRef, PDF 1.5) at 'itr'.  Each pair
+ * in /Index (default [0 /Size]) becomes an xref.  'follow_prev' is false for
+ * the /XRefStm of a hybrid file, whose trailer does that itself.
+ */
+#define MAX_XREF_INDEX 256
+static int get_xref_stream(pdf_t *pdf, iter_t *itr, _Bool follow_prev)
+{
+    int i, n_index, type;
+    off_t j, k, n_rows, w[3], index[MAX_XREF_INDEX], offset = ITR_POS(itr);
+    size_t len, row_len;
+    obj_t obj, dict;
+    stream_t stream;
+    xref_t *xref;
+    xref_entry_t *entry;
+    const unsigned char *row;
+    char *data;
+
+    if (!object_at(pdf, offset, 0, &obj) ||
+        !resolve_stream(pdf, obj, &stream))
+      return PDF_ERR;
+
+    /* Only look at the dictionary, not the (binary) stream data */
+    dict = obj;
+    if (!find_in_object(itr, obj, "stream"))
+      return PDF_ERR;
+    dict.end = ITR_POS(itr);
+    if (!find_in_object(itr, dict, "/XRef"))
+      return PDF_ERR; /* Not an xref stream */
+
+    /* Field widths and which objects are described */
+    if (get_int_array(itr, dict, "/W", w, 3) != 3)
+      return PDF_ERR;
+    if ((n_index = get_int_array(itr, dict, "/Index", index, MAX_XREF_INDEX))<0)
+    {
+        index[0] = 0;
+        index[1] = get_int(itr, dict, "/Size", 0);
+        n_index = 2;
+    }
+
+    if (w[0] > 8 || w[1] > 8 || w[2] > 8 ||
+        (row_len = w[0] + w[1] + w[2]) == 0)
+      return PDF_ERR; /* Fields wider than an off_t, or no fields */
+    for (i=0; i+1<n_index; i+=2)
+      if (!valid_ids(index[i], index[i+1]))
+        return PDF_ERR;
+
+    if (!(data = pdf_decode_stream(pdf, &stream, &len)))
+      return PDF_ERR;
+
+    /* No more entries than there are rows left for (a short stream's missing
+     * entries are not in any xref, so are free)
+     */
+    row = (const unsigned char *)data;
+    for (i=0; i+1<n_index; i+=2)
+    {
+        n_rows = ((const unsigned char *)data + len - row) / row_len;
+        if (index[i+1] > n_rows)
+          index[i+1] = n_rows;
+        xref = new_xref(pdf, offset, index[i], index[i+1]);
+        for (j=0; j<index[i+1]; ++j, row+=row_len)
+        {
+            /* Type defaults to 1 (in use) if the field is not present */
+            type = w[0] ? get_field(row, w[0]) : 1;
+            k = get_field(row + w[0], w[1]);
+            entry = &xref->entries[j];
+            switch (type)
+            {
+                case 1: /* Uncompressed object at offset 'k' */
+                    entry->offset = k;
+                    entry->generation = get_field(row + w[0] + w[1], w[2]);
+                    break;
+
+                case 2: /* In object stream 'k' */
+                    entry->objstm = k;
+                    entry->offset = get_field(row + w[0] + w[1], w[2]);
+                    break;
+
+                default: /* Free (or unknown, which we treat as free) */
+                    entry->is_free = true;
+                    break;
+            }
+        }
+    }
+
+    free(data);
+    return follow_prev ? get_trailer(pdf, itr, dict) : PDF_OK;
+}
+
+
+/* Load the xref table at 'itr' and, through /Prev, all older sections.
+ * Sections are added newest first.
+ */
+static int get_xref_table(pdf_t *pdf, iter_t *itr)
+{
+    int i, first, err;
+    off_t offset = ITR_POS(itr);
+    obj_t trailer;
+    xref_t **stm;
+
+    /* Each subsection starts with a line "<first id> <count>" */
+    first = pdf->n_xrefs;
+    seek_next_line(itr);
+    while (ITR_IN_BOUNDS(itr) && isdigit(ITR_VAL(itr)))
+      if (get_xref_subsection(pdf, itr, offset) != PDF_OK)
+        return PDF_ERR;
+
+    /* Get trailer */
+    if (!ITR_IN_BOUNDS_V(itr, strlen("trailer")) ||
+        strncmp("trailer", ITR_VAL_STR(itr), strlen("trailer")) != 0)
       return PDF_ERR; /*  Could not locate trailer */
     
-    trailer = ITR_POS(itr);
+    /* Only look at this trailer (up to its startxref), not at later ones */
+    trailer.id = 0;
+    trailer.begin = ITR_POS(itr);
+    trailer.end = seek_string(itr, "startxref") ? ITR_POS(itr) : pdf->len-1;
+    trailer.data = pdf->data;
+    trailer.len = pdf->len;
+
+    /* Hybrid file: Compressed objects are described by an xref stream
+     * (/XRefStm).  Its entries take precedence over this table's, so move
+     * them in front of the table's.
+     */
+    if (find_value_in_object(itr, trailer, "/XRefStm"))
+    {
+        offset = ITR_VAL_INT(itr);
+        i = pdf->n_xrefs;
+        if (offset >= 0 && offset < pdf->len && !have_xref(pdf, offset))
+        {
+            iter_set(itr, offset);
+            if ((err = get_xref_stream(pdf, itr, false)) != PDF_OK)
+              return err;
+            ERR((stm = malloc(sizeof(xref_t *) * (pdf->n_xrefs - i))), ==NULL,
+                "Could not allocate xref");
+            memcpy(stm, pdf->xrefs + i, sizeof(xref_t *) * (pdf->n_xrefs - i));
+            memmove(pdf->xrefs + first + (pdf->n_xrefs - i),
+                    pdf->xrefs + first, sizeof(xref_t *) * (i - first));
+            memcpy(pdf->xrefs + first, stm, sizeof(xref_t *)*(pdf->n_xrefs-i));
+            free(stm);
+        }
+    }
+
+    return get_trailer(pdf, itr, trailer);
+}
+
+
+/* Load the xref section (a table or a stream) at 'itr' and, through /Prev,
+ * all older sections.
+ */
+static int get_xref(pdf_t *pdf, iter_t *itr)
+{
+    if (ITR_IN_BOUNDS_V(itr, strlen("xref")) &&
+        strncmp("xref", ITR_VAL_STR(itr), strlen("xref")) == 0)
+      return get_xref_table(pdf, itr);
+    return get_xref_stream(pdf, itr, true);
+}
+
+
+/* Merge all xref sections into one table indexed by object id.  The sections
+ * are applied from oldest to newest, so the newest entry for an object wins.
+ */
+static int build_object_index(pdf_t *pdf)
+{
+    int i;
+    off_t id, j;
+    const xref_t *xref;
+
+    for (i=0; i<pdf->n_xrefs; ++i)
+    {
+        xref = pdf->xrefs[i];
+        if (xref->first_entry_id + xref->n_entries > pdf->n_objects)
+          pdf->n_objects = xref->first_entry_id + xref->n_entries;
+    }
 
-    /* Find /Root */
-    if (!seek_string(itr, "/Root"))
+    if (!(pdf->objects = malloc(sizeof(xref_entry_t) * (pdf->n_objects+1))))
       return PDF_ERR;
-    seek_next_nonwhitespace(itr);
-    xref->root_obj = ITR_VAL_INT(itr);
-    D("Document root located at %lu", xref->root_obj);
+    for (id=0; id<pdf->n_objects; ++id)
+    {
+        pdf->objects[id].offset = 0;
+        pdf->objects[id].generation = 0;
+        pdf->objects[id].is_free = true; /* Not in any xref */
+        pdf->objects[id].objstm = 0;
+    }
 
-    /* Find /Prev */
-    iter_set(itr, trailer);
-    if (seek_string(itr, "/Prev"))
+    for (i=pdf->n_xrefs-1; i>=0; --i)
     {
-        seek_next_nonwhitespace(itr);
-        iter_set(itr, ITR_VAL_INT(itr));
-        get_xref(pdf, itr);
+        xref = pdf->xrefs[i];
+        for (j=0; j<xref->n_entries; ++j)
+          pdf->objects[xref->first_entry_id + j] = xref->entries[j];
     }
 
+    /* Cache for object streams (filled in as compressed objects are used) */
+    if (!(pdf->objstms = calloc(pdf->n_objects + 1, sizeof(objstm_t *))))
+      return PDF_ERR;
+
+    D("Object index holds %lu objects", pdf->n_objects);
     return PDF_OK;
 }
 
 
 static int get_xrefs(pdf_t *pdf)
 {
+    int err;
     off_t xref;
     iter_t *itr;
     
@@ -397,19 +1362,32 @@ static int get_xrefs(pdf_t *pdf)
     seek_previous_line(itr); /* Get xref offset */
     xref = ITR_VAL_INT(itr);
     D("Initial xref table located at offset %lu", xref);
+    if (xref < 0 || xref >= pdf->len)
+    {
+        iter_destroy(itr);
+        return PDF_ERR;
+    }
 
     /* Get xref */
     iter_set(itr, xref);
-    get_xref(pdf, itr);
+    err = get_xref(pdf, itr);
     iter_destroy(itr);
+    if (err != PDF_OK)
+      return err;
 
-    return PDF_OK;
+    return build_object_index(pdf);
 }
 
 
 static int get_version(pdf_t *pdf)
 {
-    if (sscanf(pdf->data,"%%PDF-%d.%d",&pdf->ver_major,&pdf->ver_minor) != 2)
+    char hdr[16];
+    size_t len = (pdf->len < sizeof(hdr)) ? pdf->len : sizeof(hdr) - 1;
+
+    /* The data need not end in a NUL (e.g. a caller's buffer) */
+    memcpy(hdr, pdf->data, len);
+    hdr[len] = '\0';
+    if (sscanf(hdr, "%%PDF-%d.%d", &pdf->ver_major, &pdf->ver_minor) != 2)
       return PDF_ERR; /* "Bad version string" */
     D("PDF Version: %d.%d", pdf->ver_major, pdf->ver_minor);
     return PDF_OK;
@@ -420,48 +1398,166 @@ static int get_version(pdf_t *pdf)
 int pdf_load_data(pdf_t *pdf)
 {
     int err;
+    uint64_t start;
     
     if ((err = get_version(pdf)) != PDF_OK)
       return err;
-    if ((err = get_xrefs(pdf)) != PDF_OK)
+    start = TIMING_ON(pdf) ? stats_now() : 0;
+    err = get_xrefs(pdf);
+    STATS_ADD(pdf, xref_ns, stats_now() - start);
+    TRACE_SPAN("xrefs", start, -1);
+    if (err != PDF_OK)
       return err;
-    if ((err = get_page_tree(pdf)) != PDF_OK)
-      return err;
-    return PDF_OK;
+    start = TIMING_ON(pdf) ? stats_now() : 0;
+    err = get_page_tree(pdf);
+    STATS_ADD(pdf, page_tree_ns, stats_now() - start);
+    TRACE_SPAN("page tree", start, pdf->pages_root ? pdf->pages_root : -1);
+    return err;
 }
 
 
 pdf_t *pdf_new(const char *fname)
 {
-    int fd;
-    struct stat stat;
+    return pdf_new_flags(fname, 0);
+}
+
+
+pdf_t *pdf_new_flags(const char *fname, int flags)
+{
+    int fd, err;
     pdf_t *pdf;
-   
-    pdf = calloc(1, sizeof(pdf_t));
-    pdf->fname = fname;
 
     /* Open and map the file into memory */
     ERR((fd = open(fname, O_RDONLY)), ==-1, "Opening file '%s'", fname);
-    ERR(fstat(fd, &stat), ==-1, "Obtaining file size");
-    ERR((pdf->data=mmap(
-         NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0)),==NULL,
-        "Mapping file into memory");
-    pdf->len = stat.st_size;
-
-    /* Get the initial cross reference table */
-    ERR(pdf_load_data(pdf), != PDF_OK, "Could not load pdf");
+    pdf = pdf_new_from_fd(fd, flags, &err);
+    close(fd); /* The mapping stays */
+    ERR(err, ==PDF_ERR_IO, "Mapping file '%s' into memory", fname);
+    ERR(pdf, ==NULL, "Could not load pdf '%s'", fname);
+
+    pdf->fname = fname;
+    return pdf;
+}
+
+
+/* Make a pdf of the 'len' bytes at 'data' and load it.  'mapped' says that
+ * 'data' is a mapping to undo when the pdf is destroyed, else it is the
+ * caller's.  Returns NULL (and the error in 'error') if it cannot be loaded.
+ */
+static pdf_t *new_pdf(
+    const char *data,
+    size_t      len,
+    _Bool       mapped,
+    int         flags,
+    int        *error)
+{
+    uint64_t start;
+    pdf_t *pdf;
+
+    if (!(pdf = calloc(1, sizeof(pdf_t))))
+    {
+        if (mapped)
+          munmap((void *)data, len);
+        *error = PDF_ERR_NOMEM;
+        return NULL;
+    }
+
+    pdf->data = data;
+    pdf->len = len;
+    pdf->mapped = mapped;
+    pdf->flags = flags;
+    pthread_mutex_init(&pdf->lock, NULL);
+    pthread_mutex_init(&pdf->objstm_lock, NULL);
+    pthread_mutex_init(&pdf->cmap_lock, NULL);
+    stats_init(pdf);
+    start = TIMING_ON(pdf) ? stats_now() : 0;
+
+    /* Get the initial cross reference table (the shortest header is
+     * "%PDF-1.0")
+     */
+    if (len < strlen("%PDF-1.0") || pdf_load_data(pdf) != PDF_OK)
+    {
+        pdf_destroy(pdf);
+        *error = PDF_ERR_FORMAT;
+        return NULL;
+    }
+
+    STATS_ADD(pdf, open_ns, stats_now() - start);
+    TRACE_SPAN("open", start, -1);
+    *error = PDF_OK;
     return pdf;
 }
 
 
+pdf_t *pdf_new_from_memory(
+    const void *data,
+    size_t      len,
+    int         flags,
+    int        *error)
+{
+    return new_pdf(data, len, false, flags, error);
+}
+
+
+pdf_t *pdf_new_from_fd(int fd, int flags, int *error)
+{
+    void *data;
+    struct stat stat;
+
+    if (fstat(fd, &stat) == -1)
+    {
+        *error = PDF_ERR_IO;
+        return NULL;
+    }
+    if (stat.st_size == 0)
+    {
+        *error = PDF_ERR_FORMAT; /* Nothing to map */
+        return NULL;
+    }
+
+    data = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        *error = PDF_ERR_IO;
+        return NULL;
+    }
+
+    return new_pdf(data, stat.st_size, true, flags, error);
+}
+
+
 void pdf_destroy(pdf_t *pdf)
 {
     int i;
+    off_t id;
+
     for (i=0; i<pdf->n_xrefs; ++i)
     {
         free(pdf->xrefs[i]->entries);
         free(pdf->xrefs[i]);
     }
-    munmap((void *)pdf->data, pdf->len);
+    free(pdf->xrefs);
+
+    for (id=0; pdf->objstms && id<pdf->n_objects; ++id)
+      if (pdf->objstms[id])
+      {
+          free(pdf->objstms[id]->data);
+          free(pdf->objstms[id]->ids);
+          free(pdf->objstms[id]->offsets);
+          free(pdf->objstms[id]);
+      }
+    free(pdf->objstms);
+
+    pdf_set_stream_cache(pdf, 0);
+    font_cmaps_free(pdf);
+    free(pdf->objects);
+    for (i=0; i<pdf->n_pages; ++i)
+      free(pdf->pages[i].contents);
+    free(pdf->pages);
+    pthread_mutex_destroy(&pdf->lock);
+    pthread_mutex_destroy(&pdf->objstm_lock);
+    pthread_mutex_destroy(&pdf->cmap_lock);
+    stats_free(pdf);
+    if (pdf->mapped)
+      munmap((void *)pdf->data, pdf->len);
     free(pdf);
 }
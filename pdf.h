@@ -22,17 +22,56 @@
 
 #ifndef __PDF_H_INCLUDE
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 
 
 #define TAG      "libnahcopdf"
 #define PDF_ERR -1
 #define PDF_OK   0
 
+/* Why pdf_new_from_memory or pdf_new_from_fd failed */
+#define PDF_ERR_IO     -2 /* Could not stat or map the file        */
+#define PDF_ERR_FORMAT -3 /* Not a pdf, or not one that can be read */
+#define PDF_ERR_NOMEM  -4
+
 
 static const char _libnachopdf_version[] = "0.1"; /* Alpha */
 
 
+/* Thread safety
+ *
+ * The state of a document lives in its pdf_t, and the state of the work on it
+ * in the decode_t/iter_t doing that work.  The rest is process-wide:
+ *
+ *  - Tracing (pdf_trace_start/pdf_trace_write): whether it is on, the list of
+ *    trace buffers (under its own lock), and each thread's own buffer, kept in
+ *    thread-local storage.
+ *  - Stats (PDF_STATS): the counter handing out each pdf's stats_id (under its
+ *    own lock), and each thread's recently used stats blocks, kept in
+ *    thread-local storage.  The blocks themselves are in the pdf_t.
+ *
+ * Therefore:
+ *
+ *  - Different pdf_t instances can be created, used and destroyed by different
+ *    threads at the same time.
+ *  - Once pdf_new() returns, a pdf_t is only ever read.  Any number of threads
+ *    can decode pages or look up objects of the same pdf_t at once, as long as
+ *    each thread uses its own decode_t and iter_t.  (The exceptions are the
+ *    page table of a pdf opened with PDF_LAZY_PAGES, which is filled in under
+ *    the pdf's lock as pages are first used, and the stream cache, the
+ *    fonts' CMaps and the stats blocks, which have locks of their own.)
+ *  - Functions that modify a pdf_t (pdf_load_data, pdf_set_stream_cache and
+ *    pdf_destroy) must not be run while any other thread is using that pdf_t.
+ *  - Tracing is started and written for the whole process:
+ *    pdf_trace_start and pdf_trace_write must not be run while any pdf is
+ *    being opened or decoded, by any thread.
+ *
+ * Each public routine below notes which of these rules applies to it.
+ */
+
+
 #ifdef DEBUG_PDF
 #define D(...) \
     do{fprintf(stderr,"["TAG"][debug] "__VA_ARGS__);putc('\n',stderr);}while(0)
@@ -57,49 +96,221 @@ typedef unsigned long long off_t;
 #endif
 
 
-/* Entry for a cross reference table */
-typedef struct {off_t offset; off_t generation; char is_free;} xref_entry_t;
+/* Entry for a cross reference table.  Objects compressed into an object
+ * stream have 'objstm' set to the object number of that stream, and 'offset'
+ * is then the index of the object within the stream.
+ */
+typedef struct {
+    off_t offset;
+    off_t generation;
+    char  is_free;
+    off_t objstm;
+} xref_entry_t;
 
 
-/* Cross reference table */
+/* Cross reference table (one per subsection of an xref section) */
 typedef struct {
     int           n_entries;
     xref_entry_t *entries;
     off_t         first_entry_id;
-    off_t         root_obj;
+    off_t         offset; /* Where the xref section starts in the pdf */
 } xref_t;
 
 
-/* Page type (just keep the kids not their parents) */
-typedef struct _kid_t {int pg_num; off_t id; struct _kid_t *next;} kid_t;
+/* Stream filters we know about (anything else is FILTER_UNKNOWN) */
+typedef enum {FILTER_UNKNOWN, FILTER_FLATE} filter_e;
+
+
+/* Stream descriptor: Where a stream's data lives and how it is encoded */
+#define MAX_FILTERS 4
+typedef struct {
+    off_t    id;                   /* Object number of the stream          */
+    off_t    offset;               /* First byte of the stream data        */
+    size_t   length;               /* Bytes of (encoded) stream data       */
+    size_t   decoded_length;       /* From /DL, 0 if not given             */
+    int      n_filters;            /* 0 means the data is not encoded      */
+    filter_e filters[MAX_FILTERS]; /* Filter chain, in the order to decode */
+
+    /* From /DecodeParms, for undoing a PNG predictor after inflating */
+    int      predictor, columns, colors, bpc;
+} stream_t;
+
+
+/* A decoded object stream (/Type /ObjStm), kept once it has been loaded */
+typedef struct {
+    char   *data;    /* Decoded stream data (NUL terminated) */
+    size_t  len;
+    int     n_objs;
+    off_t  *ids;     /* Object number of each object          */
+    off_t  *offsets; /* Where each object begins within 'data' */
+} objstm_t;
+
+
+/* A decoded stream held by the stream cache (library use only) */
+typedef struct _cached_stream_t
+{
+    off_t  id;
+    char  *data;       /* Decoded stream data (NUL terminated)       */
+    size_t len;
+    int    refs;       /* Decoders currently using 'data'            */
+    _Bool  is_evicted; /* No longer cached, freed by the last release */
+    struct _cached_stream_t *prev, *next; /* Most recently used first */
+} cached_stream_t;
+
+
+/* Cache of decoded streams, see pdf_set_stream_cache() */
+typedef struct
+{
+    size_t            budget;    /* Most bytes of decoded data to keep */
+    size_t            used;
+    int               n_streams;
+    unsigned long     hits, misses, evictions;
+    cached_stream_t **by_id;     /* Object id -> cached stream         */
+    cached_stream_t  *head, *tail;
+    pthread_mutex_t   lock;
+} stream_cache_t;
+
+
+/* A mapping of a font's ToUnicode CMap: Codes 'lo' to 'hi' are the code
+ * points 'uni' to 'uni + hi - lo', unless 'len' is set, in which case code 'lo'
+ * (== 'hi') is the UTF-8 text at 'off' in the CMap's text (library use only).
+ */
+typedef struct
+{
+    unsigned lo, hi;
+    unsigned uni;
+    unsigned off, len;
+} cmap_range_t;
+
+
+/* A font's ToUnicode CMap, compiled for lookups (library use only).  Codes
+ * are 'code_bytes' long: One byte codes are mapped by 'direct' (the offset of
+ * their UTF-8 text << 8 | its length, 0 if unmapped), two byte codes by
+ * 'ranges' (sorted, and not overlapping).  If 'code_bytes' is 0 the font has
+ * no CMap we can use and its strings are taken as they are.
+ */
+typedef struct
+{
+    int           code_bytes;
+    unsigned      direct[256];
+    int           n_ranges;
+    cmap_range_t *ranges;
+    char         *text;     /* UTF-8 text of the mappings       */
+    size_t        text_len;
+    size_t        max_len;  /* Most UTF-8 bytes a code maps to */
+} cmap_t;
+
+
+/* Counters returned by pdf_get_stream_cache_stats() */
+typedef struct
+{
+    size_t        budget, used; /* In bytes */
+    int           n_streams;
+    unsigned long hits, misses, evictions;
+} pdf_cache_stats_t;
+
+
+/* What a pdf opened with PDF_STATS has done, for all threads together (see
+ * pdf_get_stats).  Times are in nanoseconds, and they add up the time of all
+ * threads, so decode_ns can be more than the time taken.
+ */
+typedef struct
+{
+    uint64_t objects_resolved; /* By pdf_get_object                        */
+    uint64_t bytes_scanned;    /* By seek_string and find_in_object        */
+    uint64_t bytes_compressed; /* Stream data inflated...                  */
+    uint64_t bytes_inflated;   /* ...and what it inflated to               */
+    uint64_t ps_runs;          /* Pieces of content stream interpreted     */
+    uint64_t ps_bytes;
+    uint64_t callbacks;        /* Calls of decode objects' callbacks       */
+    uint64_t open_ns;          /* Opening the pdf, with the next two       */
+    uint64_t xref_ns;          /* Reading the xref sections                */
+    uint64_t page_tree_ns;     /* Building the page table (lazily or not)  */
+    uint64_t decode_ns;        /* In pdf_decode_page                       */
+} pdf_stats_t;
+
+typedef struct _stats_block_t stats_block_t;
+
+
+/* Page type (just keep the pages not their parents).  Page 'n' lives at index
+ * 'n-1' of the page table, its content streams are resolved at load time.
+ * A page's contents can be split over several streams, which are decoded in
+ * order as if they were one.
+ */
+typedef struct {
+    off_t     id;          /* Object number of the page dictionary      */
+    _Bool     is_resolved; /* False until a lazily loaded page is used */
+    int       n_contents;
+    stream_t *contents;
+} page_t;
+
+
+/* Flags for pdf_new_flags() */
+#define PDF_LAZY_PAGES 0x1 /* Only read the page count when opening, resolve
+                            * each part of the page tree when a page in it is
+                            * first used.
+                            */
+#define PDF_STATS      0x2 /* Keep count of what is done (pdf_get_stats)   */
 
 
 /* Data type: Contains a pointer to the raw pdf data */
 typedef struct {
     const char   *data;
-    const char   *fname; /* File name */
+    const char   *fname; /* File name (NULL if not opened by name) */
     size_t        len;
+    _Bool         mapped; /* 'data' is ours to unmap, not the caller's  */
     int           ver_major, ver_minor;
     int           n_xrefs;
-    xref_t      **xrefs;
-    kid_t        *kids; /* Linked-list of all pages */
+    xref_t      **xrefs;   /* Newest section first                         */
+    xref_entry_t *objects; /* All xrefs merged: object id -> newest entry  */
+    off_t         n_objects;
+    off_t         root_obj; /* Document catalog (from the newest trailer)   */
+    page_t       *pages;   /* Page table: pages[0] is page 1 */
+    int           n_pages;
+    int           max_pages; /* Allocated length of 'pages'    */
+    off_t         pages_root; /* Root /Pages node of the page tree */
+    int           flags;      /* PDF_LAZY_PAGES, PDF_STATS         */
+    pthread_mutex_t lock;     /* Serializes lazy page loading      */
+    objstm_t    **objstms;    /* Object id -> decoded object stream */
+    pthread_mutex_t objstm_lock; /* Serializes loading 'objstms'    */
+    stream_cache_t *stream_cache; /* NULL unless enabled           */
+    cmap_t      **cmaps;      /* Font object id -> its ToUnicode CMap */
+    pthread_mutex_t cmap_lock;   /* Serializes loading 'cmaps'      */
+    stats_block_t *stats;     /* One per thread, if PDF_STATS       */
+    pthread_mutex_t stats_lock;  /* Serializes adding to 'stats'    */
+    unsigned long  stats_id;
 }pdf_t;
 
 
-/* Range type */
-typedef struct {off_t id; off_t begin; off_t end;} obj_t;
+/* Range type: 'begin' and 'end' index into 'data', which is the pdf data for
+ * most objects and the decoded object stream for compressed objects.
+ */
+typedef struct {
+    off_t       id;
+    off_t       begin;
+    off_t       end;
+    const char *data;
+    size_t      len;  /* Length of 'data' */
+} obj_t;
 
 
-/* Iterator type: Index into data */
-typedef struct {off_t idx; const pdf_t *pdf;} iter_t;
-#define ITR_VAL(_itr)       _itr->pdf->data[_itr->idx]
-#define ITR_VAL_INT(_itr)   atoll(_itr->pdf->data + _itr->idx)
-#define ITR_VAL_STR(_itr)   (char *)(_itr->pdf->data + _itr->idx)
+/* Iterator type: Index into data (the pdf's data, or that of the object the
+ * iterator was last pointed at by find_in_object).
+ */
+typedef struct {
+    off_t        idx;
+    const pdf_t *pdf;
+    const char  *data;
+    size_t       len;  /* Length of 'data' */
+} iter_t;
+#define ITR_VAL(_itr)       _itr->data[_itr->idx]
+#define ITR_VAL_INT(_itr)   iter_int(_itr)
+#define ITR_VAL_STR(_itr)   (char *)(_itr->data + _itr->idx)
 #define ITR_POS(_itr)       _itr->idx
-#define ITR_ADDR(_itr)      (_itr->pdf->data + _itr->idx)
-#define ITR_IN_BOUNDS(_itr) (_itr->idx < _itr->pdf->len)
+#define ITR_ADDR(_itr)      (_itr->data + _itr->idx)
+#define ITR_IN_BOUNDS(_itr) (_itr->idx < _itr->len)
 #define ITR_IN_BOUNDS_V(_itr, _val) \
-    ((_itr->idx+_val) < _itr->pdf->len)
+    ((_itr->idx+_val) < _itr->len)
 
 
 /* Decoding return values, all decoding routines and the callback return one
@@ -115,12 +326,133 @@ struct _decode_t;
 typedef  decode_exit_e (*decode_cb)(struct _decode_t *decode);
 
 
-/* For decoding data */
+/* Text runs: The text shown by one text showing operator (Tj, TJ, ' or ")
+ * and where on the page it starts.  Runs are handed out in batches, stored as
+ * a struct of arrays so that a batch can be worked on a column at a time.
+ *
+ * Run 'i' of a batch is the text arena[start[i]] to arena[start[i]+len[i]-1],
+ * starting at (x[i], y[i]) in default user space (points from the bottom left
+ * of the page) in a font of size[i] points, on page page[i].
+ *
+ * The position of the first run after a line is placed (Td, Tm and the like)
+ * is exact.  Runs after it on the same line are placed by estimating glyph
+ * widths, as the fonts' metrics are not read.
+ */
+#define TEXT_RUN_BATCH 256
+#define TEXT_RUN_ARENA (16 * 1024) /* A batch is handed out at this much text */
+typedef struct
+{
+    int       n_runs;
+    float     x[TEXT_RUN_BATCH];
+    float     y[TEXT_RUN_BATCH];
+    float     size[TEXT_RUN_BATCH];
+    unsigned  start[TEXT_RUN_BATCH];
+    unsigned  len[TEXT_RUN_BATCH];
+    int       page[TEXT_RUN_BATCH];
+    char     *arena;
+    size_t    arena_used, arena_max;
+} text_runs_t;
+
+
+/* Function pointer: Called back with each batch of text runs (see
+ * decode_t.run_callback).  The batch is only valid until the call returns.
+ */
+typedef decode_exit_e (*text_runs_cb)(
+    struct _decode_t *decode, const text_runs_t *runs);
+
+
+/* Text state of the page being decoded (library use only).  This lives in the
+ * decode object, rather than the decoding routine, so that separate decode
+ * objects can be used to decode pages at the same time.
+ */
+#define MAX_GSTATE 16 /* q/Q nesting kept track of (deeper is ignored) */
+#define MAX_PAGE_FONTS 8
+typedef struct
+{
+    _Bool  in_array;
+    double Tm[6], Tlm[6]; /* Text and text line matrices              */
+    double ctm[6];        /* Current transformation matrix            */
+    double Tc, Tw, Th, TL, Tfs;
+    double Tj;            /* Sum of the adjustments in a TJ array     */
+    int    n_saved;       /* Depth of q/Q nesting                     */
+    double saved_ctm[MAX_GSTATE][6];
+    char   font[64]; /* Name of the font set by Tf (without the '/') */
+    const cmap_t *cmap; /* Its ToUnicode CMap                      */
+    struct {            /* The page's last few fonts and their CMaps */
+        char          name[64];
+        const cmap_t *cmap;
+    } fonts[MAX_PAGE_FONTS];
+    int    n_fonts;
+} text_state_t;
+
+
+/* Numeric operands of the content stream lexer (library use only).  Each
+ * operator uses up (clears) the operands before it.  No operator we run takes
+ * more than six, so if there are more than MAX_OPERANDS the oldest are dropped.
+ */
+#define MAX_OPERANDS 16
+typedef struct
+{
+    int    n_vals;
+    double vals[MAX_OPERANDS]; /* vals[n_vals-1] is the top */
+} operand_stack_t;
+
+
+/* Content stream lexer state (library use only).  This lives in the decode
+ * object so that a token split across the windows a stream is inflated in (or
+ * across the streams of a page) is picked up where it was left off.
+ */
+#define MAX_TOKEN 64
+typedef struct
+{
+    int    state;          /* What is being lexed (see decode.c)        */
+    int    depth;          /* Nesting of () within a literal string (or
+                            * how much of "EI" after inline image data)
+                            */
+    int    esc, esc_val;   /* Escape sequence being read in a string    */
+    int    hex;            /* First digit of a hex string byte, or -1   */
+    _Bool  done;           /* The callback said to stop                 */
+    char   tok[MAX_TOKEN]; /* Name, number or operator being read       */
+    int    tok_len;
+    char   name[MAX_TOKEN]; /* Last name operand (e.g. the font of Tf)  */
+    operand_stack_t vals;  /* Numeric operands                          */
+    char  *str;            /* String operands since the last operator   */
+    size_t str_len, str_max;
+    char  *text;           /* The strings mapped to UTF-8 (by a CMap)  */
+    size_t text_max;
+} lex_state_t;
+
+
+/* Text of every page of a pdf, kept in a file next to it (see sidecar.c) so
+ * that it can be had again without parsing or decoding the pdf at all.
+ */
+#define PDF_SIDECAR_EXT ".pagetext"
+typedef struct
+{
+    const char     *data;    /* The sidecar file, mapped         */
+    size_t          len;
+    int             n_pages;
+    const uint64_t *offsets; /* Where each page's text starts,
+                              * and (the last) where it all ends
+                              */
+    const char     *text;
+} pdf_sidecar_t;
+
+
+/* For decoding data.  A decode object must only be used by one thread at a
+ * time, but any number of them can be decoding the same pdf at once.
+ * A decode object holds state of the library's (the fields marked "library
+ * use only", and the lexer's buffers), so it must be set up by
+ * pdf_decode_init() before it is first used, and be passed to
+ * pdf_decode_release() when done with.
+ */
 typedef struct _decode_t
 {
     const pdf_t *pdf;
     int          pg_num;
     decode_cb    callback;
+    text_state_t text;   /* Reset by pdf_decode_page() */
+    lex_state_t  lex;    /* Reset by pdf_decode_page() */
 
     /* Decoded data will end up here... user must give a buffer and its length.
      * the buffer is NOT null terminated by the decoing routines.
@@ -135,20 +467,68 @@ typedef struct _decode_t
     size_t  buffer_length; /* Should never change once set */
     size_t  buffer_used;
 
+    /* Text can also be had as positioned runs (see text_runs_t): Set
+     * 'run_callback' and it is called with a batch of runs whenever one fills
+     * up, and with the rest at the end of each page (before 'callback').
+     * Leave 'buffer' NULL to only get runs, 'callback' is then optional.
+     */
+    text_runs_cb run_callback;
+    text_runs_t *runs; /* Batch being filled (library use only) */
+
     /* Stash anything here, the pdf library should never touch this... like a
      * Swiss bank of data.
      */
     void *user_data;
+
+    /* Compressed streams are inflated (and then parsed) 'window_size' bytes at
+     * a time, 0 means the default of 64K.
+     */
+    size_t window_size;
+
+    /* Inflate backend to use (see pdf_inflater_name), 0 is the fastest one
+     * built in.  The others are only of use for comparing them.
+     */
+    int inflater;
+
+    /* Inflate state, reused between pages (library use only) */
+    void *inflate;
+
+    /* If set, pages come from this sidecar instead: 'pdf' is not used (and
+     * can be NULL) and only the text is had, there are no text runs.
+     */
+    const pdf_sidecar_t *sidecar;
 } decode_t;
 
 
-/* Allocate or destroy a PDF instance (this does loads the pdf) */
+/* Allocate or destroy a PDF instance (this does loads the pdf)
+ * pdf_new_flags takes PDF_* flags (e.g. PDF_LAZY_PAGES), pdf_new uses none.
+ * Both exit if the file cannot be opened or loaded.
+ * Thread-safe: pdf_new can be called from any thread.  pdf_destroy must not
+ * be called while another thread is using the pdf.
+ */
 extern pdf_t *pdf_new(const char *filename);
+extern pdf_t *pdf_new_flags(const char *filename, int flags);
 extern void pdf_destroy(pdf_t *pdf);
 
 
+/* Load a pdf that is already in memory, or in an open file, without exiting
+ * on error: They return NULL and set 'error' (to a PDF_ERR_* code) if it
+ * cannot be loaded, else set it to PDF_OK.
+ * pdf_new_from_memory uses the caller's 'len' bytes at 'data' as they are (no
+ * copy is made), which must stay put until the pdf is destroyed.
+ * pdf_new_from_fd maps the file 'fd' is open on, and does not close 'fd' (the
+ * pdf does not need it once made).
+ * Neither pdf has a file name, so it cannot have a sidecar.
+ * Thread-safe: as pdf_new.
+ */
+extern pdf_t *pdf_new_from_memory(
+    const void *data, size_t len, int flags, int *error);
+extern pdf_t *pdf_new_from_fd(int fd, int flags, int *error);
+
+
 /* Load the pdf data.  
  * Returns PDF_OK success or error otherwise.
+ * Not thread-safe: modifies 'pdf', nothing else may be using it.
  */
 extern int pdf_load_data(pdf_t *pdf);
 
@@ -157,20 +537,219 @@ extern int pdf_load_data(pdf_t *pdf);
  * beginging and end indicies for the object within the pdf.
  * Result is placed in 'obj'
  * Returns 'true' on success, 'false' otherwise
+ * Thread-safe: Object streams are decoded (once) under the pdf's objstm_lock.
  */
 extern _Bool pdf_get_object(const pdf_t *pdf, off_t object_number, obj_t *obj);
 
 
+/* Get page 'pg_num' (the first page is 1) from the page table, resolving it
+ * first if the pdf was opened with PDF_LAZY_PAGES.
+ * Returns NULL if there is no such page.
+ * Thread-safe: lazy resolution is done under the pdf's lock.
+ */
+extern const page_t *pdf_get_page(const pdf_t *pdf, int pg_num);
+
+
+/* Resolve the stream object 'obj_id' (where its data is and how it is
+ * encoded).  Returns 'false' if it is not a stream.
+ * Thread-safe: only reads 'pdf'.
+ */
+extern _Bool pdf_get_stream(const pdf_t *pdf, off_t obj_id, stream_t *stream);
+
+
+/* Object id of the font that page 'pg_num' calls 'name' (without the '/') in
+ * its resources, or -1 if it has no such font.
+ * Thread-safe: as pdf_get_page().
+ */
+extern off_t pdf_get_font(const pdf_t *pdf, int pg_num, const char *name);
+
+
+/* Decode all of a stream's data (e.g. inflate it and undo any predictor).
+ * Returns a newly allocated, NUL terminated, buffer (caller frees) and sets
+ * 'length' to the number of decoded bytes, or returns NULL on error.
+ * Thread-safe: only reads 'pdf'.
+ */
+extern char *pdf_decode_stream(
+    const pdf_t *pdf, const stream_t *stream, size_t *length);
+
+
+/* Get a decode object ready to decode pages of 'pdf' (NULL if they come from a
+ * sidecar).  Everything else in it is cleared, so set the buffer, callback and
+ * the rest after.
+ * Thread-safe: only touches 'decode'.
+ */
+extern void pdf_decode_init(decode_t *decode, const pdf_t *pdf);
+
+
+/* Free the state a decode object keeps between pages (the decode object can
+ * still be used again afterwards).
+ * Thread-safe: only touches 'decode'.
+ */
+extern void pdf_decode_release(decode_t *decode);
+
+
+/* Name of inflate backend 'idx' (for decode_t.inflater), or NULL if there is
+ * no such backend.  Backend 0 is the fastest (libdeflate when built with
+ * HAVE_LIBDEFLATE, otherwise zlib), and the last one is zlib a window at a time,
+ * which all of them fall back on.
+ * Thread-safe: only reads constant data.
+ */
+extern const char *pdf_inflater_name(int idx);
+
+
+/* Keep up to 'budget' bytes of decoded streams (e.g. page contents) so that
+ * decoding a page again does not inflate its contents again.  The least
+ * recently used streams are dropped first.  Passing a budget of 0 disables the
+ * cache (it is disabled by default).
+ * Returns PDF_OK on success, PDF_ERR otherwise.
+ * Not thread-safe: must not be called while the pdf is being decoded.
+ */
+extern int pdf_set_stream_cache(pdf_t *pdf, size_t budget);
+
+
+/* Fill 'stats' with the stream cache's counters (all zero if it is disabled).
+ * Thread-safe: read under the cache's lock.
+ */
+extern void pdf_get_stream_cache_stats(
+    const pdf_t *pdf, pdf_cache_stats_t *stats);
+
+
+/* Fill 'stats' with what 'pdf' has done so far, added up over all threads.
+ * pdf_add_stats adds 'stats' to 'sum' (e.g. to total up several pdfs).
+ * Returns PDF_ERR if the pdf was not opened with PDF_STATS, PDF_OK otherwise.
+ * Thread-safe: each thread only counts into its own block, which this reads
+ * without stopping it, so the numbers are exact once no other thread is
+ * using the pdf (and may be a little behind until then).
+ */
+extern int pdf_get_stats(const pdf_t *pdf, pdf_stats_t *stats);
+extern void pdf_add_stats(pdf_stats_t *sum, const pdf_stats_t *stats);
+
+
+/* Counting for PDF_STATS (library use only): STATS_ADD adds 'n' to this
+ * thread's 'field' of the pdf's stats, and does nothing (not even work out
+ * 'n') if it does not keep any.
+ */
+extern void stats_init(pdf_t *pdf);
+extern void stats_free(pdf_t *pdf);
+extern pdf_stats_t *stats_local(const pdf_t *pdf);
+extern uint64_t stats_now(void);
+
+#define STATS_ON(_pdf) ((_pdf) && ((_pdf)->flags & PDF_STATS))
+#define STATS_ADD(_pdf, _field, _n) \
+    do { \
+        pdf_stats_t *_st; \
+        if (STATS_ON(_pdf) && (_st = stats_local(_pdf))) \
+          _st->_field += (_n); \
+    } while (0)
+
+
+/* Start recording a timeline of what the library does, for all pdfs and
+ * threads: Opening each pdf, reading its xref sections and page tree, and
+ * inflating and decoding each page's contents.
+ * pdf_trace_write stops recording and writes what was recorded to 'fname' as
+ * Chrome trace event JSON (for chrome://tracing or Perfetto), one span for
+ * each, with the thread, page and object it was for.
+ * Both return PDF_OK on success, PDF_ERR otherwise (e.g. if already started
+ * or not started).
+ * Not thread-safe: must not be called while any pdf is being opened or
+ * decoded.  In between, each thread records into a buffer of its own.
+ */
+extern int pdf_trace_start(void);
+extern int pdf_trace_write(const char *fname);
+
+
+/* Recording for tracing (library use only): TRACE_SPAN records a span named
+ * 'name' (a string that must outlive the trace) from 'start' (stats_now())
+ * until now, for object 'obj' (-1 if none) of the page this thread last said
+ * it is decoding with trace_page() (0 if none).  TIMING_ON tells whether the
+ * time is wanted for either stats or tracing.
+ */
+extern int trace_on;
+extern void trace_span(const char *name, uint64_t start, long obj);
+extern void trace_page(int pg_num);
+
+#define TIMING_ON(_pdf) (STATS_ON(_pdf) || trace_on)
+#define TRACE_SPAN(_name, _start, _obj) \
+    do { \
+        if (trace_on) \
+          trace_span(_name, _start, _obj); \
+    } while (0)
+
+
+/* Get the decoded data of 'stream' from the stream cache, decoding and adding
+ * it on a miss.  Returns NULL if the cache is disabled or decoding failed.
+ * Each stream returned must be passed to stream_cache_release when done with.
+ * (Library use only)
+ */
+extern const cached_stream_t *stream_cache_get(
+    const pdf_t *pdf, const stream_t *stream);
+extern void stream_cache_release(
+    const pdf_t *pdf, const cached_stream_t *stream);
+
+
+/* ToUnicode CMap of font object 'font_id', parsed and compiled the first time
+ * the font is used and then shared by all pages using it (library use only).
+ * Returns NULL if it cannot be loaded.
+ * Thread-safe: CMaps are loaded (once) under the pdf's cmap_lock.
+ */
+extern const cmap_t *font_cmap_get(const pdf_t *pdf, off_t font_id);
+
+
+/* Map the codes of string 'in' through 'cmap' into UTF-8 text at '*out',
+ * which is grown as needed.  Returns the length of the text and sets
+ * 'n_codes' to the number of codes (glyphs) in 'in'.
+ */
+extern size_t cmap_map(const cmap_t *cmap, const char *in, size_t len,
+                       char **out, size_t *out_max, size_t *n_codes);
+
+
+/* Free all of the CMaps loaded for 'pdf' (library use only) */
+extern void font_cmaps_free(pdf_t *pdf);
+
+
 /* Given a decode object (which contains a pdf and a page number to decode).
  * The callback in the decode object is called, possibly multiple times during
  * decoding, with a buffer of decoded page data (ascii).
  * PDF_OK is returned on success, PDF_ERR is returned otherwise.
+ * Thread-safe: only reads the pdf, all decoding state lives in 'decode'.  The
+ * callback is run on the calling thread.
  */
 extern int pdf_decode_page(decode_t *decode);
 
 
+/* Write the text of all of 'pdf's pages to its sidecar (its file name plus
+ * PDF_SIDECAR_EXT), replacing any there was.
+ * Returns PDF_OK on success, PDF_ERR otherwise.
+ * Thread-safe: as pdf_decode_page().  The sidecar appears all at once, so it
+ * can be written while others open it.
+ */
+extern int pdf_sidecar_write(const pdf_t *pdf);
+
+
+/* Map the sidecar of the pdf 'fname', if it has one that is up to date: The
+ * pdf must have the size, modification time and content hash it was written
+ * for (this reads all of the pdf, but parses none of it).  Returns NULL if
+ * there is none or it is out of date.
+ * Thread-safe: a sidecar is only read once open.
+ */
+extern pdf_sidecar_t *pdf_sidecar_open(const char *fname);
+extern void pdf_sidecar_close(pdf_sidecar_t *sc);
+
+
+/* Text of page 'pg_num' (the first page is 1) of a sidecar, and its length.
+ * Returns NULL if there is no such page.  The text is not NUL terminated.
+ * Thread-safe: only reads 'sc'.
+ */
+extern const char *pdf_sidecar_page(
+    const pdf_sidecar_t *sc, int pg_num, size_t *len);
+
+
 /* Create or destroy an iterator (for parsing a pdf)
  * offset: Byte offset into the pdf to start the iterator at.
+ *
+ * Thread-safe: All of the iterator and seek routines below only read the pdf
+ * and modify the iterator passed to them.  An iterator must not be shared
+ * between threads without locking.
  */
 extern iter_t *iter_new(const pdf_t *pdf);
 extern iter_t *iter_new_offset(const pdf_t *pdf, off_t offset);
@@ -181,6 +760,7 @@ extern void iter_destroy(iter_t *iter);
 extern void iter_set(iter_t *itr, off_t offset); /* Byte offset into the pdf */
 extern void iter_prev(iter_t *itr);              /* Previous character       */
 extern void iter_next(iter_t *itr);              /* Next character           */
+extern long long iter_int(const iter_t *itr);    /* Integer at the iterator  */
 
 /* Locate a string in a pdf starting at 'itr'
  * Returns 'true' if the string is found, 'false otherwise.
@@ -188,6 +768,29 @@ extern void iter_next(iter_t *itr);              /* Next character           */
 extern _Bool seek_string(iter_t *itr, const char *search);
 
 
+/* Length-bounded scanning (SSE2/AVX2 where available).  None of these read
+ * outside of [s, s+len), which matters as the pdf data is not NUL terminated.
+ * pdf_span_space/nonspace return the length of the run of (non)whitespace
+ * that 's' starts with.
+ * Thread-safe: these only read their arguments.
+ */
+extern const char *pdf_memchr(const char *s, int c, size_t len);
+extern const char *pdf_memrchr(const char *s, int c, size_t len);
+extern const char *pdf_memmem(
+    const char *s, size_t len, const char *find, size_t find_len);
+extern size_t pdf_span_space(const char *s, size_t len);
+extern size_t pdf_span_nonspace(const char *s, size_t len);
+
+
+/* Parse the PDF number (an integer or real: optional sign, digits and an
+ * optional '.' and fraction, no exponent) at the start of [s, s+len) into
+ * 'val'.  Unlike atof/strtod this does not depend on the locale.
+ * Returns the number of bytes used, or 0 if 's' does not start with a number.
+ * Thread-safe: only reads its arguments.
+ */
+extern size_t pdf_parse_number(const char *s, size_t len, double *val);
+
+
 /* Seek iterator to the next or previous instance of 'search' */
 extern void seek_next(iter_t *itr, char search);
 extern void seek_prev(iter_t *itr, char search);
@@ -224,4 +827,10 @@ extern void seek_next_line(iter_t *itr);
 extern _Bool find_in_object(iter_t *itr, obj_t obj, const char *search);
 
 
+/* Like find_in_object, but for dictionary keys: If the key 'search' is found
+ * the iterator is set to the first character of its value.
+ */
+extern _Bool find_value_in_object(iter_t *itr, obj_t obj, const char *search);
+
+
 #endif /* __PDF_H_INCLUDE */
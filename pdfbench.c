@@ -0,0 +1,418 @@
+/******************************************************************************
+ * pdfbench.c
+ *
+ * pdfbench - Time each phase of libnachopdf and pdfsearch
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* For each pdf given, times (the best of a number of rounds):
+ *
+ *   open_ms      Opening it: Reading the xref sections and the page tree
+ *   xrefs_ms     Opening it with PDF_LAZY_PAGES, which reads the xref
+ *                sections and only the page tree's root
+ *   tree_ms      The difference: Walking the page tree
+ *   inflate_mbs  Inflating the pages' contents (compressed MB/s)
+ *   decode_mbs   Running the text operators of the pages' contents, with
+ *                nothing left to inflate (decoded MB/s)
+ *   search_pps   Pages a second that pdfsearch (the one given with -s, run
+ *                as from the shell) gets through, from start to exit
+ *   search_rss_kb  Peak RSS of that pdfsearch
+ *
+ * and, once for all of them, the peak RSS of pdfbench itself (bench_rss_kb).
+ *
+ * '-o' also writes them to a file, one "file metric value" line (tab
+ * separated) each, and '-c' compares them with such a file from an earlier
+ * run, failing if anything got worse by more than the threshold (-t).
+ */
+
+#define _DEFAULT_SOURCE /* wait4 */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "pdf.h"
+
+
+#undef TAG
+#define TAG "pdfbench"
+
+
+#define P(...) do {printf(__VA_ARGS__); putc('\n', stdout);} while(0)
+
+
+static void usage(const char *execname)
+{
+    printf("Usage: %s [-r rounds] [-s pdfsearch] [-e regexp] [-j threads] "
+           "[-o results] [-c baseline] [-t percent] <file> [file ...]\n",
+           execname);
+    exit(EXIT_SUCCESS);
+}
+
+
+/* Throw the decoded text away */
+static decode_exit_e discard_callback(decode_t *decode)
+{
+    decode->buffer_used = 0;
+    return DECODE_CONTINUE;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Seconds to decode all pages once */
+static double time_pages(const pdf_t *pdf)
+{
+    int pg;
+    double start;
+    char buf[16384];
+    decode_t decode;
+
+    pdf_decode_init(&decode, pdf);
+    decode.callback = discard_callback;
+    decode.buffer = buf;
+    decode.buffer_length = sizeof(buf);
+
+    start = now();
+    for (pg=1; pg<=pdf->n_pages; ++pg)
+    {
+        decode.pg_num = pg;
+        pdf_decode_page(&decode);
+    }
+
+    pdf_decode_release(&decode);
+    return now() - start;
+}
+
+
+/* Seconds to open 'fname' with 'flags' */
+static double time_open(const char *fname, int flags)
+{
+    double start, t;
+    pdf_t *pdf;
+
+    start = now();
+    pdf = pdf_new_flags(fname, flags);
+    t = now() - start;
+    pdf_destroy(pdf);
+    return t;
+}
+
+
+/* Run pdfsearch on 'fname', returns the seconds it took and its peak RSS */
+static double time_search(
+    const char *search,
+    const char *expr,
+    const char *threads,
+    const char *fname,
+    long       *rss_kb)
+{
+    int fd, status;
+    pid_t pid;
+    double start;
+    struct rusage ru;
+
+    start = now();
+    ERR((pid = fork()), ==-1, "Could not run %s", search);
+    if (pid == 0)
+    {
+        if ((fd = open("/dev/null", O_WRONLY)) != -1)
+          dup2(fd, STDOUT_FILENO);
+        execl(search, search, "-e", expr, "-j", threads, fname, (char *)NULL);
+        _exit(127);
+    }
+
+    ERR(wait4(pid, &status, 0, &ru), ==-1, "Could not wait for %s", search);
+    ERR(!WIFEXITED(status) || WEXITSTATUS(status), !=0, "%s failed on %s",
+        search, fname);
+    *rss_kb = ru.ru_maxrss;
+    return now() - start;
+}
+
+
+/* The results: One value for each file and metric */
+typedef struct
+{
+    char   *file;
+    char   *metric;
+    double  value;
+} result_t;
+
+typedef struct
+{
+    result_t *results;
+    int       n_results, max_results;
+} results_t;
+
+static void add_result(
+    results_t *res, const char *file, const char *metric, double value)
+{
+    result_t *r;
+
+    if (res->n_results == res->max_results)
+    {
+        res->max_results = res->max_results ? res->max_results * 2 : 64;
+        ERR((res->results = realloc(res->results,
+                                    sizeof(result_t) * res->max_results)),
+            ==NULL, "Could not allocate results");
+    }
+    r = &res->results[res->n_results++];
+    ERR((r->file = strdup(file)), ==NULL, "Could not allocate results");
+    ERR((r->metric = strdup(metric)), ==NULL, "Could not allocate results");
+    r->value = value;
+}
+
+
+static void bench(
+    results_t  *res,
+    const char *fname,
+    int         rounds,
+    const char *search,
+    const char *expr,
+    const char *threads)
+{
+    int r, j, pg;
+    pdf_t *pdf;
+    long rss, best_rss = 0;
+    size_t in_bytes = 0, out_bytes = 0, len;
+    double t, open = 1e9, lazy = 1e9, cold = 1e9, parse = 1e9, find = 1e9;
+    char *data;
+    const page_t *page;
+
+    for (r=0; r<rounds; ++r)
+    {
+        if ((t = time_open(fname, 0)) < open)
+          open = t;
+        if ((t = time_open(fname, PDF_LAZY_PAGES)) < lazy)
+          lazy = t;
+    }
+
+    /* How much there is to inflate, and what it inflates to */
+    pdf = pdf_new(fname);
+    for (pg=1; pg<=pdf->n_pages; ++pg)
+      for (j=0; (page = pdf_get_page(pdf, pg)) && j<page->n_contents; ++j)
+      {
+          if (page->contents[j].n_filters)
+            in_bytes += page->contents[j].length;
+          if ((data = pdf_decode_stream(pdf, &page->contents[j], &len)))
+            out_bytes += len;
+          free(data);
+      }
+
+    /* Inflating and all, then the same with everything coming out of the
+     * (warmed up) stream cache: The difference is the inflating
+     */
+    for (r=0; r<rounds; ++r)
+      if ((t = time_pages(pdf)) < cold)
+        cold = t;
+    pdf_set_stream_cache(pdf, (size_t)-1);
+    time_pages(pdf);
+    for (r=0; r<rounds; ++r)
+      if ((t = time_pages(pdf)) < parse)
+        parse = t;
+
+    add_result(res, fname, "pages", pdf->n_pages);
+    add_result(res, fname, "open_ms", open * 1e3);
+    add_result(res, fname, "xrefs_ms", lazy * 1e3);
+    add_result(res, fname, "tree_ms", (open > lazy) ? (open - lazy) * 1e3 : 0);
+    add_result(res, fname, "inflate_mbs", (in_bytes && cold > parse) ?
+               in_bytes / 1e6 / (cold - parse) : 0);
+    add_result(res, fname, "decode_mbs", parse > 0 ? out_bytes/1e6/parse : 0);
+
+    if (search)
+    {
+        for (r=0; r<rounds; ++r)
+        {
+            if ((t = time_search(search, expr, threads, fname, &rss)) < find)
+              find = t;
+            if (rss > best_rss)
+              best_rss = rss;
+        }
+        add_result(res, fname, "search_pps", find > 0 ? pdf->n_pages/find : 0);
+        add_result(res, fname, "search_rss_kb", best_rss);
+    }
+
+    pdf_destroy(pdf);
+}
+
+
+/* Whether a bigger value of 'metric' is better (rates) or worse (times and
+ * sizes), 0 if it is not something to compare
+ */
+static int direction(const char *metric)
+{
+    size_t len = strlen(metric);
+
+    if (len > 4 && (strcmp(metric + len - 4, "_mbs") == 0 ||
+                    strcmp(metric + len - 4, "_pps") == 0))
+      return 1;
+    if (len > 3 && (strcmp(metric + len - 3, "_ms") == 0 ||
+                    strcmp(metric + len - 3, "_kb") == 0))
+      return -1;
+    return 0;
+}
+
+
+static void read_results(results_t *res, const char *fname)
+{
+    double value;
+    char line[4096], file[2048], metric[64];
+    FILE *fp;
+
+    ERR((fp = fopen(fname, "r")), ==NULL, "Could not open %s", fname);
+    while (fgets(line, sizeof(line), fp))
+      if (line[0] != '#' &&
+          sscanf(line, "%2047[^\t]\t%63[^\t]\t%lf", file, metric, &value) == 3)
+        add_result(res, file, metric, value);
+    fclose(fp);
+}
+
+
+static void write_results(const results_t *res, const char *fname)
+{
+    int i;
+    FILE *fp;
+
+    ERR((fp = fopen(fname, "w")), ==NULL, "Could not create %s", fname);
+    fprintf(fp, "# pdfbench results: file, metric, value (tab separated)\n");
+    for (i=0; i<res->n_results; ++i)
+      fprintf(fp, "%s\t%s\t%.6g\n", res->results[i].file,
+              res->results[i].metric, res->results[i].value);
+    ERR(fclose(fp), !=0, "Could not write %s", fname);
+}
+
+
+/* Print how each result changed since the baseline, returns the number that
+ * got worse by more than 'threshold' percent
+ */
+static int compare(
+    const results_t *res, const results_t *base, double threshold)
+{
+    int i, j, dir, n_worse = 0;
+    double change;
+    const result_t *r, *b;
+
+    P("Compared with the baseline (+ is better):");
+    for (i=0; i<res->n_results; ++i)
+    {
+        r = &res->results[i];
+        if (!(dir = direction(r->metric)))
+          continue;
+        for (j=0; j<base->n_results; ++j)
+          if (strcmp(base->results[j].file, r->file) == 0 &&
+              strcmp(base->results[j].metric, r->metric) == 0)
+            break;
+        if (j == base->n_results || (b = &base->results[j])->value <= 0)
+          continue;
+
+        change = dir * (r->value - b->value) / b->value * 100.0;
+        P("  %-40s %-14s %+8.1f%%%s", r->file, r->metric, change,
+          (change < -threshold) ? "  REGRESSION" : "");
+        if (change < -threshold)
+          ++n_worse;
+    }
+
+    return n_worse;
+}
+
+
+int main(int argc, char **argv)
+{
+    int i, rounds = 5, n_files = 0;
+    double threshold = 10.0;
+    const char *search = NULL, *expr = "needle", *threads = "1";
+    const char *out = NULL, *baseline = NULL;
+    struct rusage ru;
+    results_t res, base;
+    const result_t *r;
+
+    for (i=1; i<argc; ++i)
+    {
+        if (argv[i][0] == '-' && i+1 == argc)
+          usage(argv[0]);
+        else if (strcmp(argv[i], "-r") == 0)
+          rounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0)
+          search = argv[++i];
+        else if (strcmp(argv[i], "-e") == 0)
+          expr = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0)
+          threads = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0)
+          out = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0)
+          baseline = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0)
+          threshold = atof(argv[++i]);
+        else if (argv[i][0] == '-')
+          usage(argv[0]);
+        else
+          ++n_files;
+    }
+
+    if (!n_files || rounds < 1)
+      usage(argv[0]);
+
+    memset(&res, 0, sizeof(results_t));
+    memset(&base, 0, sizeof(results_t));
+    for (i=1; i<argc; ++i)
+    {
+        if (argv[i][0] == '-')
+          ++i;
+        else
+          bench(&res, argv[i], rounds, search, expr, threads);
+    }
+
+    /* This process did all the decoding above, so its peak is the library's
+     * (plus the harness)
+     */
+    getrusage(RUSAGE_SELF, &ru);
+    add_result(&res, "all", "bench_rss_kb", ru.ru_maxrss);
+
+    for (i=0; i<res.n_results; ++i)
+    {
+        r = &res.results[i];
+        if (i == 0 || strcmp(r->file, res.results[i-1].file) != 0)
+          P("%s:", r->file);
+        P("  %-14s %12.2f", r->metric, r->value);
+    }
+
+    if (out)
+      write_results(&res, out);
+    if (baseline)
+    {
+        read_results(&base, baseline);
+        if (compare(&res, &base, threshold))
+        {
+            P("Worse than %s by more than %.1f%%", baseline, threshold);
+            return 2;
+        }
+    }
+
+    return 0;
+}
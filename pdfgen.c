@@ -0,0 +1,434 @@
+/******************************************************************************
+ * pdfgen.c
+ *
+ * pdfgen - Generate synthetic pdfs for benchmarking libnachopdf
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Writes a pdf of made up text, the same one every time for the same options
+ * (there is no randomness other than the seed).  What can be varied is what
+ * costs libnachopdf time: The number of pages, how deep the page tree is, how
+ * many xref sections (chained through /Prev, as incremental updates leave
+ * them) the objects are spread over, how big each page's content stream is
+ * and how much of it is numbers (positioning operators) rather than text.
+ *
+ * About one page in a hundred has the word "needle" on it, for searching.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <zlib.h>
+
+
+#define TAG "pdfgen"
+
+
+#define ERR(_expr, _fail, ...) \
+    if ((_expr) _fail) {                    \
+        fprintf(stderr, "["TAG"] Error: " __VA_ARGS__);\
+        fputc('\n', stderr); \
+        exit(EXIT_FAILURE);\
+    }
+
+
+static void usage(const char *execname)
+{
+    printf("Usage: %s [-p pages] [-d depth] [-x sections] [-s stream_bytes] "
+           "[-n numbers%%] [-r seed] [-u] <out.pdf>\n"
+           "  -p  Number of pages (default 100)\n"
+           "  -d  Levels of /Pages nodes above the pages (default 1)\n"
+           "  -x  Number of xref sections, chained through /Prev (default 1)\n"
+           "  -s  Bytes of (decoded) content per page (default 4096)\n"
+           "  -n  Percent of operators that are numbers (default 20)\n"
+           "  -r  Seed (default 1)\n"
+           "  -u  Leave the content streams uncompressed\n",
+           execname);
+    exit(EXIT_SUCCESS);
+}
+
+
+/* xorshift64*: The same numbers on every machine */
+static unsigned long long rng_state;
+
+static void rng_seed(unsigned long long seed)
+{
+    /* splitmix64, so that no seed leaves the state all zeros */
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    rng_state = (seed ^ (seed >> 31)) | 1;
+}
+
+static unsigned rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+
+static const char *words[] =
+{
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was",
+    "with", "be", "by", "on", "not", "he", "this", "are", "or", "his", "from",
+    "at", "which", "but", "have", "an", "had", "they", "you", "were", "their",
+    "one", "all", "we", "can", "her", "has", "there", "been", "if", "more",
+    "when", "will", "would", "who", "so", "no", "invoice", "account", "total",
+    "payment", "report", "section", "table", "figure", "result", "method",
+    "system", "value", "number", "order", "page", "document", "foo", "bar",
+};
+#define N_WORDS ((int)(sizeof(words) / sizeof(words[0])))
+
+
+/* A growable buffer */
+typedef struct
+{
+    char   *data;
+    size_t  len, max;
+} buf_t;
+
+static void buf_printf(buf_t *b, const char *fmt, ...)
+{
+    int n;
+    va_list va;
+
+    for ( ;; )
+    {
+        va_start(va, fmt);
+        n = vsnprintf(b->data + b->len, b->max - b->len, fmt, va);
+        va_end(va);
+        ERR(n, <0, "Could not format content");
+        if (b->len + n < b->max)
+          break;
+        b->max = b->max ? b->max * 2 : 4096;
+        while (b->len + n >= b->max)
+          b->max *= 2;
+        ERR((b->data = realloc(b->data, b->max)), ==NULL,
+            "Could not allocate content");
+    }
+    b->len += n;
+}
+
+
+/* Content stream of a page: Lines of text, with 'numbers' percent of the
+ * operators being ones that only move the text around
+ */
+static void page_content(buf_t *b, size_t size, int numbers, _Bool needle)
+{
+    int i, n;
+    unsigned r[4];
+
+    b->len = 0;
+    buf_printf(b, "BT\n/F1 10 Tf\n12 TL\n72 720 Td\n");
+    while (b->len < size)
+    {
+        if ((int)(rng() % 100) < numbers)
+        {
+            /* Drawn first: The order arguments are worked out in varies */
+            for (i=0; i<4; ++i)
+              r[i] = rng();
+            switch (rng() % 4)
+            {
+            case 0:
+                buf_printf(b, "%u -%u Td\n", r[0] % 5, r[1] % 3);
+                break;
+            case 1:
+                buf_printf(b, "1 0 0 1 %u.%02u %u.%02u Tm\n", 72 + r[0] % 40,
+                           r[1] % 100, 100 + r[2] % 620, r[3] % 100);
+                break;
+            case 2:
+                buf_printf(b, "%u.%u Tc %u Tz\n", r[0] % 2, r[1] % 10,
+                           90 + r[2] % 20);
+                break;
+            default:
+                buf_printf(b, "[(%s) -%u (%s) -%u] TJ\n",
+                           words[r[0] % N_WORDS], r[1] % 300,
+                           words[r[2] % N_WORDS], r[3] % 300);
+                break;
+            }
+            continue;
+        }
+
+        /* A line of text */
+        buf_printf(b, "(");
+        for (i=0, n=4+rng()%8; i<n; ++i)
+          buf_printf(b, "%s%s", i ? " " : "", words[rng() % N_WORDS]);
+        if (needle)
+        {
+            buf_printf(b, " needle");
+            needle = 0;
+        }
+        buf_printf(b, ") Tj T*\n");
+    }
+    buf_printf(b, "ET\n");
+}
+
+
+/* Where each object was written, and the xref sections */
+typedef struct
+{
+    FILE *fp;
+    long *offsets;
+    int   n_objs;
+} out_t;
+
+static void begin_obj(out_t *out, int id)
+{
+    out->offsets[id] = ftell(out->fp);
+    fprintf(out->fp, "%d 0 obj\n", id);
+}
+
+
+/* The page tree: Nodes are numbered from 2 (the root) in the order they are
+ * made, and each has either nodes or pages (when 'leaf') as kids
+ */
+typedef struct
+{
+    int  parent;
+    int  first, count; /* The pages under it */
+    int  n_kids;
+    int  kids;         /* First kid: Node number, or page index if 'leaf' */
+    _Bool leaf;
+} node_t;
+
+static node_t *nodes;
+static int n_nodes, max_nodes;
+
+static int new_node(int parent, int first, int count)
+{
+    if (n_nodes == max_nodes)
+    {
+        max_nodes = max_nodes ? max_nodes * 2 : 64;
+        ERR((nodes = realloc(nodes, sizeof(node_t) * max_nodes)), ==NULL,
+            "Could not allocate page tree");
+    }
+    memset(&nodes[n_nodes], 0, sizeof(node_t));
+    nodes[n_nodes].parent = parent;
+    nodes[n_nodes].first = first;
+    nodes[n_nodes].count = count;
+    return n_nodes++;
+}
+
+
+/* Split the pages of node 'nd' between 'fanout' kids, 'depth' more levels */
+static void build_tree(int nd, int depth, int fanout)
+{
+    int i, per, first, count, kid;
+
+    if (depth <= 1 || nodes[nd].count <= fanout)
+    {
+        nodes[nd].leaf = 1;
+        nodes[nd].kids = nodes[nd].first;
+        nodes[nd].n_kids = nodes[nd].count;
+        return;
+    }
+
+    per = (nodes[nd].count + fanout - 1) / fanout;
+    first = nodes[nd].first;
+    nodes[nd].kids = n_nodes;
+    for (i=0; first<nodes[nd].first+nodes[nd].count; ++i)
+    {
+        count = per;
+        if (first + count > nodes[nd].first + nodes[nd].count)
+          count = nodes[nd].first + nodes[nd].count - first;
+        new_node(nd, first, count);
+        first += count;
+    }
+    nodes[nd].n_kids = i;
+
+    /* Kids were made one after the other, so their kids come after them */
+    for (kid=nodes[nd].kids, i=0; i<nodes[nd].n_kids; ++i)
+      build_tree(kid + i, depth - 1, fanout);
+}
+
+
+/* Smallest fanout (at least 2) that 'depth' levels can hold 'n_pages' with */
+static int get_fanout(int n_pages, int depth)
+{
+    int i, f;
+    double cap;
+
+    for (f=2; ; ++f)
+    {
+        for (cap=1, i=0; i<depth; ++i)
+          cap *= f;
+        if (cap >= n_pages)
+          return f;
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    int i, j, id, pg, sec, first, last, n_pages = 100, depth = 1;
+    int n_sections = 1, size = 4096, numbers = 20, compress = 1;
+    int font_id, page_base;
+    long xref, prev = 0;
+    unsigned long seed = 1;
+    uLongf zlen;
+    Bytef *zbuf = NULL;
+    size_t zmax = 0;
+    const char *fname = NULL;
+    buf_t content;
+    out_t out;
+    node_t *n;
+
+    for (i=1; i<argc; ++i)
+    {
+        if (strcmp(argv[i], "-p") == 0 && i+1<argc)
+          n_pages = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i+1<argc)
+          depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-x") == 0 && i+1<argc)
+          n_sections = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i+1<argc)
+          size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i+1<argc)
+          numbers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i+1<argc)
+          seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-u") == 0)
+          compress = 0;
+        else if (argv[i][0] != '-' && !fname)
+          fname = argv[i];
+        else
+          usage(argv[0]);
+    }
+
+    if (!fname || n_pages < 1 || depth < 1 || n_sections < 1 || size < 1 ||
+        numbers < 0 || numbers > 99)
+      usage(argv[0]);
+
+    /* Objects: 1 is the catalog, then the page tree nodes (the root is 2),
+     * the font, and each page and its content
+     */
+    new_node(-1, 0, n_pages);
+    build_tree(0, depth, get_fanout(n_pages, depth));
+    font_id = 2 + n_nodes;
+    page_base = font_id + 1;
+    out.n_objs = page_base + 2 * n_pages;
+    ERR((out.offsets = calloc(out.n_objs, sizeof(long))), ==NULL,
+        "Could not allocate xref");
+    ERR((out.fp = fopen(fname, "wb")), ==NULL, "Could not create %s", fname);
+    memset(&content, 0, sizeof(buf_t));
+
+    fprintf(out.fp, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n");
+
+    /* Each section holds a run of object ids, and is written as if appended
+     * by an incremental update of what came before it
+     */
+    if (n_sections > out.n_objs - 1)
+      n_sections = out.n_objs - 1;
+    for (sec=0; sec<n_sections; ++sec)
+    {
+        first = 1 + (long)(out.n_objs - 1) * sec / n_sections;
+        last = 1 + (long)(out.n_objs - 1) * (sec + 1) / n_sections;
+
+        for (id=first; id<last; ++id)
+        {
+            begin_obj(&out, id);
+            if (id == 1)
+              fprintf(out.fp, "<< /Type /Catalog /Pages 2 0 R >>\n");
+            else if (id < font_id)
+            {
+                n = &nodes[id - 2];
+                fprintf(out.fp, "<< /Type /Pages /Count %d /Kids [", n->count);
+                for (j=0; j<n->n_kids; ++j)
+                  fprintf(out.fp, "%s%d 0 R", j ? " " : "", n->leaf ?
+                          page_base + 2 * (n->kids + j) : n->kids + j + 2);
+                fprintf(out.fp, "]");
+                if (n->parent >= 0)
+                  fprintf(out.fp, " /Parent %d 0 R", n->parent + 2);
+                fprintf(out.fp, " >>\n");
+            }
+            else if (id == font_id)
+              fprintf(out.fp, "<< /Type /Font /Subtype /Type1 "
+                      "/BaseFont /Helvetica >>\n");
+            else if ((id - page_base) % 2 == 0)
+            {
+                /* The leaf the page is under */
+                pg = (id - page_base) / 2;
+                for (j=0; j<n_nodes; ++j)
+                  if (nodes[j].leaf && pg >= nodes[j].first &&
+                      pg < nodes[j].first + nodes[j].count)
+                    break;
+                fprintf(out.fp, "<< /Type /Page /Parent %d 0 R "
+                        "/MediaBox [0 0 612 792] "
+                        "/Resources << /Font << /F1 %d 0 R >> >> "
+                        "/Contents %d 0 R >>\n", j + 2, font_id, id + 1);
+            }
+            else
+            {
+                /* Pages are made in order, so the text does not depend on
+                 * how the objects are split into sections
+                 */
+                rng_seed(seed ^ ((unsigned long long)(id - page_base) << 32));
+                page_content(&content, size, numbers, rng() % 100 == 0);
+                if (compress)
+                {
+                    if (compressBound(content.len) > zmax)
+                    {
+                        zmax = compressBound(content.len);
+                        ERR((zbuf = realloc(zbuf, zmax)), ==NULL,
+                            "Could not allocate stream");
+                    }
+                    zlen = zmax;
+                    ERR(compress2(zbuf, &zlen, (const Bytef *)content.data,
+                                  content.len, 6), !=Z_OK,
+                        "Could not compress stream");
+                    fprintf(out.fp, "<< /Length %lu /Filter /FlateDecode >>\n"
+                            "stream\n", (unsigned long)zlen);
+                    fwrite(zbuf, 1, zlen, out.fp);
+                }
+                else
+                {
+                    fprintf(out.fp, "<< /Length %lu >>\nstream\n",
+                            (unsigned long)content.len);
+                    fwrite(content.data, 1, content.len, out.fp);
+                }
+                fprintf(out.fp, "\nendstream\n");
+            }
+            fprintf(out.fp, "endobj\n");
+        }
+
+        /* The section's xref table (the first also has the free object 0) */
+        xref = ftell(out.fp);
+        fprintf(out.fp, "xref\n");
+        if (sec == 0)
+          fprintf(out.fp, "0 %d\n0000000000 65535 f \n", last);
+        else
+          fprintf(out.fp, "%d %d\n", first, last - first);
+        for (id=first; id<last; ++id)
+          fprintf(out.fp, "%010ld 00000 n \n", out.offsets[id]);
+        fprintf(out.fp, "trailer\n<< /Size %d /Root 1 0 R", last);
+        if (sec)
+          fprintf(out.fp, " /Prev %ld", prev);
+        fprintf(out.fp, " >>\nstartxref\n%ld\n%%%%EOF\n", xref);
+        prev = xref;
+    }
+
+    ERR(fclose(out.fp), !=0, "Could not write %s", fname);
+    free(out.offsets);
+    free(content.data);
+    free(zbuf);
+    free(nodes);
+    return 0;
+}
@@ -21,14 +21,21 @@
  *****************************************************************************/
 
 
+#define _POSIX_C_SOURCE 200809L /* opendir, lstat, strcasecmp */
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-#include <regex.h>
+#include <pthread.h>
 #include "pdf.h"
+#include "search.h"
 
 
 #undef TAG
@@ -66,61 +73,978 @@ static const char _pdfsearch_version[] = "0.1"; /* Alpha */
 
 static void usage(const char *execname)
 {
-    printf("Usage: %s <file> <-e regexp>\n", execname);
+    printf("Usage: %s <file | dir>... [-l list] <-e regexp | -f patterns> "
+           "[-j threads] [-s] [--stats] [--trace file]\n"
+           "       %s <file | dir>... [-l list] -b index [-j threads] [-s] "
+           "[--stats] [--trace file]\n"
+           "       %s -q index <-e regexp | -f patterns>\n",
+           execname, execname, execname);
     exit(EXIT_SUCCESS);
 }
 
 
-/* Gets called back from the decode routine when the buffer is full */
+/* What a decode object's user_data points to while searching a page.  In
+ * multi-pattern mode the patterns found on the page are collected in 'hits',
+ * each once: 'seen' holds the last scan (see 'scan') each was found in.  When
+ * building an index the page's text is collected instead, as it is when
+ * searching for an expression until the page has all of its literals.
+ */
+#define MAX_LITERALS 32
+typedef struct
+{
+    ere_dfa_t     *dfa;
+    _Bool          match;
+    unsigned       lits_left; /* Literals not found on the page yet (bits) */
+    size_t         looked;    /* Text they have been looked for in         */
+    const ac_t    *ac;
+    int            ac_state;
+    int            scan;     /* Pages this worker has scanned */
+    int           *seen;
+    int           *hits;
+    int            n_hits;
+    char          *text;
+    size_t         text_len, text_max;
+} search_t;
+
+
+/* Add the text to what is kept of the page */
+static void keep_text(search_t *search, const char *text, size_t len)
+{
+    if (len == 0)
+      return;
+    while (search->text_len + len > search->text_max)
+    {
+        search->text_max = search->text_max ? search->text_max * 2 : 65536;
+        ERR((search->text = realloc(search->text, search->text_max)), ==NULL,
+            "Could not allocate page text");
+    }
+    memcpy(search->text + search->text_len, text, len);
+    search->text_len += len;
+}
+
+
+/* Look for the literals not found yet in the text kept since the last look
+ * (and enough before it to find one that straddles the two).  Returns true
+ * once all of them have been found.
+ */
+static _Bool find_literals(search_t *search)
+{
+    int i;
+    size_t len, start;
+    const ere_t *re = search->dfa->re;
+
+    for (i=0; i<re->n_literals && i<MAX_LITERALS; ++i)
+    {
+        if (!(search->lits_left & (1U << i)))
+          continue;
+        len = strlen(re->literals[i]);
+        start = (search->looked >= len) ? search->looked - len + 1 : 0;
+        if (pdf_memmem(search->text + start, search->text_len - start,
+                       re->literals[i], len))
+          search->lits_left &= ~(1U << i);
+    }
+    search->looked = search->text_len;
+    return search->lits_left == 0;
+}
+
+
+/* Gets called back from the decode routine when the buffer is full: The
+ * matcher carries on from where the last buffer left it, so the buffer can be
+ * handed back empty.  A page without all of the expression's literals cannot
+ * match, so its text is held back from the matcher (and only looked through
+ * for the literals) until they have all turned up, which on most pages they
+ * never do.
+ */
 static decode_exit_e regexp_callback(decode_t *decode)
 {
-    char *en, incomplete[2048] = {0};
-    int match;
+    search_t *search = (search_t *)decode->user_data;
+    const char *text = decode->buffer;
+    size_t len = decode->buffer_used;
 
-    /* Save last line */
-    if (strrchr(decode->buffer, '\n'))
+    if (search->lits_left)
     {
-        en = strrchr(decode->buffer, '\n') + 1;
-        *(en-1) = '\0';
-        strncpy(incomplete, en, strlen(en));
+        keep_text(search, decode->buffer, decode->buffer_used);
+        decode->buffer_used = 0;
+        if (!find_literals(search))
+          return DECODE_CONTINUE;
+        text = search->text;
+        len = search->text_len;
     }
 
-    /* Check all data upto the line that was incomplete */
-    match = regexec(
-        (regex_t*)decode->user_data, decode->buffer, 0, NULL, 0);
-    if (match == 0)
+    if (ere_dfa_scan(search->dfa, text, len))
     {
-        P("%s: Found match on page %d", decode->pdf->fname, decode->pg_num);
+        search->match = true;
         return DECODE_DONE;
     }
-    
-    /* Continue adding character to the end of the incomplete line */
-    memset(decode->buffer, 0, decode->buffer_length);
-    strncpy(decode->buffer, incomplete, strlen(incomplete));
-    decode->buffer_used = strlen(decode->buffer);
 
+    decode->buffer_used = 0;
     return DECODE_CONTINUE;
 }
 
 
-static void run_regex(const pdf_t *pdf, const regex_t *re)
+/* Multi-pattern mode: Note each pattern found on the page the first time */
+static void pattern_hit(void *arg, int pattern)
 {
-    const kid_t *kid;
-    char buf[2048] = {0};
+    search_t *search = (search_t *)arg;
+
+    if (search->seen[pattern] == search->scan)
+      return;
+    search->seen[pattern] = search->scan;
+    search->hits[search->n_hits++] = pattern;
+}
+
+
+/* Multi-pattern mode: Gets called back from the decode routine when the buffer
+ * is full.  The automaton's state carries over from one buffer to the next, so
+ * no text needs to be held back.
+ */
+static decode_exit_e patterns_callback(decode_t *decode)
+{
+    search_t *search = (search_t *)decode->user_data;
+
+    search->ac_state = ac_scan(search->ac, search->ac_state, decode->buffer,
+                               decode->buffer_used, pattern_hit, search);
+    decode->buffer_used = 0;
+
+    /* Everything found already: No need to read the rest of the page */
+    return (search->n_hits == search->ac->n_patterns) ? DECODE_DONE
+                                                      : DECODE_CONTINUE;
+}
+
+
+/* Index mode: Gets called back from the decode routine when the buffer is
+ * full, to keep all of the page's text
+ */
+static decode_exit_e text_callback(decode_t *decode)
+{
+    search_t *search = (search_t *)decode->user_data;
+
+    keep_text(search, decode->buffer, decode->buffer_used);
+    decode->buffer_used = 0;
+    return DECODE_CONTINUE;
+}
+
+
+/* Result for a page: Workers fill these in and whoever completes the page that
+ * is next in line reports it (and any finished pages following it).  This keeps
+ * the output in page order no matter what order the pages are decoded in.
+ */
+typedef struct
+{
+    _Bool     done;
+    _Bool     match;
+    int       n_hits;  /* Multi-pattern mode: The patterns found, in order */
+    int      *hits;
+    char     *text;    /* Index mode: The page's text and its trigrams     */
+    size_t    text_len;
+    uint32_t *tris;
+    int       n_tris;
+} result_t;
+
+
+/* A document to search.  The first worker to get to it opens it (its sidecar
+ * if it has an up to date one, else the pdf), the last one to finish a page of
+ * it closes it.  Its results are kept until printed, as documents are reported
+ * in the order they were given.
+ */
+typedef struct
+{
+    char          *fname;
+    pdf_t         *pdf;
+    pdf_sidecar_t *sidecar;
+    _Bool     opened;
+    _Bool     indexed;    /* Added to the index yet          */
+    int       n_pages;
+    int       pages_left; /* Pages not scanned yet           */
+    int       next_print; /* Index of the next page to print */
+    result_t *results;    /* Reorder buffer (one per page)   */
+} doc_t;
+
+
+/* A unit of work: Pages [first, last) of a document, or opening it if 'last'
+ * is -1 (which turns into all of its pages).  Ranges are split in half until
+ * they are at most MAX_RANGE pages, the halves going to the task queue, so
+ * that other workers can take on parts of a big document.
+ */
+#define MAX_RANGE 4
+typedef struct
+{
+    int doc;
+    int first, last;
+} task_t;
+
+
+/* Each worker's tasks.  The worker pushes and pops at the bottom, workers with
+ * nothing to do steal from the top: The oldest and so biggest ranges.
+ */
+typedef struct
+{
+    task_t          *tasks;
+    int              top, bottom, max;
+    pthread_mutex_t  lock;
+} deque_t;
+
+
+/* State shared between all workers */
+typedef struct
+{
+    doc_t           *docs;
+    int              n_docs;
+    int              next_print; /* Index of the next document to print */
+    const ere_t     *re;
+    const ac_t      *ac;         /* Multi-pattern mode if set           */
+    char           **patterns;
+    index_writer_t  *index;      /* Index mode if set                   */
+    _Bool            sidecars;   /* Write sidecars that are missing     */
+    pdf_stats_t     *stats;      /* Totals of the pdfs' stats, if set   */
+    int              n_failed;   /* Documents that could not be opened  */
+    int              n_workers;
+    deque_t         *deques;     /* One per worker                      */
+    int              pending;    /* Tasks queued or being worked on     */
+    unsigned         pushes;     /* Tasks queued so far (see next_task) */
+    pthread_cond_t   work;       /* A task was queued, or none are left */
+    pthread_mutex_t  lock;
+} pool_t;
+
+
+/* Report all pages, in order, whose predecessors have all been scanned.
+ * Caller must hold the pool lock.
+ */
+static void flush_results(pool_t *pool)
+{
+    int i, pg;
+    doc_t *doc;
+    result_t *res;
+
+    while (pool->next_print < pool->n_docs)
+    {
+        doc = &pool->docs[pool->next_print];
+        if (!doc->opened)
+          break;
+        if (pool->index && !doc->indexed)
+        {
+            ERR(index_add_doc(pool->index, doc->fname), ==false,
+                "Could not write the index");
+            doc->indexed = true;
+        }
+
+        while (doc->next_print < doc->n_pages &&
+               doc->results[doc->next_print].done)
+        {
+            pg = doc->next_print++;
+            res = &doc->results[pg];
+            if (pool->index)
+            {
+                ERR(index_add_page(pool->index, res->text, res->text_len,
+                                   res->tris, res->n_tris), ==false,
+                    "Could not write the index");
+                free(res->text);
+                free(res->tris);
+                res->text = NULL;
+                res->tris = NULL;
+            }
+            if (res->match && !pool->ac)
+              P("%s: Found match on page %d", doc->fname, pg+1);
+            for (i=0; i<res->n_hits; ++i)
+              P("%s: Found match on page %d: %s", doc->fname, pg+1,
+                pool->patterns[res->hits[i]]);
+            if (res->match)
+              fflush(stdout);
+            free(res->hits);
+            res->hits = NULL;
+        }
+
+        /* On to the next document once all of this one is out */
+        if (doc->next_print < doc->n_pages)
+          break;
+        free(doc->results);
+        doc->results = NULL;
+        ++pool->next_print;
+    }
+}
+
+
+static int cmp_ints(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+
+/* Queue 'task' on worker 'self's deque */
+static void push_task(pool_t *pool, int self, int doc, int first, int last)
+{
+    deque_t *dq = &pool->deques[self];
+
+    /* Counted before it can be taken, so the count never drops to 0 early */
+    pthread_mutex_lock(&pool->lock);
+    ++pool->pending;
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top == dq->bottom)
+      dq->top = dq->bottom = 0;
+    if (dq->bottom == dq->max)
+    {
+        dq->max = dq->max ? dq->max * 2 : 64;
+        ERR((dq->tasks = realloc(dq->tasks, sizeof(task_t) * dq->max)), ==NULL,
+            "Could not allocate tasks");
+    }
+    dq->tasks[dq->bottom].doc = doc;
+    dq->tasks[dq->bottom].first = first;
+    dq->tasks[dq->bottom].last = last;
+    ++dq->bottom;
+    pthread_mutex_unlock(&dq->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    ++pool->pushes;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* Take a task from the bottom of 'dq' (its worker) or the top (a thief) */
+static _Bool take_task(deque_t *dq, _Bool steal, task_t *task)
+{
+    _Bool found = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top < dq->bottom)
+    {
+        *task = steal ? dq->tasks[dq->top++] : dq->tasks[--dq->bottom];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+
+/* Get worker 'self' its next task: Its own newest, or else the oldest of
+ * another worker's.  Returns 'false' once there is no work left at all.
+ */
+static _Bool next_task(pool_t *pool, int self, task_t *task)
+{
+    int i;
+    unsigned pushes;
+
+    for ( ;; )
+    {
+        pthread_mutex_lock(&pool->lock);
+        pushes = pool->pushes;
+        i = pool->pending;
+        pthread_mutex_unlock(&pool->lock);
+        if (i == 0)
+          return false;
+
+        if (take_task(&pool->deques[self], false, task))
+          return true;
+        for (i=1; i<pool->n_workers; ++i)
+          if (take_task(&pool->deques[(self + i) % pool->n_workers], true,
+                        task))
+            return true;
+
+        /* Everything queued is being worked on: Wait for more (unless some
+         * was queued since looking)
+         */
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending && pool->pushes == pushes)
+          pthread_cond_wait(&pool->work, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+
+/* A task is done */
+static void finish_task(pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* Done with a pdf: Add its stats to the totals first, if they are kept */
+static void close_pdf(pool_t *pool, pdf_t *pdf)
+{
+    pdf_stats_t stats;
+
+    if (!pdf)
+      return;
+    if (pool->stats && pdf_get_stats(pdf, &stats) == PDF_OK)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pdf_add_stats(pool->stats, &stats);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pdf_destroy(pdf);
+}
+
+
+/* Open pdf 'fname'.  If it cannot be opened, say so and return NULL: The
+ * other documents are still searched.
+ */
+static pdf_t *open_pdf(pool_t *pool, const char *fname)
+{
+    int fd, error = PDF_ERR_IO;
+    pdf_t *pdf = NULL;
+
+    if ((fd = open(fname, O_RDONLY)) != -1)
+    {
+        pdf = pdf_new_from_fd(fd, pool->stats ? PDF_STATS : 0, &error);
+        close(fd); /* The mapping stays */
+    }
+
+    if (!pdf)
+    {
+        fprintf(stderr, "["TAG"] Error: Could not open %s: %s\n", fname,
+                (error == PDF_ERR_IO)     ? strerror(errno) :
+                (error == PDF_ERR_FORMAT) ? "Not a pdf that can be read" :
+                                            "Out of memory");
+        return NULL;
+    }
+
+    pdf->fname = fname; /* For its sidecar */
+    return pdf;
+}
+
+
+/* Open document 'd', returns its number of pages (0 if it cannot be opened) */
+static int open_doc(pool_t *pool, int d)
+{
+    int n_pages;
+    doc_t *doc = &pool->docs[d];
+    pdf_t *pdf = NULL;
+    pdf_sidecar_t *sc;
+
+    /* The sidecar if it is up to date, then there is no pdf to parse.  Else
+     * write it now if asked to, which decodes every page here and now.
+     */
+    if (!(sc = pdf_sidecar_open(doc->fname)) &&
+        (pdf = open_pdf(pool, doc->fname)) &&
+        pool->sidecars && pdf_sidecar_write(pdf) == PDF_OK &&
+        (sc = pdf_sidecar_open(doc->fname)))
+    {
+        close_pdf(pool, pdf);
+        pdf = NULL;
+    }
+    n_pages = sc ? sc->n_pages : pdf ? pdf->n_pages : 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!sc && !pdf)
+      ++pool->n_failed;
+    doc->pdf = pdf;
+    doc->sidecar = sc;
+    doc->n_pages = doc->pages_left = n_pages;
+    ERR((doc->results = calloc(doc->n_pages + 1, sizeof(result_t))), ==NULL,
+        "Could not allocate results");
+    doc->opened = true;
+    flush_results(pool);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (doc->n_pages == 0)
+    {
+        close_pdf(pool, pdf);
+        pdf_sidecar_close(sc);
+        doc->pdf = NULL;
+        doc->sidecar = NULL;
+    }
+    return n_pages;
+}
+
+
+/* Scan pages [first, last) of document 'd' */
+static void scan_pages(
+    pool_t   *pool,
+    int       d,
+    int       first,
+    int       last,
+    decode_t *decode,
+    search_t *search)
+{
+    int pg, max_tris = 0;
+    unsigned lits = 0;
+    _Bool done;
+    doc_t *doc = &pool->docs[d];
+    result_t *res;
+
+    /* One bit per literal of the expression to look for on each page */
+    if (search->dfa)
+      lits = (pool->re->n_literals >= MAX_LITERALS) ? ~0U :
+             (1U << pool->re->n_literals) - 1;
+
+    decode->pdf = doc->pdf;
+    decode->sidecar = doc->sidecar;
+    for (pg=first; pg<last; ++pg)
+    {
+        search->match = false;
+        search->ac_state = 0;
+        ++search->scan;
+        search->n_hits = 0;
+        search->text_len = 0;
+        decode->pg_num = pg + 1;
+        decode->buffer_used = 0;
+        search->looked = 0;
+        if (search->dfa)
+        {
+            ere_dfa_reset(search->dfa);
+            search->lits_left = lits;
+        }
+        pdf_decode_page(decode);
+
+        /* The last line of the page ends with the page ('$'), if the page
+         * got as far as the matcher
+         */
+        if (search->dfa && !search->match && !search->lits_left)
+          search->match = ere_dfa_end(search->dfa);
+
+        /* Index mode: Hand the text over with its trigrams */
+        if (pool->index)
+        {
+            res = &doc->results[pg];
+            res->n_tris = index_trigrams(search->text, search->text_len,
+                                         &res->tris, &max_tris);
+            ERR(res->n_tris, <0, "Could not allocate trigrams");
+            max_tris = 0;
+            ERR((res->text = malloc(search->text_len + 1)), ==NULL,
+                "Could not allocate page text");
+            if (search->text_len)
+              memcpy(res->text, search->text, search->text_len);
+            res->text_len = search->text_len;
+        }
+
+        /* Report the patterns in the order they were given */
+        if (search->n_hits)
+        {
+            qsort(search->hits, search->n_hits, sizeof(int), cmp_ints);
+            ERR((doc->results[pg].hits = malloc(sizeof(int)*search->n_hits)),
+                ==NULL, "Could not allocate results");
+            memcpy(doc->results[pg].hits, search->hits,
+                   sizeof(int) * search->n_hits);
+            doc->results[pg].n_hits = search->n_hits;
+            search->match = true;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        doc->results[pg].match = search->match;
+        doc->results[pg].done = true;
+        done = (--doc->pages_left == 0);
+        flush_results(pool);
+        pthread_mutex_unlock(&pool->lock);
+
+        /* Last page of the document: Nobody else is using it */
+        if (done)
+        {
+            close_pdf(pool, doc->pdf);
+            pdf_sidecar_close(doc->sidecar);
+            doc->pdf = NULL;
+            doc->sidecar = NULL;
+        }
+    }
+}
+
+
+/* Work on tasks until there are none left */
+static void regex_worker(pool_t *pool, int self)
+{
+    int mid;
+    char buf[16384];
+    task_t task;
+    search_t search;
     decode_t decode;
 
-    decode.pdf = pdf;
+    pdf_decode_init(&decode, NULL);
+    memset(&search, 0, sizeof(search_t));
     decode.callback = regexp_callback;
     decode.buffer = buf;
-    decode.buffer_length = sizeof(buf) - 1;
-    decode.user_data = (void *)re;
+    decode.buffer_length = sizeof(buf);
+    decode.user_data = &search;
+
+    if ((search.ac = pool->ac))
+    {
+        decode.callback = patterns_callback;
+        ERR((search.seen = calloc(search.ac->n_patterns, sizeof(int))), ==NULL,
+            "Could not allocate pattern state");
+        ERR((search.hits = malloc(sizeof(int) * search.ac->n_patterns)), ==NULL,
+            "Could not allocate pattern state");
+    }
+    else if (pool->index)
+      decode.callback = text_callback;
+    else
+      ERR((search.dfa = ere_dfa_new(pool->re)), ==NULL,
+          "Could not allocate regex state");
+
+    while (next_task(pool, self, &task))
+    {
+        if (task.last < 0)
+        {
+            task.first = 0;
+            task.last = open_doc(pool, task.doc);
+        }
+
+        /* Leave the upper halves for later, or for someone else */
+        while (task.last - task.first > MAX_RANGE)
+        {
+            mid = task.first + (task.last - task.first) / 2;
+            push_task(pool, self, task.doc, mid, task.last);
+            task.last = mid;
+        }
+
+        scan_pages(pool, task.doc, task.first, task.last, &decode, &search);
+        finish_task(pool);
+    }
+
+    pdf_decode_release(&decode);
+    ere_dfa_free(search.dfa);
+    free(search.seen);
+    free(search.hits);
+    free(search.text);
+}
+
+
+/* Thread entry point: 'arg' is the pool, and the worker number */
+typedef struct
+{
+    pool_t *pool;
+    int     self;
+} worker_arg_t;
+
+static void *regex_thread(void *arg)
+{
+    worker_arg_t *wa = (worker_arg_t *)arg;
+
+    regex_worker(wa->pool, wa->self);
+    return NULL;
+}
+
+
+/* Search the documents using 'n_threads' workers, for 're' or (if it is set)
+ * the patterns of 'ac', or (if 'index' is set) index them.  Documents without
+ * an up to date sidecar get one if 'sidecars' is set, and if 'stats' is set
+ * the pdfs' stats are added up into it.  Returns the number of documents that
+ * could not be opened (they are searched as if they had no pages).
+ */
+static int run_regex(
+    doc_t          *docs,
+    int             n_docs,
+    const ere_t    *re,
+    const ac_t     *ac,
+    char          **patterns,
+    index_writer_t *index,
+    _Bool           sidecars,
+    pdf_stats_t    *stats,
+    int             n_threads)
+{
+    int i;
+    pool_t pool;
+    pthread_t *threads;
+    worker_arg_t *args;
+
+    memset(&pool, 0, sizeof(pool_t));
+    pool.docs = docs;
+    pool.n_docs = n_docs;
+    pool.re = re;
+    pool.ac = ac;
+    pool.patterns = patterns;
+    pool.index = index;
+    pool.sidecars = sidecars;
+    pool.stats = stats;
+    pool.n_workers = n_threads;
+    ERR((pool.deques = calloc(n_threads, sizeof(deque_t))), ==NULL,
+        "Could not allocate workers");
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    for (i=0; i<n_threads; ++i)
+      pthread_mutex_init(&pool.deques[i].lock, NULL);
+
+    /* Deal the documents out (last first, so each worker pops its first
+     * document first)
+     */
+    for (i=n_docs-1; i>=0; --i)
+      push_task(&pool, i % n_threads, i, 0, -1);
 
-    for (kid=pdf->kids; kid; kid=kid->next)
+    /* No need for threads if there is only one worker */
+    if (n_threads <= 1)
+      regex_worker(&pool, 0);
+    else
     {
-        decode.pg_num = kid->pg_num;
-        decode.buffer_used = 0;
-        pdf_decode_page(&decode);
+        ERR((threads = malloc(sizeof(pthread_t) * n_threads)), ==NULL,
+            "Could not allocate workers");
+        ERR((args = malloc(sizeof(worker_arg_t) * n_threads)), ==NULL,
+            "Could not allocate workers");
+        for (i=0; i<n_threads; ++i)
+        {
+            args[i].pool = &pool;
+            args[i].self = i;
+            ERR(pthread_create(&threads[i], NULL, regex_thread, &args[i]), !=0,
+                "Could not create worker thread");
+        }
+        for (i=0; i<n_threads; ++i)
+          pthread_join(threads[i], NULL);
+        free(threads);
+        free(args);
     }
+
+    for (i=0; i<n_threads; ++i)
+    {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    free(pool.deques);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.lock);
+    return pool.n_failed;
+}
+
+
+/* Answer the search from index 'idx' instead of the PDFs: Only the pages with
+ * the trigrams of what a match needs (a literal the expression always matches,
+ * or any one of the patterns) have their text checked.
+ */
+static void run_query(
+    const index_t *idx,
+    const ere_t   *re,
+    const ac_t    *ac,
+    char         **patterns,
+    int            n_patterns)
+{
+    int i;
+    int64_t n, k;
+    uint32_t pg, doc, n_pages = idx->hdr->n_pages, *pages = NULL;
+    size_t len;
+    const char *text;
+    unsigned char *cand;
+    search_t search;
+
+    memset(&search, 0, sizeof(search_t));
+    ERR((cand = calloc(n_pages + 1, 1)), ==NULL, "Could not allocate pages");
+
+    if ((search.ac = ac))
+    {
+        /* Pages that could have any of the patterns */
+        for (i=0; i<n_patterns; ++i)
+        {
+            n = index_filter(idx, patterns[i], strlen(patterns[i]), &pages,-1);
+            ERR(n, ==-2, "Could not allocate pages");
+            if (n == -1)
+            {
+                memset(cand, 1, n_pages);
+                break;
+            }
+            for (k=0; k<n; ++k)
+              cand[pages[k]] = 1;
+            free(pages);
+            pages = NULL;
+        }
+
+        ERR((search.seen = calloc(ac->n_patterns, sizeof(int))), ==NULL,
+            "Could not allocate pattern state");
+        ERR((search.hits = malloc(sizeof(int) * ac->n_patterns)), ==NULL,
+            "Could not allocate pattern state");
+    }
+    else
+    {
+        /* Pages with all of the literals */
+        for (n=-1, i=0; i<re->n_literals && n; ++i)
+        {
+            n = index_filter(idx, re->literals[i], strlen(re->literals[i]),
+                             &pages, n);
+            ERR(n, ==-2, "Could not allocate pages");
+        }
+        if (n == -1)
+          memset(cand, 1, n_pages);
+        for (k=0; k<n; ++k)
+          cand[pages[k]] = 1;
+        free(pages);
+
+        ERR((search.dfa = ere_dfa_new(re)), ==NULL,
+            "Could not allocate regex state");
+    }
+
+    for (pg=0; pg<n_pages; ++pg)
+    {
+        if (!cand[pg])
+          continue;
+        text = index_page_text(idx, pg, &len);
+        doc = index_doc_of(idx, pg);
+
+        if (search.ac)
+        {
+            ++search.scan;
+            search.n_hits = 0;
+            ac_scan(ac, 0, text, len, pattern_hit, &search);
+            qsort(search.hits, search.n_hits, sizeof(int), cmp_ints);
+            for (i=0; i<search.n_hits; ++i)
+              P("%s: Found match on page %u: %s", index_doc_name(idx, doc),
+                pg - idx->docs[doc].first_page + 1, patterns[search.hits[i]]);
+        }
+        else
+        {
+            ere_dfa_reset(search.dfa);
+            if (ere_dfa_scan(search.dfa, text, len) || ere_dfa_end(search.dfa))
+              P("%s: Found match on page %u", index_doc_name(idx, doc),
+                pg - idx->docs[doc].first_page + 1);
+        }
+    }
+
+    ere_dfa_free(search.dfa);
+    free(search.seen);
+    free(search.hits);
+    free(cand);
+}
+
+
+/* Read the patterns (one per line) of file 'fname' */
+static char **read_patterns(const char *fname, int *n_patterns)
+{
+    FILE *fp;
+    size_t len;
+    int max = 0;
+    char line[1024], **patterns = NULL;
+
+    ERR((fp = fopen(fname, "r")), ==NULL,
+        "Could not open pattern file %s: %s", fname, strerror(errno));
+
+    *n_patterns = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        len = strlen(line);
+        ERR(len, == sizeof(line) - 1 && line[len-1] != '\n',
+            "Pattern is too long... sorry");
+        while (len && (line[len-1] == '\n' || line[len-1] == '\r'))
+          line[--len] = '\0';
+        if (len == 0)
+          continue;
+
+        if (*n_patterns == max)
+        {
+            max = max ? max * 2 : 64;
+            ERR((patterns = realloc(patterns, sizeof(char *) * max)), ==NULL,
+                "Could not allocate patterns");
+        }
+        ERR((patterns[*n_patterns] = malloc(len + 1)), ==NULL,
+            "Could not allocate patterns");
+        memcpy(patterns[*n_patterns], line, len + 1);
+        ++*n_patterns;
+    }
+
+    fclose(fp);
+    return patterns;
+}
+
+
+/* The documents to search, in the order given */
+typedef struct
+{
+    doc_t *docs;
+    int    n_docs, max_docs;
+} inputs_t;
+
+
+static void add_doc(inputs_t *in, const char *fname)
+{
+    size_t len = strlen(fname);
+    doc_t *doc;
+
+    if (in->n_docs == in->max_docs)
+    {
+        in->max_docs = in->max_docs ? in->max_docs * 2 : 64;
+        ERR((in->docs = realloc(in->docs, sizeof(doc_t) * in->max_docs)),
+            ==NULL, "Could not allocate documents");
+    }
+
+    doc = &in->docs[in->n_docs++];
+    memset(doc, 0, sizeof(doc_t));
+    ERR((doc->fname = malloc(len + 1)), ==NULL, "Could not allocate documents");
+    memcpy(doc->fname, fname, len + 1);
+}
+
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+/* Add 'path': Directories are searched recursively (in name order) for files
+ * named *.pdf, anything else is taken to be a PDF.  Symbolic links to
+ * directories are not followed.
+ */
+static void add_path(inputs_t *in, const char *path)
+{
+    int i, n = 0, max = 0;
+    size_t len;
+    char **names = NULL;
+    DIR *dir;
+    struct dirent *ent;
+    struct stat st;
+
+    ERR(stat(path, &st), ==-1, "Could not open %s: %s", path, strerror(errno));
+    if (!S_ISDIR(st.st_mode))
+    {
+        add_doc(in, path);
+        return;
+    }
+
+    ERR((dir = opendir(path)), ==NULL,
+        "Could not open directory %s: %s", path, strerror(errno));
+    while ((ent = readdir(dir)))
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+          continue;
+        if (n == max)
+        {
+            max = max ? max * 2 : 64;
+            ERR((names = realloc(names, sizeof(char *) * max)), ==NULL,
+                "Could not allocate documents");
+        }
+        len = strlen(path) + strlen(ent->d_name) + 2;
+        ERR((names[n] = malloc(len)), ==NULL, "Could not allocate documents");
+        snprintf(names[n++], len, "%s/%s", path, ent->d_name);
+    }
+    closedir(dir);
+
+    if (n > 1)
+      qsort(names, n, sizeof(char *), cmp_names);
+    for (i=0; i<n; ++i)
+    {
+        if (lstat(names[i], &st) == 0 && S_ISDIR(st.st_mode))
+          add_path(in, names[i]);
+        else if (stat(names[i], &st) == 0 && S_ISREG(st.st_mode) &&
+                 (len = strlen(names[i])) > 4 &&
+                 strcasecmp(names[i] + len - 4, ".pdf") == 0)
+          add_doc(in, names[i]);
+        free(names[i]);
+    }
+    free(names);
+}
+
+
+/* Add the paths listed (one per line) in file 'fname', "-" is stdin */
+static void read_list(inputs_t *in, const char *fname)
+{
+    FILE *fp;
+    size_t len;
+    char line[4096];
+
+    if (strcmp(fname, "-") == 0)
+      fp = stdin;
+    else
+      ERR((fp = fopen(fname, "r")), ==NULL,
+          "Could not open file list %s: %s", fname, strerror(errno));
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        len = strlen(line);
+        ERR(len, == sizeof(line) - 1 && line[len-1] != '\n',
+            "Path is too long... sorry");
+        while (len && (line[len-1] == '\n' || line[len-1] == '\r'))
+          line[--len] = '\0';
+        if (len)
+          add_path(in, line);
+    }
+
+    if (fp != stdin)
+      fclose(fp);
 }
 
 
@@ -135,34 +1059,76 @@ static decode_exit_e print_buffer_callback(decode_t *decode)
 #endif /* DEBUG */
 
 
+/* --stats: What the library did for all of the pdfs together (to stderr, so
+ * as not to get mixed up with the results)
+ */
+static void print_stats(const pdf_stats_t *st, int n_docs)
+{
+    FILE *fp = stderr;
+
+    fprintf(fp, "Stats for %d document%s (times are summed over threads):\n",
+            n_docs, (n_docs == 1) ? "" : "s");
+    fprintf(fp, "  %-22s %14llu\n", "objects resolved",
+            (unsigned long long)st->objects_resolved);
+    fprintf(fp, "  %-22s %14llu\n", "bytes scanned",
+            (unsigned long long)st->bytes_scanned);
+    fprintf(fp, "  %-22s %14llu\n", "bytes compressed",
+            (unsigned long long)st->bytes_compressed);
+    fprintf(fp, "  %-22s %14llu\n", "bytes inflated",
+            (unsigned long long)st->bytes_inflated);
+    fprintf(fp, "  %-22s %14llu (%llu bytes)\n", "content stream runs",
+            (unsigned long long)st->ps_runs,
+            (unsigned long long)st->ps_bytes);
+    fprintf(fp, "  %-22s %14llu\n", "callbacks",
+            (unsigned long long)st->callbacks);
+    fprintf(fp, "  %-22s %14.3f ms\n", "open", st->open_ns / 1e6);
+    fprintf(fp, "  %-22s %14.3f ms\n", "  xrefs", st->xref_ns / 1e6);
+    fprintf(fp, "  %-22s %14.3f ms\n", "  page tree",
+            st->page_tree_ns / 1e6);
+    fprintf(fp, "  %-22s %14.3f ms\n", "decode", st->decode_ns / 1e6);
+}
+
+
 #ifdef DEBUG
 static void debug_page(const pdf_t *pdf, int pg_num)
 {
     decode_t decode;
     char buf[2048] = {0};
 
-    decode.pdf = pdf;
+    pdf_decode_init(&decode, pdf);
     decode.pg_num = pg_num;
     decode.buffer = buf;
-    decode.buffer_length = sizeof(buf) - 1;
+    decode.buffer_length = sizeof(buf);
     decode.buffer_used = 0;
     decode.callback = print_buffer_callback;
     decode.user_data = NULL;
     pdf_decode_page(&decode);
+    pdf_decode_release(&decode);
 }
 #endif /* DEBUG */
 
 
 int main(int argc, char **argv)
 {
-    int i, re_idx;
+    int i, re_idx, n_threads = 1, n_patterns = 0, n_inputs = 0;
+    int n_failed = 0;
+    _Bool sidecars = false, show_stats = false;
+    pdf_stats_t stats;
 #ifdef DEBUG
     int debug_page_num = 0;
-#endif
     pdf_t *pdf;
-    regex_t re;
-    char regex[1024] = {0};
-    const char *fname = NULL, *expr = NULL;
+#endif
+    ere_t *re = NULL;
+    ac_t *ac = NULL;
+    inputs_t in;
+    index_t *idx;
+    index_writer_t *writer = NULL;
+    char regex[1024] = {0}, **patterns = NULL;
+    const char *expr = NULL, *pattern_file = NULL, *error;
+    const char *index_out = NULL, *index_in = NULL, *trace_out = NULL;
+
+    memset(&in, 0, sizeof(inputs_t));
+    memset(&stats, 0, sizeof(pdf_stats_t));
 
     for (i=1; i<argc; ++i)
     {
@@ -176,41 +1142,151 @@ int main(int argc, char **argv)
             else 
               usage(argv[0]);
         }
+        else if (strncmp(argv[i], "-f", 2) == 0)
+        {
+            /* -f file or -ffile */
+            if (strlen(argv[i]) > 2)
+              pattern_file = argv[i] + 2;
+            else if (i+1<argc)
+              pattern_file = argv[++i];
+            else
+              usage(argv[0]);
+        }
+        else if (strncmp(argv[i], "-l", 2) == 0)
+        {
+            /* -l list or -llist */
+            if (strlen(argv[i]) > 2)
+              read_list(&in, argv[i] + 2);
+            else if (i+1<argc)
+              read_list(&in, argv[++i]);
+            else
+              usage(argv[0]);
+            ++n_inputs;
+        }
+        else if (strncmp(argv[i], "-b", 2) == 0)
+        {
+            /* -b index or -bindex */
+            if (strlen(argv[i]) > 2)
+              index_out = argv[i] + 2;
+            else if (i+1<argc)
+              index_out = argv[++i];
+            else
+              usage(argv[0]);
+        }
+        else if (strncmp(argv[i], "-q", 2) == 0)
+        {
+            /* -q index or -qindex */
+            if (strlen(argv[i]) > 2)
+              index_in = argv[i] + 2;
+            else if (i+1<argc)
+              index_in = argv[++i];
+            else
+              usage(argv[0]);
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0)
+        {
+            /* -j N or -jN */
+            if (strlen(argv[i]) > 2)
+              n_threads = atoi(argv[i] + 2);
+            else if (i+1<argc)
+              n_threads = atoi(argv[++i]);
+            if (n_threads < 1)
+              usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+          sidecars = true;
+        else if (strcmp(argv[i], "--stats") == 0)
+          show_stats = true;
+        else if (strcmp(argv[i], "--trace") == 0 && i+1<argc)
+          trace_out = argv[++i];
 #ifdef DEBUG
         else if (strncmp(argv[i], "-d", 2) == 0)
           debug_page_num = atoi(argv[++i]);
 #endif
         else if (argv[i][0] != '-')
-          fname = argv[i];
+        {
+            add_path(&in, argv[i]);
+            ++n_inputs;
+        }
         else
           usage(argv[0]);
     }
 
-    if (!fname || !expr)
+    /* Building an index takes documents and no search, anything else takes
+     * one search and either documents or an index
+     */
+    if (index_out && index_in)
+      usage(argv[0]);
+    else if (index_in && (sidecars || show_stats || trace_out))
+      usage(argv[0]);
+    else if (index_out && (!n_inputs || expr || pattern_file))
       usage(argv[0]);
+    else if (!index_out && (!(expr || pattern_file) || (expr && pattern_file) ||
+                            !n_inputs == !index_in))
+      usage(argv[0]);
+
+    /* Multi-pattern mode: Patterns are matched as literals, in one pass */
+    if (pattern_file)
+    {
+        patterns = read_patterns(pattern_file, &n_patterns);
+        ERR(n_patterns, ==0, "No patterns in %s", pattern_file);
+        ERR((ac = ac_new((const char *const *)patterns, n_patterns)), ==NULL,
+            "Could not build patterns");
+        D("Patterns: %d (%d states)", n_patterns, ac->n_states);
+    }
+    else if (expr)
+    {
+        /* Remove spaces for regex and test length */
+        ERR(strlen(expr), >= sizeof(regex), "Regex is too long... sorry")
+        for (i=0, re_idx=0; i<strlen(expr); ++i)
+          if (expr[i] != ' ')
+            regex[re_idx++] = expr[i];
 
-    /* Remove spaces for regex and test length */
-    ERR(strlen(expr), >= sizeof(regex), "Regex is too long... sorry")
-    for (i=0, re_idx=0; i<strlen(expr); ++i)
-      if (expr[i] != ' ')
-        regex[re_idx++] = expr[i];
+        /* Build regex */
+        ERR((re = ere_compile(regex, &error)), ==NULL,
+            "Could not build regex: %s", error);
+    }
 
-    D("File: %s", fname);
+    D("Files: %d", in.n_docs);
     D("Expr: %s", regex);
+    D("Threads: %d", n_threads);
 
-    /* Build regex */
-    ERR(regcomp(&re, regex, REG_EXTENDED), !=0,
-        "Could not build regex");
-   
-    /* New pdf */ 
-    pdf = pdf_new(fname);
+    /* Run the match routine (or answer it from an index, or build one) */
+    if (trace_out)
+      pdf_trace_start();
+    if (index_in)
+    {
+        ERR((idx = index_open(index_in, &error)), ==NULL,
+            "Could not open index %s: %s", index_in, error);
+        run_query(idx, re, ac, patterns, n_patterns);
+        index_close(idx);
+    }
+    else if (index_out)
+    {
+        ERR((writer = index_create(index_out)), ==NULL,
+            "Could not create index %s: %s", index_out, strerror(errno));
+        n_failed = run_regex(in.docs, in.n_docs, NULL, NULL, NULL, writer,
+                             sidecars, show_stats ? &stats : NULL, n_threads);
+        ERR(index_finish(writer), ==false, "Could not write index %s",
+            index_out);
+    }
+    else
+      n_failed = run_regex(in.docs, in.n_docs, re, ac, patterns, NULL,
+                           sidecars, show_stats ? &stats : NULL, n_threads);
 
-    /* Run the match routine */
-    run_regex(pdf, &re);
+    if (show_stats)
+      print_stats(&stats, in.n_docs);
+    if (trace_out)
+      ERR(pdf_trace_write(trace_out), !=PDF_OK, "Could not write trace %s",
+          trace_out);
 
 #ifdef DEBUG
-    if (debug_page_num)
-      debug_page(pdf, debug_page_num);
+    if (debug_page_num && in.n_docs)
+    {
+        pdf = pdf_new(in.docs[0].fname);
+        debug_page(pdf, debug_page_num);
+        pdf_destroy(pdf);
+    }
 #endif
 
 #if 0
@@ -218,7 +1294,13 @@ int main(int argc, char **argv)
 #endif
 
     /* Clean up */
-    pdf_destroy(pdf);
-    regfree(&re);
-    return 0;
+    for (i=0; i<in.n_docs; ++i)
+      free(in.docs[i].fname);
+    free(in.docs);
+    ere_free(re);
+    ac_destroy(ac);
+    for (i=0; i<n_patterns; ++i)
+      free(patterns[i]);
+    free(patterns);
+    return n_failed ? EXIT_FAILURE : 0;
 }
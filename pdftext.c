@@ -0,0 +1,97 @@
+/******************************************************************************
+ * pdftext.c
+ *
+ * pdftext - Write out the text of each page of a pdf
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Writes the text of page 1 of a pdf to <dir>/1, page 2 to <dir>/2 and so on,
+ * decoded in buffers of the size pdfsearch uses.  'make check' runs grep over
+ * these to check what pdfsearch finds on each page.
+ *
+ * The pdf is opened with its pages loaded lazily (pdfsearch loads them all up
+ * front), and without exiting on a pdf that cannot be loaded: That prints the
+ * PDF_ERR_* code instead, which 'make check' looks for with bad pdfs.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "pdf.h"
+
+
+#undef TAG
+#define TAG "pdftext"
+
+
+static void usage(const char *execname)
+{
+    printf("Usage: %s <file> <dir>\n", execname);
+    exit(EXIT_SUCCESS);
+}
+
+
+/* Append the decoded text to the page's file */
+static decode_exit_e write_callback(decode_t *decode)
+{
+    FILE *fp = (FILE *)decode->user_data;
+
+    ERR(fwrite(decode->buffer, 1, decode->buffer_used, fp),
+        !=decode->buffer_used, "Could not write page %d", decode->pg_num);
+    decode->buffer_used = 0;
+    return DECODE_CONTINUE;
+}
+
+
+int main(int argc, char **argv)
+{
+    int pg, fd, err;
+    char buf[16384], path[4096];
+    FILE *fp;
+    pdf_t *pdf;
+    decode_t decode;
+
+    if (argc != 3)
+      usage(argv[0]);
+
+    ERR((fd = open(argv[1], O_RDONLY)), ==-1, "Opening file '%s'", argv[1]);
+    pdf = pdf_new_from_fd(fd, PDF_LAZY_PAGES, &err);
+    close(fd);
+    ERR(pdf, ==NULL, "Could not load pdf '%s' (error %d)", argv[1], err);
+
+    pdf_decode_init(&decode, pdf);
+    decode.callback = write_callback;
+    decode.buffer = buf;
+    decode.buffer_length = sizeof(buf);
+
+    for (pg=1; pg<=pdf->n_pages; ++pg)
+    {
+        snprintf(path, sizeof(path), "%s/%d", argv[2], pg);
+        ERR((fp = fopen(path, "w")), ==NULL, "Could not create %s", path);
+        decode.pg_num = pg;
+        decode.user_data = fp;
+        pdf_decode_page(&decode);
+        ERR(fclose(fp), !=0, "Could not write %s", path);
+    }
+
+    pdf_decode_release(&decode);
+    pdf_destroy(pdf);
+    return 0;
+}
@@ -0,0 +1,454 @@
+/******************************************************************************
+ * scan.c
+ *
+ * libnachopdf - A basic PDF text extraction library
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Length-bounded scanning primitives.  The pdf is mapped straight from the
+ * file and is not NUL terminated, so nothing here ever reads outside of the
+ * range it is given.
+ *
+ * On x86 SSE2 is always used (it is part of x86-64) and AVX2 is used when the
+ * CPU has it.  Everything else gets the scalar versions.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "pdf.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__SSE2__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+/* PDF whitespace: NUL, tab, line feed, form feed, carriage return and space */
+#define IS_SPACE(_c) \
+    ((_c)==' ' || (_c)=='\n' || (_c)=='\r' || (_c)=='\t' || \
+     (_c)=='\f' || (_c)=='\0')
+
+
+/*
+ * Scalar versions (also used for the tails the vector versions leave behind)
+ */
+
+static const char *memchr_scalar(const char *s, int c, size_t len)
+{
+    size_t i;
+    for (i=0; i<len; ++i)
+      if (s[i] == (char)c)
+        return s + i;
+    return NULL;
+}
+
+
+static const char *memrchr_scalar(const char *s, int c, size_t len)
+{
+    while (len--)
+      if (s[len] == (char)c)
+        return s + len;
+    return NULL;
+}
+
+
+static size_t span_scalar(const char *s, size_t len, _Bool space)
+{
+    size_t i;
+    for (i=0; i<len; ++i)
+      if (IS_SPACE(s[i]) != space)
+        break;
+    return i;
+}
+
+
+static const char *memmem_scalar(
+    const char *s,
+    size_t      len,
+    const char *find,
+    size_t      find_len)
+{
+    const char *en, *st = s;
+
+    while (len - (st - s) >= find_len &&
+           (en = memchr_scalar(st, find[0], len - (st - s) - find_len + 1)))
+    {
+        if (memcmp(en + 1, find + 1, find_len - 1) == 0)
+          return en;
+        st = en + 1;
+    }
+
+    return NULL;
+}
+
+
+#ifdef HAVE_X86_SIMD
+/*
+ * SSE2 (16 bytes at a time)
+ */
+
+static const char *memchr_sse2(const char *s, int c, size_t len)
+{
+    size_t i;
+    unsigned m;
+    const __m128i v = _mm_set1_epi8((char)c);
+
+    for (i=0; i+16<=len; i+=16)
+    {
+        m = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+i)), v));
+        if (m)
+          return s + i + __builtin_ctz(m);
+    }
+
+    return memchr_scalar(s + i, c, len - i);
+}
+
+
+static const char *memrchr_sse2(const char *s, int c, size_t len)
+{
+    unsigned m;
+    const __m128i v = _mm_set1_epi8((char)c);
+
+    for ( ; len>=16; len-=16)
+    {
+        m = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+len-16)), v));
+        if (m)
+          return s + len - 16 + (31 - __builtin_clz(m));
+    }
+
+    return memrchr_scalar(s, c, len);
+}
+
+
+/* Bit 'n' of the result is set if s[n] is whitespace */
+static inline unsigned space_mask_sse2(const char *s)
+{
+    const __m128i d = _mm_loadu_si128((const __m128i *)s);
+    __m128i m;
+
+    m = _mm_or_si128(_mm_cmpeq_epi8(d, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(d, _mm_set1_epi8('\n')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(d, _mm_set1_epi8('\r')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(d, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(d, _mm_set1_epi8('\f')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(d, _mm_setzero_si128()));
+    return _mm_movemask_epi8(m);
+}
+
+
+static size_t span_sse2(const char *s, size_t len, _Bool space)
+{
+    size_t i;
+    unsigned m;
+
+    for (i=0; i+16<=len; i+=16)
+    {
+        /* Bits set where the run ends */
+        m = space_mask_sse2(s + i);
+        m = space ? (~m & 0xFFFF) : m;
+        if (m)
+          return i + __builtin_ctz(m);
+    }
+
+    return i + span_scalar(s + i, len - i, space);
+}
+
+
+/* Compare the first and last characters of 'find' at 16 positions at once,
+ * and only memcmp the positions where both match.
+ */
+static const char *memmem_sse2(
+    const char *s,
+    size_t      len,
+    const char *find,
+    size_t      find_len)
+{
+    size_t i;
+    unsigned m, bit;
+    const __m128i first = _mm_set1_epi8(find[0]);
+    const __m128i last = _mm_set1_epi8(find[find_len-1]);
+
+    for (i=0; i+find_len-1+16<=len; i+=16)
+    {
+        m = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+i)), first),
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(s+i+find_len-1)), last)));
+        while (m)
+        {
+            bit = __builtin_ctz(m);
+            if (memcmp(s + i + bit + 1, find + 1, find_len - 2) == 0)
+              return s + i + bit;
+            m &= m - 1;
+        }
+    }
+
+    return memmem_scalar(s + i, len - i, find, find_len);
+}
+
+
+/*
+ * AVX2 (32 bytes at a time)
+ */
+
+__attribute__((target("avx2")))
+static const char *memchr_avx2(const char *s, int c, size_t len)
+{
+    size_t i;
+    unsigned m;
+    const __m256i v = _mm256_set1_epi8((char)c);
+
+    for (i=0; i+32<=len; i+=32)
+    {
+        m = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s+i)), v));
+        if (m)
+          return s + i + __builtin_ctz(m);
+    }
+
+    return memchr_sse2(s + i, c, len - i);
+}
+
+
+__attribute__((target("avx2")))
+static const char *memrchr_avx2(const char *s, int c, size_t len)
+{
+    unsigned m;
+    const __m256i v = _mm256_set1_epi8((char)c);
+
+    for ( ; len>=32; len-=32)
+    {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(s+len-32)), v));
+        if (m)
+          return s + len - 32 + (31 - __builtin_clz(m));
+    }
+
+    return memrchr_sse2(s, c, len);
+}
+
+
+__attribute__((target("avx2")))
+static inline unsigned space_mask_avx2(const char *s)
+{
+    const __m256i d = _mm256_loadu_si256((const __m256i *)s);
+    __m256i m;
+
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(d, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(d, _mm256_set1_epi8('\n')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(d, _mm256_set1_epi8('\r')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(d, _mm256_set1_epi8('\t')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(d, _mm256_set1_epi8('\f')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(d, _mm256_setzero_si256()));
+    return _mm256_movemask_epi8(m);
+}
+
+
+__attribute__((target("avx2")))
+static size_t span_avx2(const char *s, size_t len, _Bool space)
+{
+    size_t i;
+    unsigned m;
+
+    for (i=0; i+32<=len; i+=32)
+    {
+        m = space_mask_avx2(s + i);
+        m = space ? ~m : m;
+        if (m)
+          return i + __builtin_ctz(m);
+    }
+
+    return i + span_sse2(s + i, len - i, space);
+}
+
+
+__attribute__((target("avx2")))
+static const char *memmem_avx2(
+    const char *s,
+    size_t      len,
+    const char *find,
+    size_t      find_len)
+{
+    size_t i;
+    unsigned m, bit;
+    const __m256i first = _mm256_set1_epi8(find[0]);
+    const __m256i last = _mm256_set1_epi8(find[find_len-1]);
+
+    for (i=0; i+find_len-1+32<=len; i+=32)
+    {
+        m = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(s+i)), first),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(s+i+find_len-1)), last)));
+        while (m)
+        {
+            bit = __builtin_ctz(m);
+            if (memcmp(s + i + bit + 1, find + 1, find_len - 2) == 0)
+              return s + i + bit;
+            m &= m - 1;
+        }
+    }
+
+    return memmem_sse2(s + i, len - i, find, find_len);
+}
+
+
+#define HAVE_AVX2() __builtin_cpu_supports("avx2")
+#endif /* HAVE_X86_SIMD */
+
+
+/*
+ * Public routines: Pick the widest version the CPU supports
+ */
+
+const char *pdf_memchr(const char *s, int c, size_t len)
+{
+#ifdef HAVE_X86_SIMD
+    return HAVE_AVX2() ? memchr_avx2(s, c, len) : memchr_sse2(s, c, len);
+#else
+    return memchr_scalar(s, c, len);
+#endif
+}
+
+
+const char *pdf_memrchr(const char *s, int c, size_t len)
+{
+#ifdef HAVE_X86_SIMD
+    return HAVE_AVX2() ? memrchr_avx2(s, c, len) : memrchr_sse2(s, c, len);
+#else
+    return memrchr_scalar(s, c, len);
+#endif
+}
+
+
+const char *pdf_memmem(
+    const char *s,
+    size_t      len,
+    const char *find,
+    size_t      find_len)
+{
+    if (find_len == 0)
+      return s;
+    if (find_len > len)
+      return NULL;
+    if (find_len == 1)
+      return pdf_memchr(s, find[0], len);
+#ifdef HAVE_X86_SIMD
+    return HAVE_AVX2() ? memmem_avx2(s, len, find, find_len) :
+                         memmem_sse2(s, len, find, find_len);
+#else
+    return memmem_scalar(s, len, find, find_len);
+#endif
+}
+
+
+size_t pdf_span_space(const char *s, size_t len)
+{
+#ifdef HAVE_X86_SIMD
+    return HAVE_AVX2() ? span_avx2(s, len, true) : span_sse2(s, len, true);
+#else
+    return span_scalar(s, len, true);
+#endif
+}
+
+
+size_t pdf_span_nonspace(const char *s, size_t len)
+{
+#ifdef HAVE_X86_SIMD
+    return HAVE_AVX2() ? span_avx2(s, len, false) : span_sse2(s, len, false);
+#else
+    return span_scalar(s, len, false);
+#endif
+}
+
+
+/*
+ * Numbers
+ */
+
+/* Powers of ten, each exactly a double (as are all up to 1e22) */
+static const double pow10_pos[] =
+{
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+};
+#define MAX_FRAC_DIGITS 18
+
+/* Largest integer up to which every integer is exactly a double */
+#define MAX_EXACT (1ULL << 53)
+
+
+/* The digits are kept as one integer while that is exactly a double; it is
+ * then a single (so correctly rounded) division by an exact power of ten, as
+ * strtod gives.  Longer numbers add the fraction to the integer part instead,
+ * which can be off by a bit in the last place.
+ */
+size_t pdf_parse_number(const char *s, size_t len, double *val)
+{
+    size_t i = 0;
+    _Bool neg = false, have_digits = false, exact = true;
+    int n_frac = 0;
+    double ip = 0.0;
+    unsigned long long frac = 0, digits = 0;
+
+    if (i < len && (s[i] == '-' || s[i] == '+'))
+      neg = (s[i++] == '-');
+
+    /* Integer part */
+    for ( ; i<len && s[i]>='0' && s[i]<='9'; ++i)
+    {
+        ip = ip * 10.0 + (s[i] - '0');
+        if (digits <= (MAX_EXACT - 9) / 10)
+          digits = digits * 10 + (s[i] - '0');
+        else
+          exact = false;
+        have_digits = true;
+    }
+
+    /* Fraction (digits past what a double can hold are just skipped) */
+    if (i < len && s[i] == '.')
+      for (++i; i<len && s[i]>='0' && s[i]<='9'; ++i)
+      {
+          if (n_frac < MAX_FRAC_DIGITS)
+          {
+              frac = frac * 10 + (s[i] - '0');
+              ++n_frac;
+              if (digits <= (MAX_EXACT - 9) / 10)
+                digits = digits * 10 + (s[i] - '0');
+              else
+                exact = false;
+          }
+          else
+            exact = false;
+          have_digits = true;
+      }
+
+    if (!have_digits)
+      return 0;
+
+    if (exact)
+      ip = (double)digits / pow10_pos[n_frac];
+    else
+      ip += (double)frac / pow10_pos[n_frac];
+    *val = neg ? -ip : ip;
+    return i;
+}
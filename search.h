@@ -0,0 +1,272 @@
+/******************************************************************************
+ * search.h
+ *
+ * pdfsearch - Search PDF text-contents from shell
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of pdfsearch.
+ * pdfsearch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pdfsearch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pdfsearch.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* The matchers pdfsearch runs over decoded page text, and its index of it */
+
+#ifndef __SEARCH_H_INCLUDE
+#define __SEARCH_H_INCLUDE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/* Multi-pattern literal search (Aho-Corasick, ac.c).  All of the patterns are
+ * compiled into one automaton (a DFA over byte classes), so text is matched
+ * against every pattern in a single pass.  Spaces and tabs are ignored in both
+ * the patterns and the text, as pdfsearch cannot tell where words break.
+ *
+ * An automaton is only read once built, so any number of threads can scan
+ * with the same one, each keeping its own state.
+ */
+typedef struct
+{
+    int            n_patterns;
+    int            n_states;
+    int            n_classes;
+    unsigned char  classes[256]; /* Byte -> class                          */
+    int           *delta;        /* State * n_classes + class -> state     */
+    int           *fail;         /* Longest proper suffix that is a state  */
+    int           *report;       /* Nearest state (itself or along 'fail')
+                                  * where a pattern ends, 0 if none
+                                  */
+    int           *term;         /* First pattern ending at a state, or -1 */
+    int           *next;         /* Next pattern ending at the same state  */
+} ac_t;
+
+
+/* Called back for each pattern (index into the patterns given to ac_new)
+ * found.  A pattern is reported each time it occurs.
+ */
+typedef void (*ac_hit_cb)(void *arg, int pattern);
+
+
+/* Build an automaton for 'n_patterns' patterns, NULL if out of memory.
+ * Patterns that are empty (or only spaces) never match.
+ */
+extern ac_t *ac_new(const char *const *patterns, int n_patterns);
+extern void ac_destroy(ac_t *ac);
+
+
+/* Scan 'len' bytes of text starting from 'state' (0 to start a new text) and
+ * return the state to continue from, so text can be scanned in pieces.
+ */
+extern int ac_scan(const ac_t *ac, int state, const char *text, size_t len,
+                   ac_hit_cb hit, void *arg);
+
+
+/* Extended regular expressions (ere.c), matched a line at a time as grep does:
+ * '.' and bracket expressions never match '\n', '^' and '$' match at the start
+ * and end of a line.  Supported: literals, '.', bracket expressions (ranges,
+ * negation and [:class:]), \w \W \s \S, '*' '+' '?' {m,n}, '|', '()' and the
+ * anchors.  Back-references are not (no DFA can match them).
+ *
+ * A compiled pattern (the NFA) is only read once built and is shared, each
+ * thread scans with its own ere_dfa_t, which builds the DFA as it goes.
+ */
+enum {ERE_SET, ERE_SPLIT, ERE_BOL, ERE_EOL, ERE_MATCH};
+
+typedef struct
+{
+    int type;
+    int out, out1; /* Next node(s), out1 only for ERE_SPLIT */
+    int set;       /* ERE_SET: Index into sets              */
+} ere_node_t;
+
+typedef struct
+{
+    int             n_nodes, max_nodes;
+    ere_node_t     *nodes;
+    int             start, match;
+    int             n_sets, max_sets;
+    unsigned char (*sets)[32];   /* Bitmaps of the bytes each ERE_SET takes */
+    int             n_classes;
+    unsigned char   classes[256]; /* Byte -> class (bytes no set tells apart) */
+    int             newline_class;
+    int             n_literals;
+    char          **literals;     /* Strings every match contains (maybe
+                                   * none), for narrowing down the text to
+                                   * scan
+                                   */
+} ere_t;
+
+typedef struct
+{
+    const ere_t   *re;
+    int            state;         /* Where the scan is                      */
+    _Bool          matched;
+    int            n_states;
+    int           *trans;         /* State * n_classes + class -> state, or
+                                   * -1 if not worked out yet
+                                   */
+    unsigned char *flags;         /* Whether a match ends at each state     */
+    int           *set_off;       /* Each state's NFA states, in 'sets'     */
+    int           *set_lens;
+    int           *sets;
+    int            sets_used, sets_max;
+    int           *hash;          /* NFA state set -> state + 1, 0 is free  */
+    int            hash_size;
+    unsigned long  flushes;       /* Times the states were all dropped      */
+    unsigned      *mark;          /* Scratch for working out new states     */
+    unsigned       gen;
+    int           *stack;
+    int           *set;
+    int            set_len;
+} ere_dfa_t;
+
+
+/* Compile 'pattern', NULL with '*error' set if it is invalid */
+extern ere_t *ere_compile(const char *pattern, const char **error);
+extern void ere_free(ere_t *re);
+
+
+/* A scanner for 're', NULL if out of memory.  It starts at the start of a
+ * text, ere_dfa_reset() starts another.
+ */
+extern ere_dfa_t *ere_dfa_new(const ere_t *re);
+extern void ere_dfa_free(ere_dfa_t *dfa);
+extern void ere_dfa_reset(ere_dfa_t *dfa);
+
+
+/* Scan the next 'len' bytes of the text, true once the pattern has matched
+ * (the rest of the text need not be scanned).  Every byte is looked at once,
+ * however the text is split up.
+ */
+extern _Bool ere_dfa_scan(ere_dfa_t *dfa, const char *text, size_t len);
+
+
+/* The text has ended (which ends its last line, for '$'): True if the pattern
+ * matched
+ */
+extern _Bool ere_dfa_end(ere_dfa_t *dfa);
+
+
+/* Trigram index (index.c) of the text of many documents, see there for the
+ * file layout.  The trigrams of a text leave out spaces and tabs (as the
+ * matchers can) and do not span lines.
+ *
+ * Written by one thread, page after page.  Once written it is only read, so
+ * any number of threads can query one index.
+ */
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t n_docs;
+    uint32_t n_pages;
+    uint32_t n_trigrams;
+    uint32_t unused;
+    uint64_t pages_off;    /* File offsets of the tables */
+    uint64_t docs_off;
+    uint64_t names_off;
+    uint64_t trigrams_off;
+    uint64_t postings_off;
+    uint64_t size;         /* Of the whole file          */
+} index_header_t;
+
+typedef struct
+{
+    uint64_t name;       /* Offset into the names */
+    uint32_t first_page; /* Numbered from 0 across all documents */
+    uint32_t n_pages;
+} index_doc_t;
+
+typedef struct
+{
+    uint32_t trigram;  /* Bytes a, b, c as a << 16 | b << 8 | c */
+    uint32_t n_pages;
+    uint64_t postings; /* Offset into the postings */
+} index_trigram_t;
+
+typedef struct
+{
+    FILE        *fp;
+    uint64_t     pos;       /* Bytes written so far       */
+    _Bool        failed;
+    uint64_t    *pages;     /* Text offset of each page   */
+    uint32_t     n_pages, max_pages;
+    index_doc_t *docs;
+    uint32_t     n_docs, max_docs;
+    char        *names;
+    size_t       names_len, names_max;
+    uint64_t    *pairs;     /* Trigram << 32 | page, for
+                             * every trigram of each page
+                             */
+    size_t       n_pairs, max_pairs;
+} index_writer_t;
+
+typedef struct
+{
+    const void            *data; /* The file, mapped */
+    size_t                 len;
+    const index_header_t  *hdr;
+    const char            *text;
+    const uint64_t        *pages;
+    const index_doc_t     *docs;
+    const char            *names;
+    const index_trigram_t *trigrams;
+    const unsigned char   *postings;
+} index_t;
+
+
+/* The trigrams of 'len' bytes of 'text', sorted and each once, into '*tris'
+ * (of '*max', grown as needed).  Returns how many, -1 if out of memory.
+ */
+extern int index_trigrams(const char *text, size_t len, uint32_t **tris,
+                          int *max);
+
+
+/* Write an index to 'fname': Add each document and then each of its pages in
+ * turn (its text, and trigrams from index_trigrams).  index_finish() writes
+ * the tables and frees 'w', it returns 'false' if anything failed.
+ */
+extern index_writer_t *index_create(const char *fname);
+extern _Bool index_add_doc(index_writer_t *w, const char *fname);
+extern _Bool index_add_page(index_writer_t *w, const char *text, size_t len,
+                            const uint32_t *tris, int n_tris);
+extern _Bool index_finish(index_writer_t *w);
+
+
+/* Map the index in 'fname', NULL with '*error' set if it is not valid */
+extern index_t *index_open(const char *fname, const char **error);
+extern void index_close(index_t *idx);
+
+
+/* Page 'page's text, its document, and a document's file name */
+extern const char *index_page_text(const index_t *idx, uint32_t page,
+                                   size_t *len);
+extern uint32_t index_doc_of(const index_t *idx, uint32_t page);
+extern const char *index_doc_name(const index_t *idx, uint32_t doc);
+
+
+/* Narrow the 'n' pages (sorted) in '*pages' down to those with every trigram
+ * of 'len' bytes of 'lit'.  If 'n' is -1 it starts from every page, and
+ * '*pages' is allocated.  Returns how many are left, -1 if 'lit' is too short
+ * to tell and it started from every page (so '*pages' was not allocated),
+ * -2 if out of memory.
+ */
+extern int64_t index_filter(const index_t *idx, const char *lit, size_t len,
+                            uint32_t **pages, int64_t n);
+
+
+#endif /* __SEARCH_H_INCLUDE */
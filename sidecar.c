@@ -0,0 +1,311 @@
+/******************************************************************************
+ * sidecar.c
+ *
+ * libnachopdf - A basic PDF text extraction library
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Sidecars: The decoded text of every page of a pdf, in a file next to it
+ * (the pdf's name plus PDF_SIDECAR_EXT), so the text can be had again straight
+ * from a mapping of that file.  The layout is:
+ *
+ *   header   sidecar_header_t
+ *   offsets  n_pages + 1 uint64_t, where each page's text starts (and the
+ *            text ends) relative to the start of the text
+ *   text     The pages' text, one after the other
+ *
+ * A sidecar is only used while the pdf has the size, modification time and
+ * content hash recorded in it.  Numbers are in the byte order of the machine
+ * that wrote it, and a sidecar from another machine is just not used.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* st_mtim */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pdf.h"
+
+
+#define SIDECAR_MAGIC   "NachoTxt"
+#define SIDECAR_VERSION 1
+#define SIDECAR_ENDIAN  0x01020304
+
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t n_pages;
+    uint32_t unused;
+    uint64_t src_size;  /* The pdf's size, modification time and hash */
+    int64_t  src_mtime; /* In nanoseconds */
+    uint64_t src_hash;
+} sidecar_header_t;
+
+
+/* A file's modification time, in nanoseconds: Seconds are not enough, a pdf
+ * can well be rewritten within the second its sidecar was
+ */
+static int64_t mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+
+#define ROTL(_x, _r) (((_x) << (_r)) | ((_x) >> (64 - (_r))))
+
+/* Hash of the pdf's contents, to catch changes that keep its size and time.
+ * Four lanes of 8 bytes each are mixed independently (so they can be worked
+ * on at once) and then combined.
+ */
+static uint64_t hash_data(const char *data, size_t len)
+{
+    int i;
+    size_t j;
+    uint64_t w, h[4] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+                        0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+    const uint64_t k = 0x9FB21C651E98DF25ULL;
+
+    for (j=0; j+32<=len; j+=32)
+      for (i=0; i<4; ++i)
+      {
+          memcpy(&w, data + j + 8*i, 8);
+          h[i] = ROTL(h[i] ^ (w * k), 31) * 0xFF51AFD7ED558CCDULL;
+      }
+
+    w = len;
+    for (i=0; i<4; ++i)
+      w = ROTL(w ^ h[i], 27) * k;
+    for ( ; j<len; ++j)
+      w = (w ^ (unsigned char)data[j]) * 0x100000001B3ULL;
+
+    w ^= w >> 33;
+    w *= 0xC4CEB9FE1A85EC53ULL;
+    return w ^ (w >> 29);
+}
+
+
+/* 'fname' plus 'ext', NULL if out of memory */
+static char *sidecar_name(const char *fname, const char *ext)
+{
+    char *name;
+    size_t len = strlen(fname), ext_len = strlen(ext);
+
+    if ((name = malloc(len + ext_len + 1)))
+    {
+        memcpy(name, fname, len);
+        memcpy(name + len, ext, ext_len + 1);
+    }
+    return name;
+}
+
+
+/* Hand the text on to the sidecar being written */
+static decode_exit_e write_text(decode_t *decode)
+{
+    FILE *fp = (FILE *)decode->user_data;
+
+    fwrite(decode->buffer, 1, decode->buffer_used, fp);
+    decode->buffer_used = 0;
+    return DECODE_CONTINUE;
+}
+
+
+int pdf_sidecar_write(const pdf_t *pdf)
+{
+    int pg, ret = PDF_ERR;
+    long pos;
+    char buf[16384], *name, *tmp_name;
+    uint64_t *offsets;
+    struct stat st;
+    sidecar_header_t hdr;
+    decode_t decode;
+    FILE *fp;
+
+    if (!pdf->fname || stat(pdf->fname, &st) == -1)
+      return PDF_ERR; /* Not from a file (or not there any more) */
+
+    /* Written under another name first, then moved into place, so nobody
+     * sees half of it
+     */
+    name = sidecar_name(pdf->fname, PDF_SIDECAR_EXT);
+    tmp_name = sidecar_name(pdf->fname, PDF_SIDECAR_EXT ".tmp");
+    offsets = calloc(pdf->n_pages + 1, sizeof(uint64_t));
+    if (!name || !tmp_name || !offsets || !(fp = fopen(tmp_name, "wb")))
+    {
+        free(name);
+        free(tmp_name);
+        free(offsets);
+        return PDF_ERR;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SIDECAR_MAGIC, sizeof(hdr.magic));
+    hdr.version = SIDECAR_VERSION;
+    hdr.endian = SIDECAR_ENDIAN;
+    hdr.n_pages = pdf->n_pages;
+    hdr.src_size = pdf->len;
+    hdr.src_mtime = mtime_ns(&st);
+    hdr.src_hash = hash_data(pdf->data, pdf->len);
+
+    /* The offsets are filled in once the text is out */
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(offsets, sizeof(uint64_t), pdf->n_pages + 1, fp);
+
+    pdf_decode_init(&decode, pdf);
+    decode.buffer = buf;
+    decode.buffer_length = sizeof(buf);
+    decode.callback = write_text;
+    decode.user_data = fp;
+    for (pg=0; pg<pdf->n_pages; ++pg)
+    {
+        offsets[pg] = ftell(fp) - sizeof(hdr) -
+                      sizeof(uint64_t) * (pdf->n_pages + 1);
+        decode.pg_num = pg + 1;
+        decode.buffer_used = 0;
+        pdf_decode_page(&decode);
+    }
+    pdf_decode_release(&decode);
+
+    pos = ftell(fp);
+    offsets[pdf->n_pages] = pos - sizeof(hdr) -
+                            sizeof(uint64_t) * (pdf->n_pages + 1);
+    if (pos != -1 && fseek(fp, sizeof(hdr), SEEK_SET) == 0 &&
+        fwrite(offsets, sizeof(uint64_t), pdf->n_pages + 1, fp) ==
+        pdf->n_pages + 1 && !ferror(fp))
+      ret = PDF_OK;
+    if (fclose(fp) != 0)
+      ret = PDF_ERR;
+
+    if (ret == PDF_OK && rename(tmp_name, name) != 0)
+      ret = PDF_ERR;
+    if (ret != PDF_OK)
+      remove(tmp_name);
+
+    free(name);
+    free(tmp_name);
+    free(offsets);
+    return ret;
+}
+
+
+/* Whether the pdf 'fname' (of size 'len') has the hash 'hash' */
+static _Bool same_contents(const char *fname, size_t len, uint64_t hash)
+{
+    int fd;
+    void *data;
+    _Bool same;
+
+    if (len == 0)
+      return hash == hash_data(NULL, 0);
+    if ((fd = open(fname, O_RDONLY)) == -1)
+      return false;
+    data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+      return false;
+
+    same = (hash_data(data, len) == hash);
+    munmap(data, len);
+    return same;
+}
+
+
+pdf_sidecar_t *pdf_sidecar_open(const char *fname)
+{
+    int fd;
+    uint32_t pg;
+    char *name;
+    struct stat src, st;
+    pdf_sidecar_t *sc;
+    const sidecar_header_t *hdr;
+
+    if (stat(fname, &src) == -1 || !(name = sidecar_name(fname,
+                                                        PDF_SIDECAR_EXT)))
+      return NULL;
+    fd = open(name, O_RDONLY);
+    free(name);
+    if (fd == -1)
+      return NULL;
+
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(sidecar_header_t) ||
+        !(sc = calloc(1, sizeof(pdf_sidecar_t))))
+    {
+        close(fd);
+        return NULL;
+    }
+    sc->len = st.st_size;
+    sc->data = mmap(NULL, sc->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (sc->data == MAP_FAILED)
+    {
+        free(sc);
+        return NULL;
+    }
+
+    /* Is it a sidecar, and for the pdf as it is now? */
+    hdr = (const sidecar_header_t *)sc->data;
+    if (memcmp(hdr->magic, SIDECAR_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != SIDECAR_VERSION || hdr->endian != SIDECAR_ENDIAN ||
+        hdr->src_size != src.st_size || hdr->src_mtime != mtime_ns(&src) ||
+        sizeof(sidecar_header_t) + sizeof(uint64_t) * (hdr->n_pages + 1ULL) >
+        sc->len)
+      goto stale;
+
+    sc->n_pages = hdr->n_pages;
+    sc->offsets = (const uint64_t *)(sc->data + sizeof(sidecar_header_t));
+    sc->text = (const char *)(sc->offsets + sc->n_pages + 1);
+    for (pg=0; pg<hdr->n_pages; ++pg)
+      if (sc->offsets[pg] > sc->offsets[pg + 1])
+        goto stale;
+    if (sc->offsets[sc->n_pages] > sc->len - (sc->text - sc->data))
+      goto stale;
+
+    /* Last (it reads all of the pdf): Same size and time, but same data? */
+    if (!same_contents(fname, src.st_size, hdr->src_hash))
+      goto stale;
+
+    return sc;
+
+stale:
+    munmap((void *)sc->data, sc->len);
+    free(sc);
+    return NULL;
+}
+
+
+void pdf_sidecar_close(pdf_sidecar_t *sc)
+{
+    if (!sc)
+      return;
+    munmap((void *)sc->data, sc->len);
+    free(sc);
+}
+
+
+const char *pdf_sidecar_page(const pdf_sidecar_t *sc, int pg_num, size_t *len)
+{
+    if (pg_num < 1 || pg_num > sc->n_pages)
+      return NULL;
+    *len = sc->offsets[pg_num] - sc->offsets[pg_num - 1];
+    return sc->text + sc->offsets[pg_num - 1];
+}
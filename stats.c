@@ -0,0 +1,170 @@
+/******************************************************************************
+ * stats.c
+ *
+ * libnachopdf - A basic PDF text extraction library
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Counters and timers of a pdf opened with PDF_STATS.  Each thread counts
+ * into a block of its own (so counting takes no lock), and pdf_get_stats()
+ * adds the blocks up.  A thread finds its block of a pdf through the few it
+ * keeps at hand, looking in the pdf's list of blocks (under a lock) only the
+ * first time it uses the pdf, or after it has used a good many others.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* clock_gettime */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pdf.h"
+
+
+/* A thread's counters for one pdf */
+struct _stats_block_t
+{
+    pdf_stats_t            stats;
+    pthread_t              owner;
+    struct _stats_block_t *next;
+};
+
+
+/* The blocks a thread used last, by pdf (pdf_t.stats_id, which, unlike the
+ * pdf's address, is never used again once the pdf is gone)
+ */
+#define N_RECENT 8
+typedef struct
+{
+    unsigned long  ids[N_RECENT];
+    pdf_stats_t   *stats[N_RECENT];
+    int            next;
+} recent_t;
+
+static pthread_key_t recent_key;
+static pthread_once_t recent_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long last_id;
+
+static void recent_init(void)
+{
+    pthread_key_create(&recent_key, free);
+}
+
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void stats_init(pdf_t *pdf)
+{
+    pthread_mutex_init(&pdf->stats_lock, NULL);
+    pthread_mutex_lock(&id_lock);
+    pdf->stats_id = ++last_id;
+    pthread_mutex_unlock(&id_lock);
+}
+
+
+void stats_free(pdf_t *pdf)
+{
+    stats_block_t *b, *next;
+
+    for (b=pdf->stats; b; b=next)
+    {
+        next = b->next;
+        free(b);
+    }
+    pdf->stats = NULL;
+    pthread_mutex_destroy(&pdf->stats_lock);
+}
+
+
+pdf_stats_t *stats_local(const pdf_t *pdf)
+{
+    int i;
+    pthread_t self;
+    recent_t *recent;
+    stats_block_t *b;
+
+    pthread_once(&recent_once, recent_init);
+    if (!(recent = pthread_getspecific(recent_key)))
+    {
+        if (!(recent = calloc(1, sizeof(recent_t))))
+          return NULL;
+        pthread_setspecific(recent_key, recent);
+    }
+
+    for (i=0; i<N_RECENT; ++i)
+      if (recent->ids[i] == pdf->stats_id)
+        return recent->stats[i];
+
+    /* This thread's block, if it has one already */
+    self = pthread_self();
+    pthread_mutex_lock((pthread_mutex_t *)&pdf->stats_lock);
+    for (b=pdf->stats; b && !pthread_equal(b->owner, self); b=b->next)
+      ;
+    if (!b && (b = calloc(1, sizeof(stats_block_t))))
+    {
+        b->owner = self;
+        b->next = pdf->stats;
+        ((pdf_t *)pdf)->stats = b;
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)&pdf->stats_lock);
+    if (!b)
+      return NULL;
+
+    recent->ids[recent->next] = pdf->stats_id;
+    recent->stats[recent->next] = &b->stats;
+    recent->next = (recent->next + 1) % N_RECENT;
+    return &b->stats;
+}
+
+
+int pdf_get_stats(const pdf_t *pdf, pdf_stats_t *stats)
+{
+    const stats_block_t *b;
+
+    if (!(pdf->flags & PDF_STATS))
+      return PDF_ERR;
+
+    memset(stats, 0, sizeof(pdf_stats_t));
+    pthread_mutex_lock((pthread_mutex_t *)&pdf->stats_lock);
+    for (b=pdf->stats; b; b=b->next)
+      pdf_add_stats(stats, &b->stats);
+    pthread_mutex_unlock((pthread_mutex_t *)&pdf->stats_lock);
+
+    return PDF_OK;
+}
+
+
+void pdf_add_stats(pdf_stats_t *sum, const pdf_stats_t *stats)
+{
+    sum->objects_resolved += stats->objects_resolved;
+    sum->bytes_scanned += stats->bytes_scanned;
+    sum->bytes_compressed += stats->bytes_compressed;
+    sum->bytes_inflated += stats->bytes_inflated;
+    sum->ps_runs += stats->ps_runs;
+    sum->ps_bytes += stats->ps_bytes;
+    sum->callbacks += stats->callbacks;
+    sum->open_ns += stats->open_ns;
+    sum->xref_ns += stats->xref_ns;
+    sum->page_tree_ns += stats->page_tree_ns;
+    sum->decode_ns += stats->decode_ns;
+}
@@ -0,0 +1,248 @@
+/******************************************************************************
+ * trace.c
+ *
+ * libnachopdf - A basic PDF text extraction library
+ *
+ * Copyright (C) 2013, Matt Davis (enferex)
+ *
+ * This file is part of libnachopdf.
+ * libnachopdf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libnachopdf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libnachopdf.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Tracing: While on, the library records a span (what, when, for how long,
+ * on which thread, for which page and object) for each part of the work, and
+ * pdf_trace_write() saves them in the Chrome trace event format, for
+ * chrome://tracing, Perfetto and the like.
+ *
+ * Each thread records into a buffer of its own, a list of fixed size chunks
+ * that are never moved, so recording takes no lock and does not copy what
+ * was recorded before.  A thread takes the lock once, to add its buffer to
+ * the list of them when it first records something.  Buffers are only read
+ * (and freed) by pdf_trace_write(), once nothing is being recorded.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pdf.h"
+
+
+/* One span: [start, end) in nanoseconds */
+typedef struct
+{
+    const char *name;
+    uint64_t    start, end;
+    int         page;
+    long        obj;
+} span_t;
+
+
+#define SPANS_PER_CHUNK 4096
+typedef struct _chunk_t
+{
+    span_t           spans[SPANS_PER_CHUNK];
+    int              n_spans;
+    struct _chunk_t *next;
+} chunk_t;
+
+
+/* A thread's spans (newest chunk first) */
+typedef struct _trace_buf_t
+{
+    int                  tid;
+    int                  page;    /* Page the thread is decoding */
+    chunk_t             *chunks;
+    struct _trace_buf_t *next;
+} trace_buf_t;
+
+
+/* What a thread keeps of its buffer: It is the thread's buffer only while
+ * 'gen' is the tracing's generation, as a buffer is freed when it is written
+ * out and tracing can then start over.
+ */
+typedef struct
+{
+    unsigned     gen;
+    trace_buf_t *buf;
+} trace_local_t;
+
+
+int trace_on;
+static unsigned trace_gen;
+static uint64_t trace_start;
+static trace_buf_t *bufs;
+static int n_bufs;
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t local_key;
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+
+static void local_init(void)
+{
+    pthread_key_create(&local_key, free);
+}
+
+
+/* This thread's buffer, NULL if out of memory */
+static trace_buf_t *get_buf(void)
+{
+    trace_local_t *local;
+    trace_buf_t *buf;
+
+    if (!(local = pthread_getspecific(local_key)))
+    {
+        if (!(local = calloc(1, sizeof(trace_local_t))))
+          return NULL;
+        pthread_setspecific(local_key, local);
+    }
+    if (local->buf && local->gen == trace_gen)
+      return local->buf;
+
+    if (!(buf = calloc(1, sizeof(trace_buf_t))))
+      return NULL;
+    pthread_mutex_lock(&bufs_lock);
+    buf->tid = ++n_bufs;
+    buf->next = bufs;
+    bufs = buf;
+    pthread_mutex_unlock(&bufs_lock);
+
+    local->gen = trace_gen;
+    local->buf = buf;
+    return buf;
+}
+
+
+void trace_span(const char *name, uint64_t start, long obj)
+{
+    chunk_t *chunk;
+    trace_buf_t *buf;
+    span_t *span;
+    uint64_t end = stats_now();
+
+    if (!(buf = get_buf()))
+      return;
+    if (!(chunk = buf->chunks) || chunk->n_spans == SPANS_PER_CHUNK)
+    {
+        if (!(chunk = malloc(sizeof(chunk_t))))
+          return;
+        chunk->n_spans = 0;
+        chunk->next = buf->chunks;
+        buf->chunks = chunk;
+    }
+
+    span = &chunk->spans[chunk->n_spans++];
+    span->name = name;
+    span->start = start;
+    span->end = end;
+    span->page = buf->page;
+    span->obj = obj;
+}
+
+
+void trace_page(int pg_num)
+{
+    trace_buf_t *buf;
+
+    if ((buf = get_buf()))
+      buf->page = pg_num;
+}
+
+
+int pdf_trace_start(void)
+{
+    pthread_once(&local_once, local_init);
+    if (trace_on)
+      return PDF_ERR;
+    ++trace_gen;
+    trace_start = stats_now();
+    trace_on = 1;
+    return PDF_OK;
+}
+
+
+/* The spans of a chunk, oldest first */
+static void write_chunk(FILE *fp, const trace_buf_t *buf, const chunk_t *chunk,
+                        _Bool *first)
+{
+    int i;
+    const span_t *s;
+
+    if (chunk->next)
+      write_chunk(fp, buf, chunk->next, first);
+
+    for (i=0; i<chunk->n_spans; ++i)
+    {
+        s = &chunk->spans[i];
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"pdf\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{",
+                *first ? "" : ",", s->name,
+                (s->start - trace_start) / 1e3, (s->end - s->start) / 1e3,
+                buf->tid);
+        if (s->page)
+          fprintf(fp, "\"page\":%d%s", s->page, (s->obj >= 0) ? "," : "");
+        if (s->obj >= 0)
+          fprintf(fp, "\"obj\":%ld", s->obj);
+        fprintf(fp, "}}");
+        *first = 0;
+    }
+}
+
+
+int pdf_trace_write(const char *fname)
+{
+    int ret = PDF_OK;
+    _Bool first = 1;
+    FILE *fp;
+    chunk_t *chunk, *next_chunk;
+    trace_buf_t *buf, *next_buf;
+
+    if (!trace_on)
+      return PDF_ERR;
+    trace_on = 0;
+
+    if (!(fp = fopen(fname, "w")))
+      ret = PDF_ERR;
+    else
+    {
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+        for (buf=bufs; buf; buf=buf->next)
+        {
+            fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                    "\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                    first ? "" : ",", buf->tid, buf->tid);
+            first = 0;
+        }
+        for (buf=bufs; buf; buf=buf->next)
+          if (buf->chunks)
+            write_chunk(fp, buf, buf->chunks, &first);
+        fprintf(fp, "\n]}\n");
+        if (fclose(fp) != 0)
+          ret = PDF_ERR;
+    }
+
+    /* Start over next time */
+    for (buf=bufs; buf; buf=next_buf)
+    {
+        next_buf = buf->next;
+        for (chunk=buf->chunks; chunk; chunk=next_chunk)
+        {
+            next_chunk = chunk->next;
+            free(chunk);
+        }
+        free(buf);
+    }
+    bufs = NULL;
+    n_bufs = 0;
+
+    return ret;
+}